@@ -0,0 +1,230 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+//Storage for Matrix and Vector elements: 64-byte aligned blocks (one cache line, one AVX-512 register) from a per-thread pool.
+//Block sizes are rounded up to a power of two. Freed blocks go to a free list of their size class in the freeing thread's pool
+//and are handed out again by the next allocation of that class, so once a training/inference loop has run one step
+//its temporaries no longer reach the system allocator.
+namespace linalg
+{
+    namespace memory
+    {
+        constexpr size_t ALIGNMENT = 64;
+        constexpr int MIN_CLASS = 6; //smallest block: 2^6 = 64 bytes
+        constexpr int NUM_CLASSES = 40;
+        constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+        constexpr size_t MAX_CACHED_BYTES = size_t(512) << 20; //per thread, blocks freed beyond this go back to the system
+
+        //Request transparent huge pages for blocks of at least 2 MB (large weight matrices). Linux only, off by default.
+        inline bool& hugePages()
+        {
+            static bool enabled = false;
+            return enabled;
+        }
+
+        inline int sizeClass(size_t bytes)
+        {
+            int c = MIN_CLASS;
+            while (((size_t)1 << c) < bytes) c++;
+            return c;
+        }
+
+        inline void* systemAlloc(size_t bytes)
+        {
+            size_t align = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : ALIGNMENT;
+#ifdef _MSC_VER
+            void* p = _aligned_malloc(bytes, align);
+#else
+            void* p = std::aligned_alloc(align, bytes);
+#endif
+            if (p == nullptr) throw std::bad_alloc();
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+            if (hugePages() && bytes >= HUGE_PAGE_SIZE) madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+            return p;
+        }
+
+        inline void systemFree(void* p)
+        {
+#ifdef _MSC_VER
+            _aligned_free(p);
+#else
+            std::free(p);
+#endif
+        }
+
+        //Free lists of one thread, one per size class.
+        class Pool
+        {
+        public:
+            std::vector<void*> freeLists[NUM_CLASSES];
+            size_t cachedBytes = 0;
+            size_t systemAllocs = 0; //number of blocks that had to come from the system allocator
+        public:
+            ~Pool()
+            {
+                for (int c = 0; c < NUM_CLASSES; c++) {
+                    for (void* p : freeLists[c]) systemFree(p);
+                }
+            }
+
+            void* allocate(size_t bytes)
+            {
+                int c = sizeClass(bytes);
+                if (c < NUM_CLASSES && !freeLists[c].empty()) {
+                    void* p = freeLists[c].back();
+                    freeLists[c].pop_back();
+                    cachedBytes -= (size_t)1 << c;
+                    return p;
+                }
+                systemAllocs++;
+                return systemAlloc((size_t)1 << c);
+            }
+
+            void deallocate(void* p, size_t bytes)
+            {
+                int c = sizeClass(bytes);
+                if (c >= NUM_CLASSES || cachedBytes + ((size_t)1 << c) > MAX_CACHED_BYTES) {
+                    systemFree(p);
+                    return;
+                }
+                freeLists[c].push_back(p);
+                cachedBytes += (size_t)1 << c;
+            }
+        };
+
+        //The pool of the calling thread, or NULL once the thread is shutting down (then blocks go straight to/from the system).
+        //The pointer itself is trivially destructible, so it stays readable for objects destroyed after the pool.
+        inline Pool*& threadPoolPtr()
+        {
+            thread_local Pool* pool = nullptr;
+            return pool;
+        }
+        inline Pool* threadPool()
+        {
+            struct Owner
+            {
+                Owner() { threadPoolPtr() = new Pool; }
+                ~Owner()
+                {
+                    delete threadPoolPtr();
+                    threadPoolPtr() = nullptr;
+                }
+            };
+            thread_local Owner owner;
+            return threadPoolPtr();
+        }
+
+        inline void* allocate(size_t bytes)
+        {
+            Pool* pool = threadPool();
+            if (pool == nullptr) return systemAlloc((size_t)1 << sizeClass(bytes));
+            return pool->allocate(bytes);
+        }
+        inline void deallocate(void* p, size_t bytes)
+        {
+            Pool* pool = threadPoolPtr();
+            if (pool == nullptr) systemFree(p);
+            else pool->deallocate(p, bytes);
+        }
+
+        //std::allocator replacement that takes its blocks from the pool of the calling thread
+        template <class T>
+        class PoolAllocator
+        {
+        public:
+            typedef T value_type;
+            typedef std::true_type is_always_equal;
+            typedef std::true_type propagate_on_container_move_assignment;
+        public:
+            PoolAllocator() {}
+            template <class U>
+            PoolAllocator(const PoolAllocator<U>&) {}
+
+            T* allocate(size_t n)
+            {
+                if (n == 0) return nullptr;
+                return (T*)memory::allocate(n * sizeof(T));
+            }
+            void deallocate(T* p, size_t n)
+            {
+                if (p != nullptr) memory::deallocate(p, n * sizeof(T));
+            }
+
+            template <class U>
+            bool operator == (const PoolAllocator<U>&) const { return true; }
+            template <class U>
+            bool operator != (const PoolAllocator<U>&) const { return false; }
+        };
+
+        //Bump allocator for memory that lives for one step, e.g. the nodes and buffers of an autograd tape (autograd.h).
+        //alloc() hands out the next 64-byte aligned piece of the current block, reset() frees everything at once in O(1) by
+        //starting over at the first block. Blocks are kept across resets, so once a step has run, the next ones allocate nothing.
+        //Not thread-safe: one arena per thread.
+        class Arena
+        {
+            struct block
+            {
+                char* data;
+                size_t size;
+            };
+            std::vector<block> blocks;
+            size_t current = 0; //the block alloc() takes from
+            size_t used = 0; //bytes taken from it
+            size_t blockSize;
+        public:
+            //IN: size of the blocks taken from the system (rounded up to a power of two; larger requests get a block of their own)
+            explicit Arena(size_t blockSize_ = size_t(1) << 20) : blockSize(blockSize_) {}
+            ~Arena()
+            {
+                for (block& b : blocks) systemFree(b.data);
+            }
+            Arena(const Arena&) = delete;
+            Arena& operator = (const Arena&) = delete;
+
+            void* alloc(size_t bytes)
+            {
+                bytes = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+                while (current < blocks.size() && used + bytes > blocks[current].size) {
+                    current++;
+                    used = 0;
+                }
+                if (current == blocks.size()) {
+                    size_t size = (size_t)1 << sizeClass(bytes > blockSize ? bytes : blockSize);
+                    blocks.push_back({ (char*)systemAlloc(size), size });
+                    used = 0;
+                }
+                void* p = blocks[current].data + used;
+                used += bytes;
+                return p;
+            }
+            template <class T>
+            T* alloc(size_t n) { return (T*)alloc(n * sizeof(T)); }
+
+            void reset()
+            {
+                current = 0;
+                used = 0;
+            }
+
+            //bytes held from the system
+            size_t capacity() const
+            {
+                size_t bytes = 0;
+                for (const block& b : blocks) { bytes += b.size; }
+                return bytes;
+            }
+        };
+    }
+
+    //The element storage of Matrix and Vector
+    template <class T>
+    using storage = std::vector<T, memory::PoolAllocator<T>>;
+}
@@ -0,0 +1,409 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <new>
+#include "linalg.h"
+#include "func.h"
+
+//Reverse-mode automatic differentiation: operations on matrices are recorded on a Tape while they compute their values,
+//Tape::backward() then runs the recorded operations in reverse and adds the gradients to the leaves created with param().
+//Everything a step records, the nodes and the values and gradients they point to, comes from the tape's arena, which reset()
+//empties in O(1), so once a step has run, the following ones allocate nothing. During backward(), the gradient of a node is freed
+//as soon as its operation has passed it on to its inputs, and reused for the next gradient of that size; an operation whose input
+//has no gradient yet hands its own gradient buffer over instead of copying it. The peak memory of backward is therefore about
+//the widest layer's gradient, not the sum over the tape.
+//A new layer only needs its forward pass recorded from these operations (ILayer::forward(Tape&, Var)), its backward follows.
+namespace autograd
+{
+    namespace lin = linalg;
+    typedef lin::Vector<float> Vectorf;
+    typedef lin::Matrix<float> Matrixf;
+
+    class Tape;
+
+    //A value recorded on a tape: rows*cols floats (one sample per row), its gradient and how to pass the gradient on.
+    struct Node
+    {
+        int rows, cols;
+        const float* value;
+        float* grad = nullptr; //nullptr until a gradient reaches the node
+        size_t gradCap = 0; //floats in the gradient buffer, to reuse it once freed
+        bool requiresGrad = false; //some leaf below the node is a parameter
+        bool externalGrad = false; //grad is owned by someone else (the gradient sum of a parameter) and accumulated into
+        Node* in[3] = { nullptr, nullptr, nullptr }; //the operands
+        void* ctx = nullptr; //what the operation needs besides its operands, e.g. the activation
+        const float* labels = nullptr; //an input that isn't differentiated, e.g. the labels of a loss
+        float* aux = nullptr; //a buffer of the operation, e.g. the weighted sums before the activation
+        int flags = 0; //per-operation flags, e.g. transposes
+        void (*backwardFn)(Tape&, Node&) = nullptr; //nullptr for leaves
+        Node* prev = nullptr; //the node recorded before this one
+
+        size_t size() const { return (size_t)rows * cols; }
+        lin::MatrixView<const float> view() const { return lin::MatrixView<const float>(value, rows, cols); }
+    };
+
+    //Handle of a node, valid until the tape is reset.
+    struct Var
+    {
+        Node* node = nullptr;
+
+        Var() {}
+        Var(Node* n) : node(n) {}
+        explicit operator bool() const { return node != nullptr; }
+        int rows() const { return node->rows; }
+        int cols() const { return node->cols; }
+        lin::MatrixView<const float> value() const { return node->view(); }
+        //the gradient after backward(), for leaves (input() with requiresGrad, param()); intermediate gradients are freed on the way
+        lin::MatrixView<const float> grad() const { return lin::MatrixView<const float>(node->grad, node->rows, node->cols); }
+    };
+
+    class Tape
+    {
+    protected:
+        //a freed gradient buffer, the list is kept in the buffers themselves
+        struct freeBuffer
+        {
+            size_t cap;
+            freeBuffer* next;
+        };
+        lin::memory::Arena arena;
+        Node* last = nullptr;
+        freeBuffer* freeBuffers = nullptr;
+        size_t nodes = 0;
+    public:
+        //IN: size of the arena's blocks
+        explicit Tape(size_t blockBytes = size_t(1) << 20) : arena(blockBytes) {}
+        Tape(const Tape&) = delete;
+        Tape& operator = (const Tape&) = delete;
+
+        //Forget everything recorded, in O(1). All Vars of the tape become invalid.
+        void reset()
+        {
+            arena.reset();
+            last = nullptr;
+            freeBuffers = nullptr;
+            nodes = 0;
+        }
+        size_t numNodes() const { return nodes; }
+        size_t arenaBytes() const { return arena.capacity(); }
+
+        //A constant leaf over the elements of x, which aren't copied and must stay unchanged until backward() is done.
+        //IN: values, whether to compute the gradient w.r.t them (readable with Var::grad() after backward())
+        Var input(lin::MatrixView<const float> x, bool requiresGrad = false)
+        {
+            assert(x.colStride == 1 && x.rowStride == x.cols);
+            Node* n = record(x.rows, x.cols, nullptr);
+            n->value = x.data;
+            n->requiresGrad = requiresGrad;
+            return n;
+        }
+        Var input(const Matrixf& x, bool requiresGrad = false) { return input(x.view(), requiresGrad); }
+
+        //A trainable leaf: backward() adds the gradient w.r.t w to gradSum, which must have the shape of w.
+        Var param(lin::MatrixView<const float> w, float* gradSum)
+        {
+            Var v = input(w, true);
+            v.node->grad = gradSum;
+            v.node->externalGrad = true;
+            return v;
+        }
+        Var param(const Matrixf& w, Matrixf& gradSum) { return param(w.view(), gradSum.nums.data()); }
+        //a vector (e.g. biases) as a 1*n parameter
+        Var param(const Vectorf& b, Vectorf& gradSum) { return param(lin::MatrixView<const float>(b.nums.data(), 1, b.size()), gradSum.nums.data()); }
+
+        //op(a) * op(b), where op(X) is X or X^T as selected by transA and transB
+        Var matmul(Var a, Var b, lin::transType transA = lin::noTrans, lin::transType transB = lin::noTrans)
+        {
+            lin::MatrixView<const float> av = opView(a, transA), bv = opView(b, transB);
+            assert(av.cols == bv.rows);
+            Node* n = record(av.rows, bv.cols, matmulBackward, a, b);
+            n->flags = (transA == lin::trans) | (transB == lin::trans) << 1;
+            float* out = values(*n);
+            lin::gemm(lin::noTrans, lin::noTrans, 1.f, av, bv, 0.f, lin::MatrixView<float>(out, n->rows, n->cols));
+            return n;
+        }
+
+        //a + b, where b has the shape of a or is one row that is added to every row of a (e.g. biases)
+        Var add(Var a, Var b)
+        {
+            assert(b.cols() == a.cols() && (b.rows() == a.rows() || b.rows() == 1));
+            Node* n = record(a.rows(), a.cols(), addBackward, a, b);
+            float* out = values(*n);
+            for (int r = 0; r < n->rows; r++) {
+                size_t at = (size_t)r * n->cols;
+                lin::kernels::add(n->cols, a.node->value + at, b.node->value + (b.rows() == 1 ? 0 : at), out + at);
+            }
+            return n;
+        }
+
+        //the elementwise product of a and b
+        Var mul(Var a, Var b)
+        {
+            assert(a.rows() == b.rows() && a.cols() == b.cols());
+            Node* n = record(a.rows(), a.cols(), mulBackward, a, b);
+            float* out = values(*n);
+            for (size_t i = 0; i < n->size(); i++) { out[i] = a.node->value[i] * b.node->value[i]; }
+            return n;
+        }
+
+        //f applied to x elementwise (or per row, softMax); f must outlive the tape's step
+        Var act(Var x, func::AActFunction& f)
+        {
+            Node* n = record(x.rows(), x.cols(), actBackward, x);
+            n->ctx = &f;
+            f.forward(n->rows, n->cols, x.node->value, values(*n));
+            return n;
+        }
+
+        //The layer f(x * w^T + b) in one operation, b may be an empty Var. The weighted sums are one GEMM, the bias and f are
+        //applied by its epilogue to each finished block (elementwise f); backward computes the three gradients from the sums.
+        //IN: inputs (batch*in), weights (out*in), biases (1*out) or Var(), activation (must outlive the tape's step)
+        Var dense(Var x, Var w, Var b, func::AActFunction& f)
+        {
+            assert(x.cols() == w.cols() && (!b || (b.rows() == 1 && b.cols() == w.rows())));
+            Node* n = record(x.rows(), w.rows(), denseBackward, x, w, b);
+            n->ctx = &f;
+            int cols = n->cols;
+            float* out = values(*n);
+            n->aux = arena.alloc<float>(n->size());
+            lin::MatrixView<float> sums(n->aux, n->rows, cols);
+            const float* bias = b ? b.node->value : nullptr;
+            //sums = x * w^T + b, out = f(sums)
+            auto finish = [&](int i0, int j0, int rows, int c) {
+                for (int r = i0; r < i0 + rows; r++) {
+                    if (bias) lin::kernels::add(c, &sums(r, j0), bias + j0, &sums(r, j0));
+                }
+                f.forwardBias(rows, c, &sums(i0, j0), cols, nullptr, out + (size_t)i0 * cols + j0, cols);
+            };
+            if (f.elementwise()) lin::gemm(lin::noTrans, lin::trans, 1.f, x.value(), w.value(), 0.f, sums, finish);
+            else {
+                lin::gemm(lin::noTrans, lin::trans, 1.f, x.value(), w.value(), 0.f, sums);
+                finish(0, 0, n->rows, cols);
+            }
+            return n;
+        }
+
+        //The loss of out against labels, summed over the batch, as a 1*1 value (f and labels must outlive the tape's step).
+        Var loss(Var out, const Matrixf& labels, func::ALossFunction& f)
+        {
+            assert(labels.rows == out.rows() && labels.cols == out.cols());
+            Node* n = record(1, 1, lossBackward, out);
+            n->ctx = &f;
+            n->labels = labels.nums.data();
+            values(*n)[0] = f.lossSum(out.rows(), out.cols(), out.node->value, labels.nums.data());
+            return n;
+        }
+
+        //Run the tape backward from root, seeded with a gradient of ones (for a 1*1 loss: d loss/d loss = 1).
+        //The gradients of the param() leaves are added to their gradient sums, the ones of input() leaves with requiresGrad
+        //can be read with Var::grad() until reset(). Call once per recording.
+        void backward(Var root)
+        {
+            Node& r = *root.node;
+            if (!r.requiresGrad) return;
+            float beta;
+            float* g = gradFor(r, beta);
+            for (size_t i = 0; i < r.size(); i++) { g[i] = beta == 0 ? 1 : g[i] + 1; }
+            for (Node* n = &r; n; n = n->prev) {
+                if (n->grad == nullptr || n->backwardFn == nullptr) continue;
+                n->backwardFn(*this, *n);
+                release(*n);
+            }
+        }
+
+    protected:
+        Node* record(int rows, int cols, void (*backwardFn)(Tape&, Node&), Var a = Var(), Var b = Var(), Var c = Var())
+        {
+            Node* n = new (arena.alloc(sizeof(Node))) Node();
+            n->rows = rows;
+            n->cols = cols;
+            n->backwardFn = backwardFn;
+            Var ins[3] = { a, b, c };
+            for (int i = 0; i < 3; i++) {
+                n->in[i] = ins[i].node;
+                if (ins[i] && ins[i].node->requiresGrad) n->requiresGrad = true;
+            }
+            n->prev = last;
+            last = n;
+            nodes++;
+            return n;
+        }
+        float* values(Node& n)
+        {
+            float* v = arena.alloc<float>(n.size());
+            n.value = v;
+            return v;
+        }
+        static lin::MatrixView<const float> opView(Var v, lin::transType t)
+        {
+            return t == lin::trans ? v.value().transposed() : v.value();
+        }
+
+        //A buffer for n floats: a freed gradient that is large enough, else a new piece of the arena.
+        float* allocGrad(size_t n, size_t& cap)
+        {
+            for (freeBuffer** f = &freeBuffers; *f; f = &(*f)->next) {
+                if ((*f)->cap >= n) {
+                    freeBuffer* b = *f;
+                    *f = b->next;
+                    cap = b->cap;
+                    return (float*)b;
+                }
+            }
+            cap = std::max(n, sizeof(freeBuffer) / sizeof(float));
+            return arena.alloc<float>(cap);
+        }
+        void freeGrad(float* g, size_t cap)
+        {
+            freeBuffer* b = (freeBuffer*)g;
+            b->cap = cap;
+            b->next = freeBuffers;
+            freeBuffers = b;
+        }
+        //free the gradient of n once it has been passed on
+        void release(Node& n)
+        {
+            if (n.grad && !n.externalGrad) freeGrad(n.grad, n.gradCap);
+            n.grad = nullptr;
+        }
+
+        //The gradient buffer of n to add to, and with what beta: 1 if it holds a gradient already, 0 if it was just allocated.
+        float* gradFor(Node& n, float& beta)
+        {
+            beta = 1;
+            if (n.grad == nullptr) {
+                n.grad = allocGrad(n.size(), n.gradCap);
+                beta = 0;
+            }
+            return n.grad;
+        }
+        //to.grad += g (to must need a gradient)
+        void accumulate(Node& to, const float* g)
+        {
+            float beta;
+            float* dst = gradFor(to, beta);
+            if (beta == 0) std::copy(g, g + to.size(), dst);
+            else lin::kernels::add((int)to.size(), dst, g, dst);
+        }
+        //Pass the gradient of from on to to, which has the same size: from's buffer is handed over if to has none yet.
+        void passOn(Node& to, Node& from)
+        {
+            if (to.grad == nullptr) {
+                to.grad = from.grad;
+                to.gradCap = from.gradCap;
+                from.grad = nullptr;
+            }
+            else accumulate(to, from.grad);
+        }
+        static bool needsGrad(const Node* n) { return n && n->requiresGrad; }
+
+        static void matmulBackward(Tape& t, Node& n)
+        {
+            Node& a = *n.in[0];
+            Node& b = *n.in[1];
+            bool transA = n.flags & 1, transB = n.flags & 2;
+            lin::MatrixView<const float> g(n.grad, n.rows, n.cols);
+            lin::MatrixView<const float> av = opView(&a, transA ? lin::trans : lin::noTrans), bv = opView(&b, transB ? lin::trans : lin::noTrans);
+            float beta;
+            if (a.requiresGrad) {
+                lin::MatrixView<float> da(t.gradFor(a, beta), a.rows, a.cols);
+                //d op(A) = G * op(B)^T
+                if (!transA) lin::gemm(lin::noTrans, lin::trans, 1.f, g, bv, beta, da);
+                else lin::gemm(lin::noTrans, lin::trans, 1.f, bv, g, beta, da);
+            }
+            if (b.requiresGrad) {
+                lin::MatrixView<float> db(t.gradFor(b, beta), b.rows, b.cols);
+                //d op(B) = op(A)^T * G
+                if (!transB) lin::gemm(lin::trans, lin::noTrans, 1.f, av, g, beta, db);
+                else lin::gemm(lin::trans, lin::noTrans, 1.f, g, av, beta, db);
+            }
+        }
+        static void addBackward(Tape& t, Node& n)
+        {
+            Node& a = *n.in[0];
+            Node& b = *n.in[1];
+            if (b.requiresGrad) {
+                if (b.rows == n.rows) t.accumulate(b, n.grad);
+                else {
+                    //a broadcast row gets the sum over the rows
+                    float beta;
+                    float* db = t.gradFor(b, beta);
+                    for (int j = 0; j < n.cols; j++) {
+                        float s = 0;
+                        for (int r = 0; r < n.rows; r++) { s += n.grad[(size_t)r * n.cols + j]; }
+                        db[j] = beta == 0 ? s : db[j] + s;
+                    }
+                }
+            }
+            if (a.requiresGrad) t.passOn(a, n);
+        }
+        static void mulBackward(Tape& t, Node& n)
+        {
+            Node& a = *n.in[0];
+            Node& b = *n.in[1];
+            float beta;
+            if (a.requiresGrad) {
+                float* da = t.gradFor(a, beta);
+                for (size_t i = 0; i < n.size(); i++) { da[i] = (beta == 0 ? 0 : da[i]) + n.grad[i] * b.value[i]; }
+            }
+            if (b.requiresGrad) {
+                float* db = t.gradFor(b, beta);
+                for (size_t i = 0; i < n.size(); i++) { db[i] = (beta == 0 ? 0 : db[i]) + n.grad[i] * a.value[i]; }
+            }
+        }
+        static void actBackward(Tape& t, Node& n)
+        {
+            Node& x = *n.in[0];
+            if (!x.requiresGrad) return;
+            func::AActFunction& f = *(func::AActFunction*)n.ctx;
+            f.backward(n.rows, n.cols, x.value, n.grad, n.grad); //in place, the gradient is freed afterwards anyway
+            t.passOn(x, n);
+        }
+        static void denseBackward(Tape& t, Node& n)
+        {
+            Node& x = *n.in[0];
+            Node& w = *n.in[1];
+            Node* b = n.in[2];
+            func::AActFunction& f = *(func::AActFunction*)n.ctx;
+            //the gradient w.r.t the sums, in place
+            f.backward(n.rows, n.cols, n.aux, n.grad, n.grad);
+            lin::MatrixView<const float> sumGrad(n.grad, n.rows, n.cols);
+            float beta;
+            if (needsGrad(b)) {
+                float* db = t.gradFor(*b, beta);
+                if (beta == 0) std::fill(db, db + n.cols, 0.f);
+                for (int r = 0; r < n.rows; r++) { lin::kernels::add(n.cols, db, n.grad + (size_t)r * n.cols, db); }
+            }
+            if (w.requiresGrad) {
+                //dW = sumGrad^T * x
+                lin::MatrixView<float> dw(t.gradFor(w, beta), w.rows, w.cols);
+                lin::gemm(lin::trans, lin::noTrans, 1.f, sumGrad, x.view(), beta, dw);
+            }
+            if (x.requiresGrad) {
+                //dX = sumGrad * W
+                lin::MatrixView<float> dx(t.gradFor(x, beta), x.rows, x.cols);
+                lin::gemm(lin::noTrans, lin::noTrans, 1.f, sumGrad, w.view(), beta, dx);
+            }
+        }
+        static void lossBackward(Tape& t, Node& n)
+        {
+            Node& out = *n.in[0];
+            if (!out.requiresGrad) return;
+            func::ALossFunction& f = *(func::ALossFunction*)n.ctx;
+            float seed = n.grad[0];
+            if (out.grad == nullptr) {
+                float* g = t.allocGrad(out.size(), out.gradCap);
+                f.gradient(out.rows, out.cols, out.value, n.labels, g);
+                if (seed != 1) lin::kernels::scale((int)out.size(), g, seed, g);
+                out.grad = g;
+            }
+            else {
+                size_t cap;
+                float* g = t.allocGrad(out.size(), cap);
+                f.gradient(out.rows, out.cols, out.value, n.labels, g);
+                lin::kernels::axpy((int)out.size(), seed, g, out.grad);
+                t.freeGrad(g, cap);
+            }
+        }
+    };
+}
@@ -0,0 +1,570 @@
+#pragma once
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "nnet.h"
+
+//Convolution and pooling layers. Images travel through a Network like any other vector: one sample per row of the batch,
+//channels*height*width (CHW) values flattened, e.g. a 28x28 MNIST image as 1*28*28 and the output of a Conv2D with 8 filters
+//as 8 planes of outHeight*outWidth. So they chain with each other and with Linear layers (which see the flattened planes).
+namespace nnet
+{
+    //Common part of the layers that work on CHW images: the shapes, and the single-sample forward()/backward() as batches of one.
+    class ASpatialLayer : public ILayer
+    {
+    public:
+        int inChannels, inHeight, inWidth;
+        int outChannels, outHeight, outWidth;
+    protected:
+        const Matrixf* lastIn = nullptr; //the inputs of the last batched forward(), read by backward()
+        Matrixf vecIn; //the input of the last single-sample forward(), as a batch of one
+    public:
+        using ILayer::forward;
+        using ILayer::backward;
+
+        Vectorf forward(Vectorf& inVec) override
+        {
+            vecIn = Matrixf(1, inSize, std::vector<float>(inVec.nums.begin(), inVec.nums.end()));
+            Matrixf& o = forward(vecIn);
+            outs = Vectorf(std::vector<float>(o.nums.begin(), o.nums.end()));
+            return outs;
+        }
+        Vectorf backward(Vectorf& outGrad) override
+        {
+            Matrixf g(1, outSize, std::vector<float>(outGrad.nums.begin(), outGrad.nums.end()));
+            Matrixf inGrad = backward(g);
+            return Vectorf(std::vector<float>(inGrad.nums.begin(), inGrad.nums.end()));
+        }
+    protected:
+        //IN: input channels, height, width, output channels, window size, stride, zero padding on each side
+        void setShapes(int channels, int height, int width, int outC, int kernel, int stride, int padding)
+        {
+            if (kernel <= 0 || stride <= 0 || padding < 0) {
+                throw std::runtime_error("bad window: size " + std::to_string(kernel) + ", stride " + std::to_string(stride) + ", padding " + std::to_string(padding));
+            }
+            if (kernel > height + 2 * padding || kernel > width + 2 * padding) {
+                throw std::runtime_error("a " + std::to_string(kernel) + "x" + std::to_string(kernel) + " window doesn't fit into a " + std::to_string(height) + "x"
+                    + std::to_string(width) + " image with padding " + std::to_string(padding));
+            }
+            inChannels = channels;
+            inHeight = height;
+            inWidth = width;
+            outChannels = outC;
+            outHeight = (height + 2 * padding - kernel) / stride + 1;
+            outWidth = (width + 2 * padding - kernel) / stride + 1;
+            inSize = channels * height * width;
+            outSize = outC * outHeight * outWidth;
+        }
+        int planeIn() const { return inHeight * inWidth; }
+        int planeOut() const { return outHeight * outWidth; }
+    };
+
+    //2D convolution: outs = act(conv(ins, filters) + biases) with outChannels filters of inChannels*kernel*kernel weights,
+    //one filter per row of weights, and one bias per output channel. Padding adds zeros around the image.
+    //The batched passes are lowered to GEMMs with im2col: the patches of all samples become the columns of one
+    //(inChannels*kernel*kernel)*(batch*outHeight*outWidth) matrix, so weights * patches are all outputs of the batch at once,
+    //and the bias and activation are applied by the GEMM's epilogue while writing the blocks into the samples' planes.
+    //backward() is two more GEMMs, weightsGradSum += sumGrad * patches^T and patchGrad = weights^T * sumGrad, and col2im adds the
+    //patch gradients back up into the image gradient.
+    //3x3 kernels with stride 1 (the common case) take a direct path if direct is set: each output plane is accumulated from nine
+    //shifted rows of every input plane with SIMD axpys, without building the nine times larger patch matrix.
+    class Conv2D : public ASpatialLayer
+    {
+    public:
+        int kernelSize, stride, padding;
+        Matrixf batchSums; //the (biased) weighted sums of the last batch, laid out like the outputs
+        Matrixf weightsGradSum; //the sum of multiple weight gradients (for SGD)
+        Vectorf biasesGradSum; //the sum of multiple bias gradients
+        bool bias = false; //use bias neuron
+        func::AActFunction* actFunc; //the activation function, elementwise
+        bool direct = true; //use the direct path for 3x3 kernels with stride 1
+    protected:
+        //weights, biases and gradient sums in the network's flat buffer (Network::flattenParams()) instead of the own matrices
+        float* boundWeights = nullptr;
+        float* boundBiases = nullptr;
+        float* boundWeightsGrad = nullptr;
+        float* boundBiasesGrad = nullptr;
+        lin::storage<float> patches; //im2col of the last batch, kept for backward()
+        lin::storage<float> scratch; //the GEMM result, then the weighted sum gradients, in channel-major order
+    public:
+        //IN: input channels, height, width, output channels (filters), kernel size, activation function, stride, zero padding,
+        //use biases, weight initialization function (called with outChannels, inChannels*kernel*kernel)
+        template <class T>
+        Conv2D(int channels, int height, int width, int filters, int kernel, T act, int stride_ = 1, int padding_ = 0, bool bias_ = true,
+            std::function<Matrixf(int, int)> weightInit = func::weightInit::heInitHalfStd)
+            : Conv2D(channels, height, width, filters, kernel, new T(act), stride_, padding_, bias_, weightInit) {}
+        template <class T>
+        Conv2D(int channels, int height, int width, int filters, int kernel, T* fptr, int stride_ = 1, int padding_ = 0, bool bias_ = true,
+            std::function<Matrixf(int, int)> weightInit = func::weightInit::heInitHalfStd)
+        {
+            actFunc = fptr;
+            if (!actFunc->elementwise()) {
+                delete actFunc;
+                throw std::runtime_error("Conv2D: the activation must be elementwise");
+            }
+            kernelSize = kernel;
+            stride = stride_;
+            padding = padding_;
+            bias = bias_;
+            try {
+                setShapes(channels, height, width, filters, kernel, stride, padding);
+            }
+            catch (...) {
+                delete actFunc;
+                throw;
+            }
+            if (weightInit != NULL) weights = weightInit(filters, patchRows());
+            else weights = Matrixf(filters, patchRows());
+            weightsGradSum = Matrixf(filters, patchRows(), lin::zeros);
+            biases = Vectorf(filters, lin::zeros);
+            biasesGradSum = Vectorf(filters, lin::zeros);
+            outs = Vectorf(outSize);
+        }
+        ~Conv2D()
+        {
+            delete actFunc;
+        }
+
+        using ASpatialLayer::forward;
+        using ASpatialLayer::backward;
+
+        std::pair<int, int> weightsShape() const override { return { outChannels, patchRows() }; }
+        void setWeights(const Matrixf& w) override
+        {
+            if (w.rows != outChannels || w.cols != patchRows()) throw std::runtime_error("Conv2D: the weights must be filters*(channels*kernel*kernel)");
+            if (boundWeights == nullptr) weights = w;
+            else std::copy(w.nums.begin(), w.nums.end(), boundWeights);
+        }
+        lin::MatrixView<const float> weightsView() const override
+        {
+            return boundWeights ? lin::MatrixView<const float>(boundWeights, outChannels, patchRows()) : weights.view();
+        }
+        lin::VectorView<const float> biasesView() const override
+        {
+            return boundBiases ? lin::VectorView<const float>(boundBiases, outChannels) : biases.view();
+        }
+        bool hasBias() const override { return bias; }
+        const func::AActFunction* activation() const override { return actFunc; }
+
+        //IN: the batch outputs of the previous layer (batch*channels*height*width)
+        //OUT: the batch outputs of this layer (batch*filters*outHeight*outWidth)
+        Matrixf& forward(Matrixf& inBatch) override
+        {
+            lastIn = &inBatch;
+            if (batchOuts.rows != inBatch.rows || batchOuts.cols != outSize) batchOuts = Matrixf(inBatch.rows, outSize);
+            if (batchSums.rows != inBatch.rows || batchSums.cols != outSize) batchSums = Matrixf(inBatch.rows, outSize);
+            forward(inBatch.rows, inBatch.nums.data(), batchSums.nums.data(), batchOuts.nums.data(), patches, scratch);
+            return batchOuts;
+        }
+
+        void predict(const Matrixf& inBatch, Matrixf& out) const override
+        {
+            if (out.rows != inBatch.rows || out.cols != outSize) out = Matrixf(inBatch.rows, outSize);
+            lin::storage<float> patchBuf, gemmBuf;
+            forward(inBatch.rows, inBatch.nums.data(), nullptr, out.nums.data(), patchBuf, gemmBuf);
+        }
+
+        //outGrad is overwritten with the gradient w.r.t the weighted sums.
+        //IN: gradient w.r.t the batch outputs
+        //OUT: gradient w.r.t the batch outputs of the previous layer
+        Matrixf backward(Matrixf& outGrad) override
+        {
+            int n = outGrad.rows;
+            float* sumGrad = outGrad.nums.data();
+            actFunc->backward(n, outSize, batchSums.nums.data(), sumGrad, sumGrad);
+            if (bias) {
+                for (int s = 0; s < n; s++) {
+                    for (int oc = 0; oc < outChannels; oc++) {
+                        biasesGradData()[oc] += lin::kernels::sum(planeOut(), sumGrad + (size_t)s * outSize + (size_t)oc * planeOut());
+                    }
+                }
+            }
+            Matrixf inGrad(n, inSize);
+            if (useDirect()) backwardDirect(n, lastIn->nums.data(), sumGrad, inGrad.nums.data());
+            else {
+                int cols = n * planeOut();
+                //the sum gradients in the channel-major order of the GEMM
+                scratch.resize((size_t)outChannels * cols);
+                lin::parallel::parallelFor(n * outChannels, 1, [&](int lo, int hi) {
+                    for (int t = lo; t < hi; t++) {
+                        int s = t / outChannels, oc = t % outChannels;
+                        const float* g = sumGrad + (size_t)s * outSize + (size_t)oc * planeOut();
+                        std::copy(g, g + planeOut(), scratch.data() + (size_t)oc * cols + (size_t)s * planeOut());
+                    }
+                });
+                lin::MatrixView<const float> g(scratch.data(), outChannels, cols);
+                lin::gemm(lin::noTrans, lin::trans, 1.f, g, lin::MatrixView<const float>(patches.data(), patchRows(), cols), 1.f,
+                    lin::MatrixView<float>(weightsGradData(), outChannels, patchRows()));
+                //the patches aren't needed anymore, their buffer takes the patch gradients
+                lin::gemm(lin::trans, lin::noTrans, 1.f, weightsView(), g, 0.f, lin::MatrixView<float>(patches.data(), patchRows(), cols));
+                col2im(n, patches.data(), inGrad.nums.data());
+            }
+            batchSize += n;
+            return inGrad;
+        }
+
+        void params(std::vector<param>& out) override
+        {
+            out.push_back({ weightsData(), weightsGradData(), (size_t)outChannels * patchRows() });
+            if (bias) out.push_back({ biasesData(), biasesGradData(), (size_t)outChannels });
+        }
+        bool canBindParams() override { return true; }
+        void bindParams(const std::vector<param>& to) override
+        {
+            boundWeights = to[0].value;
+            boundWeightsGrad = to[0].grad;
+            weights = Matrixf();
+            weightsGradSum = Matrixf();
+            if (bias) {
+                boundBiases = to[1].value;
+                boundBiasesGrad = to[1].grad;
+                biases = Vectorf();
+                biasesGradSum = Vectorf();
+            }
+        }
+        ILayer* clone() const override
+        {
+            Conv2D* l = new Conv2D(inChannels, inHeight, inWidth, outChannels, kernelSize, actFunc->clone(), stride, padding, bias, nullptr);
+            l->weights = Matrixf(weightsView());
+            l->biases = Vectorf(biasesView());
+            l->direct = direct;
+            return l;
+        }
+
+        //Update the weights with the negative of weightsGradSum times a learning rate (SGD).
+        void update(float lr) override
+        {
+            lin::kernels::axpy(outChannels * patchRows(), -lr / batchSize, weightsGradData(), weightsData());
+            if (bias) lin::kernels::axpy(outChannels, -lr / batchSize, biasesGradData(), biasesData());
+        }
+        void zeroGrad() override
+        {
+            std::fill(weightsGradData(), weightsGradData() + (size_t)outChannels * patchRows(), 0.f);
+            if (bias) std::fill(biasesGradData(), biasesGradData() + outChannels, 0.f);
+            batchSize = 0;
+        }
+
+    protected:
+        int patchRows() const { return inChannels * kernelSize * kernelSize; }
+        float* weightsData() { return boundWeights ? boundWeights : weights.nums.data(); }
+        float* biasesData() { return boundBiases ? boundBiases : biases.nums.data(); }
+        float* weightsGradData() { return boundWeightsGrad ? boundWeightsGrad : weightsGradSum.nums.data(); }
+        float* biasesGradData() { return boundBiasesGrad ? boundBiasesGrad : biasesGradSum.nums.data(); }
+        bool useDirect() const { return direct && kernelSize == 3 && stride == 1; }
+
+        //The batched forward pass: sums (nullptr: don't keep them) and outputs of n samples.
+        void forward(int n, const float* in, float* sums, float* out, lin::storage<float>& patchBuf, lin::storage<float>& gemmBuf) const
+        {
+            if (useDirect()) {
+                forwardDirect(n, in, sums, out);
+                return;
+            }
+            int cols = n * planeOut();
+            const float* b = biasesView().data;
+            patchBuf.resize((size_t)patchRows() * cols);
+            gemmBuf.resize((size_t)outChannels * cols);
+            im2col(n, in, patchBuf.data());
+            lin::MatrixView<float> c(gemmBuf.data(), outChannels, cols);
+            //add the bias to each finished block, then scatter it into the samples' planes through the activation
+            lin::gemm(lin::noTrans, lin::noTrans, 1.f, weightsView(), lin::MatrixView<const float>(patchBuf.data(), patchRows(), cols), 0.f, c,
+                [&](int i0, int j0, int rows, int len) {
+                    for (int oc = i0; oc < i0 + rows; oc++) {
+                        for (int j = j0; j < j0 + len; ) {
+                            int s = j / planeOut(), p = j % planeOut(), cnt = std::min(j0 + len - j, planeOut() - p);
+                            float* x = &c(oc, j);
+                            if (bias) {
+                                for (int i = 0; i < cnt; i++) { x[i] += b[oc]; }
+                            }
+                            size_t at = (size_t)s * outSize + (size_t)oc * planeOut() + p;
+                            if (sums) std::copy(x, x + cnt, sums + at);
+                            actFunc->forward(1, cnt, x, out + at);
+                            j += cnt;
+                        }
+                    }
+                });
+        }
+
+        //patches[(ic*k + ky)*k + kx][s*planeOut + oy*outWidth + ox] = in[s][ic][oy*stride + ky - padding][ox*stride + kx - padding], 0 outside
+        void im2col(int n, const float* in, float* dst) const
+        {
+            int k = kernelSize;
+            size_t cols = (size_t)n * planeOut();
+            lin::parallel::parallelFor(patchRows() * n, 1, [&](int lo, int hi) {
+                for (int t = lo; t < hi; t++) {
+                    int r = t / n, s = t % n;
+                    int ic = r / (k * k), ky = r / k % k, kx = r % k;
+                    const float* x = in + (size_t)s * inSize + (size_t)ic * planeIn();
+                    float* d = dst + r * cols + (size_t)s * planeOut();
+                    for (int oy = 0; oy < outHeight; oy++) {
+                        int iy = oy * stride + ky - padding;
+                        float* row = d + (size_t)oy * outWidth;
+                        if (iy < 0 || iy >= inHeight) {
+                            std::fill(row, row + outWidth, 0.f);
+                            continue;
+                        }
+                        for (int ox = 0; ox < outWidth; ox++) {
+                            int ix = ox * stride + kx - padding;
+                            row[ox] = ix >= 0 && ix < inWidth ? x[iy * inWidth + ix] : 0.f;
+                        }
+                    }
+                }
+            });
+        }
+        //The reverse of im2col: add each patch gradient to the input it was taken from. Each task owns one input plane.
+        void col2im(int n, const float* src, float* inGrad) const
+        {
+            int k = kernelSize;
+            size_t cols = (size_t)n * planeOut();
+            lin::parallel::parallelFor(n * inChannels, 1, [&](int lo, int hi) {
+                for (int t = lo; t < hi; t++) {
+                    int s = t / inChannels, ic = t % inChannels;
+                    float* g = inGrad + (size_t)s * inSize + (size_t)ic * planeIn();
+                    for (int ky = 0; ky < k; ky++) {
+                        for (int kx = 0; kx < k; kx++) {
+                            const float* d = src + (size_t)((ic * k + ky) * k + kx) * cols + (size_t)s * planeOut();
+                            for (int oy = 0; oy < outHeight; oy++) {
+                                int iy = oy * stride + ky - padding;
+                                if (iy < 0 || iy >= inHeight) continue;
+                                for (int ox = 0; ox < outWidth; ox++) {
+                                    int ix = ox * stride + kx - padding;
+                                    if (ix >= 0 && ix < inWidth) g[iy * inWidth + ix] += d[oy * outWidth + ox];
+                                }
+                            }
+                        }
+                    }
+                }
+            });
+        }
+
+        //The output columns [lo, hi) that tap 3x3 kernel column kx reads from inside the image (stride 1).
+        void validCols(int kx, int& lo, int& hi) const
+        {
+            lo = std::max(0, padding - kx);
+            hi = std::min(outWidth, inWidth + padding - kx);
+        }
+
+        //3x3, stride 1: each (sample, filter) plane starts at the bias and gets w * (the input plane shifted by the tap) added
+        //for each of the nine taps of each input channel, one axpy per output row.
+        void forwardDirect(int n, const float* in, float* sums, float* out) const
+        {
+            const float* weightsAt = weightsView().data;
+            const float* b = biasesView().data;
+            lin::parallel::parallelFor(n * outChannels, 1, [&](int lo, int hi) {
+                for (int t = lo; t < hi; t++) {
+                    int s = t / outChannels, oc = t % outChannels;
+                    size_t at = (size_t)s * outSize + (size_t)oc * planeOut();
+                    float* plane = (sums ? sums : out) + at;
+                    std::fill(plane, plane + planeOut(), bias ? b[oc] : 0.f);
+                    for (int ic = 0; ic < inChannels; ic++) {
+                        const float* x = in + (size_t)s * inSize + (size_t)ic * planeIn();
+                        const float* w = weightsAt + (size_t)oc * patchRows() + ic * 9;
+                        for (int ky = 0; ky < 3; ky++) {
+                            for (int kx = 0; kx < 3; kx++) {
+                                int c0, c1;
+                                validCols(kx, c0, c1);
+                                if (c0 >= c1) continue;
+                                for (int oy = 0; oy < outHeight; oy++) {
+                                    int iy = oy + ky - padding;
+                                    if (iy < 0 || iy >= inHeight) continue;
+                                    lin::kernels::axpy(c1 - c0, w[ky * 3 + kx], x + iy * inWidth + c0 + kx - padding, plane + oy * outWidth + c0);
+                                }
+                            }
+                        }
+                    }
+                    actFunc->forward(1, planeOut(), plane, out + at);
+                }
+            });
+        }
+        //The gradients of the direct path: each weight gets the dot products of the sum gradient rows with the input rows
+        //under its tap (one task per filter and input channel, so each owns its nine weights), and each input plane gets the sum
+        //gradient planes added back through the same taps (one task per sample and input channel).
+        void backwardDirect(int n, const float* in, const float* sumGrad, float* inGrad)
+        {
+            const float* weightsAt = weightsView().data;
+            lin::parallel::parallelFor(outChannels * inChannels, 1, [&](int lo, int hi) {
+                for (int t = lo; t < hi; t++) {
+                    int oc = t / inChannels, ic = t % inChannels;
+                    float* dw = weightsGradData() + (size_t)oc * patchRows() + ic * 9;
+                    for (int s = 0; s < n; s++) {
+                        const float* x = in + (size_t)s * inSize + (size_t)ic * planeIn();
+                        const float* g = sumGrad + (size_t)s * outSize + (size_t)oc * planeOut();
+                        for (int ky = 0; ky < 3; ky++) {
+                            for (int kx = 0; kx < 3; kx++) {
+                                int c0, c1;
+                                validCols(kx, c0, c1);
+                                if (c0 >= c1) continue;
+                                float acc = 0;
+                                for (int oy = 0; oy < outHeight; oy++) {
+                                    int iy = oy + ky - padding;
+                                    if (iy < 0 || iy >= inHeight) continue;
+                                    acc += lin::kernels::dot(c1 - c0, g + oy * outWidth + c0, x + iy * inWidth + c0 + kx - padding);
+                                }
+                                dw[ky * 3 + kx] += acc;
+                            }
+                        }
+                    }
+                }
+            });
+            lin::parallel::parallelFor(n * inChannels, 1, [&](int lo, int hi) {
+                for (int t = lo; t < hi; t++) {
+                    int s = t / inChannels, ic = t % inChannels;
+                    float* dx = inGrad + (size_t)s * inSize + (size_t)ic * planeIn();
+                    for (int oc = 0; oc < outChannels; oc++) {
+                        const float* g = sumGrad + (size_t)s * outSize + (size_t)oc * planeOut();
+                        const float* w = weightsAt + (size_t)oc * patchRows() + ic * 9;
+                        for (int ky = 0; ky < 3; ky++) {
+                            for (int kx = 0; kx < 3; kx++) {
+                                int c0, c1;
+                                validCols(kx, c0, c1);
+                                if (c0 >= c1) continue;
+                                for (int oy = 0; oy < outHeight; oy++) {
+                                    int iy = oy + ky - padding;
+                                    if (iy < 0 || iy >= inHeight) continue;
+                                    lin::kernels::axpy(c1 - c0, w[ky * 3 + kx], g + oy * outWidth + c0, dx + iy * inWidth + c0 + kx - padding);
+                                }
+                            }
+                        }
+                    }
+                }
+            });
+        }
+    };
+
+    //Common part of the pooling layers: kernel*kernel windows moved by stride over each channel, no padding, no weights.
+    class APool2D : public ASpatialLayer
+    {
+    public:
+        int kernelSize, stride;
+    protected:
+        std::vector<int> indices; //per output of the last batch, what backward() needs of the window (MaxPool2D: where the max was)
+    public:
+        //IN: channels, height, width, window size, stride (0: the window size, windows don't overlap)
+        APool2D(int channels, int height, int width, int kernel, int stride_)
+        {
+            kernelSize = kernel;
+            stride = stride_ > 0 ? stride_ : kernel;
+            setShapes(channels, height, width, channels, kernel, stride, 0);
+            outs = Vectorf(outSize);
+        }
+
+        using ASpatialLayer::forward;
+        using ASpatialLayer::backward;
+
+        std::pair<int, int> weightsShape() const override { return { 0, 0 }; }
+        void setWeights(const Matrixf&) override {}
+        void update(float) override {}
+        void zeroGrad() override {}
+
+        Matrixf& forward(Matrixf& inBatch) override
+        {
+            lastIn = &inBatch;
+            if (batchOuts.rows != inBatch.rows || batchOuts.cols != outSize) batchOuts = Matrixf(inBatch.rows, outSize);
+            if (keepsIndices()) indices.resize((size_t)inBatch.rows * outSize);
+            pool(inBatch.rows, inBatch.nums.data(), batchOuts.nums.data(), keepsIndices() ? indices.data() : nullptr);
+            return batchOuts;
+        }
+        void predict(const Matrixf& inBatch, Matrixf& out) const override
+        {
+            if (out.rows != inBatch.rows || out.cols != outSize) out = Matrixf(inBatch.rows, outSize);
+            pool(inBatch.rows, inBatch.nums.data(), out.nums.data(), nullptr);
+        }
+        Matrixf backward(Matrixf& outGrad) override
+        {
+            Matrixf inGrad(outGrad.rows, inSize);
+            lin::parallel::parallelFor(outGrad.rows * inChannels, 1, [&](int lo, int hi) {
+                for (int t = lo; t < hi; t++) {
+                    int s = t / inChannels, c = t % inChannels;
+                    size_t inAt = (size_t)s * inSize + (size_t)c * planeIn(), outAt = (size_t)s * outSize + (size_t)c * planeOut();
+                    unpoolPlane(outGrad.nums.data() + outAt, keepsIndices() ? indices.data() + outAt : nullptr, inGrad.nums.data() + inAt);
+                }
+            });
+            return inGrad;
+        }
+    protected:
+        //pool each (sample, channel) plane, in parallel
+        void pool(int n, const float* in, float* out, int* idx) const
+        {
+            lin::parallel::parallelFor(n * inChannels, 1, [&](int lo, int hi) {
+                for (int t = lo; t < hi; t++) {
+                    int s = t / inChannels, c = t % inChannels;
+                    size_t inAt = (size_t)s * inSize + (size_t)c * planeIn(), outAt = (size_t)s * outSize + (size_t)c * planeOut();
+                    poolPlane(in + inAt, out + outAt, idx ? idx + outAt : nullptr);
+                }
+            });
+        }
+        virtual bool keepsIndices() const { return false; }
+        //IN: input plane, output plane, indices of the plane's outputs (nullptr: not needed)
+        virtual void poolPlane(const float* x, float* y, int* idx) const = 0;
+        //IN: output gradient plane, indices of the plane's outputs, input gradient plane (zeros, added to)
+        virtual void unpoolPlane(const float* g, const int* idx, float* dx) const = 0;
+    };
+
+    //Max pooling: each output is the largest input of its window. backward() passes the gradient to that input only.
+    class MaxPool2D : public APool2D
+    {
+    public:
+        //IN: channels, height, width, window size, stride (0: the window size)
+        MaxPool2D(int channels, int height, int width, int kernel, int stride_ = 0) : APool2D(channels, height, width, kernel, stride_) {}
+        ILayer* clone() const override { return new MaxPool2D(inChannels, inHeight, inWidth, kernelSize, stride); }
+    protected:
+        bool keepsIndices() const override { return true; }
+        void poolPlane(const float* x, float* y, int* idx) const override
+        {
+            for (int oy = 0; oy < outHeight; oy++) {
+                for (int ox = 0; ox < outWidth; ox++) {
+                    int best = oy * stride * inWidth + ox * stride;
+                    for (int ky = 0; ky < kernelSize; ky++) {
+                        for (int kx = 0; kx < kernelSize; kx++) {
+                            int i = (oy * stride + ky) * inWidth + ox * stride + kx;
+                            if (x[i] > x[best]) best = i;
+                        }
+                    }
+                    y[oy * outWidth + ox] = x[best];
+                    if (idx) idx[oy * outWidth + ox] = best;
+                }
+            }
+        }
+        void unpoolPlane(const float* g, const int* idx, float* dx) const override
+        {
+            for (int o = 0; o < planeOut(); o++) { dx[idx[o]] += g[o]; }
+        }
+    };
+
+    //Average pooling: each output is the mean of its window. backward() spreads the gradient evenly over the window.
+    class AvgPool2D : public APool2D
+    {
+    public:
+        //IN: channels, height, width, window size, stride (0: the window size)
+        AvgPool2D(int channels, int height, int width, int kernel, int stride_ = 0) : APool2D(channels, height, width, kernel, stride_) {}
+        ILayer* clone() const override { return new AvgPool2D(inChannels, inHeight, inWidth, kernelSize, stride); }
+    protected:
+        void poolPlane(const float* x, float* y, int*) const override
+        {
+            float scale = 1.f / (kernelSize * kernelSize);
+            for (int oy = 0; oy < outHeight; oy++) {
+                for (int ox = 0; ox < outWidth; ox++) {
+                    float sum = 0;
+                    for (int ky = 0; ky < kernelSize; ky++) {
+                        const float* row = x + (oy * stride + ky) * inWidth + ox * stride;
+                        for (int kx = 0; kx < kernelSize; kx++) { sum += row[kx]; }
+                    }
+                    y[oy * outWidth + ox] = sum * scale;
+                }
+            }
+        }
+        void unpoolPlane(const float* g, const int*, float* dx) const override
+        {
+            float scale = 1.f / (kernelSize * kernelSize);
+            for (int oy = 0; oy < outHeight; oy++) {
+                for (int ox = 0; ox < outWidth; ox++) {
+                    float share = g[oy * outWidth + ox] * scale;
+                    for (int ky = 0; ky < kernelSize; ky++) {
+                        float* row = dx + (oy * stride + ky) * inWidth + ox * stride;
+                        for (int kx = 0; kx < kernelSize; kx++) { row[kx] += share; }
+                    }
+                }
+            }
+        }
+    };
+}
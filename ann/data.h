@@ -26,6 +26,22 @@ namespace data
         Vectorf a;
     };
 
+    //Copy the inputs and labels of count items of a batch, starting at first, into the rows of two matrices
+    //for the batched Network::forward()/backward(). The matrices are resized if needed.
+    //IN: batch, input matrix, label matrix, index of the first item, number of items (-1: all from first on)
+    inline void toMatrices(const Batch& batch, Matrixf& inputs, Matrixf& labels, int first = 0, int count = -1)
+    {
+        if (count == -1) count = (int)batch.size() - first;
+        int inSize = batch[first].input->size(), labelSize = batch[first].label->size();
+        if (inputs.rows != count || inputs.cols != inSize) inputs = Matrixf(count, inSize);
+        if (labels.rows != count || labels.cols != labelSize) labels = Matrixf(count, labelSize);
+        for (int r = 0; r < count; r++) {
+            const InputLabelPair& item = batch[first + r];
+            std::copy(item.input->nums.begin(), item.input->nums.end(), inputs[r]);
+            std::copy(item.label->nums.begin(), item.label->nums.end(), labels[r]);
+        }
+    }
+
     class IDataSet
     {
     public:
@@ -50,17 +66,19 @@ namespace data
         std::vector<Vectorf> inputData;
         std::vector<Vectorf> labelData;
     public:
-        //IN: input file path, label file path
-        MNIST(std::string ipath, std::string lpath)
+        //A shard reads only its part of the files, items [n * shardIndex / shardCount, n * (shardIndex + 1) / shardCount) of the n,
+        //so each of shardCount training processes (dist.h) holds just its own share of the data in memory.
+        //IN: input file path, label file path, index of the shard to load, number of shards
+        MNIST(std::string ipath, std::string lpath, int shardIndex = 0, int shardCount = 1)
         {
             inputPath = ipath;
             labelPath = lpath;
-            loadData();
+            loadData(shardIndex, shardCount);
             std::cout << size << " items loaded from '" << ipath << "'\n";
         }
         //Creates a MNIST dataset from the default directory if files are present
-        //IN: "train" or "test"
-        MNIST(std::string type)
+        //IN: "train" or "test", index of the shard to load, number of shards
+        MNIST(std::string type, int shardIndex = 0, int shardCount = 1)
         {
             std::string dataDir = getDefaultDataPath();
             if (type == "train") {
@@ -75,7 +93,7 @@ namespace data
                 std::cout << "Invalid MNIST constructor argument. Only \"train\" or \"test\".";
             }
 
-            loadData();
+            loadData(shardIndex, shardCount);
             std::cout << size << " items loaded from '" << inputPath << "'\n";
         }
 
@@ -127,9 +145,10 @@ namespace data
             }
         }
     protected:
-        //Write from the ubyte mnist files to the input and label vectors.
-        void loadData() 
+        //Write from the ubyte mnist files to the input and label vectors: the items of one of shardCount contiguous parts of the files.
+        void loadData(int shardIndex, int shardCount)
         {
+            if (shardCount < 1 || shardIndex < 0 || shardIndex >= shardCount) throw std::runtime_error("MNIST: bad shard index or count");
             inputifs.open(inputPath, std::ios::binary);
             if (!inputifs.good()) {
                 std::cout << "\nInput file not found: '" << inputPath << "'\n";
@@ -148,6 +167,8 @@ namespace data
             inputSize = rows * cols;
             labelSize = 10;
             //###################################
+            int first = (int)((long long)size * shardIndex / shardCount);
+            size = (int)((long long)size * (shardIndex + 1) / shardCount) - first;
 
             labelifs.open(labelPath, std::ios::binary);
             if (!labelifs.good()) {
@@ -157,8 +178,8 @@ namespace data
 
             inputData.reserve(size);
             labelData.reserve(size);
-            inputifs.seekg(4 * sizeof(int));
-            labelifs.seekg(2 * sizeof(int));
+            inputifs.seekg(4 * sizeof(int) + (std::streamoff)first * inputSize);
+            labelifs.seekg(2 * sizeof(int) + (std::streamoff)first);
             for (int i = 0; i < size; i++) {
                 Vectorf inputVec(inputSize);
                 Vectorf labelVec(labelSize, linalg::zeros);
@@ -191,6 +212,36 @@ namespace data
         }
     };
 
+    //One of count disjoint parts of a dataset, e.g. the share of one of count training processes: the items index, index + count,
+    //index + 2 * count, ... of the dataset. shuffle() shuffles the order of the shard's items only, so the shards stay disjoint.
+    //Every process still holds the whole dataset; MNIST can load just its part instead (its shardIndex/shardCount arguments).
+    class Shard : public IDataSet
+    {
+    public:
+        IDataSet& dataSet;
+        std::vector<int> indices; //the shard's items in the dataset
+    public:
+        //IN: dataset (must outlive the shard, not shuffled meanwhile), index of the shard, number of shards
+        Shard(IDataSet& datSet, int index, int count) : dataSet(datSet)
+        {
+            for (int i = index; i < datSet.size; i += count) { indices.push_back(i); }
+            size = (int)indices.size();
+            inputSize = datSet.inputSize;
+            labelSize = datSet.labelSize;
+        }
+
+        InputLabelPair getItem(int ind) override
+        {
+            return dataSet.getItem(indices[ind]);
+        }
+
+        void shuffle() override
+        {
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            std::shuffle(indices.begin(), indices.end(), std::default_random_engine(seed));
+        }
+    };
+
     //Holds a ADataSet object and is resposible for getting batches from it.
     class DataLoader
     {
@@ -0,0 +1,440 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 //macOS: SIGPIPE is ignored for the process instead
+#endif
+#endif
+#include "nnet.h"
+#include "metrics.h"
+
+//Multi-process data-parallel training on one host: N processes (ranks) train the same network, each on its own shard of the data
+//(e.g. data::MNIST("train", rank, N), which loads only the rank's part of the files), and add up their gradients after each batch
+//through POSIX shared memory, so they keep identical weights.
+//Rank 0 creates the shared memory and a Unix domain socket, the others connect to it. The socket is the control channel: the
+//rendezvous at the start, and afterwards it tells the ranks when another one left (exited, threw or crashed), so none waits for it forever.
+//The gradients themselves go through the shared memory only: each rank writes its gradients into its own slot, each reduces its
+//1/N of the elements over all slots, in rank order, into the shared result, and all copy the result back. Every element is summed
+//in the same order on every rank, so all ranks get bitwise the same sums and their weights never drift apart.
+//POSIX only (Linux, macOS); on Windows the constructors throw.
+namespace nnet
+{
+    //The shared memory, the control channel and the barrier of a group of processes.
+    class ShmGroup
+    {
+    protected:
+        struct header
+        {
+            alignas(64) std::atomic<uint32_t> arrived; //ranks at the barrier
+            alignas(64) std::atomic<uint32_t> generation; //barriers passed
+            alignas(64) std::atomic<uint32_t> aborted; //a rank left the group (done, threw or crashed)
+        };
+        int rank_, size_;
+        size_t capacity; //floats per slot
+        std::string shmName, socketPath;
+        char* base = nullptr;
+        size_t mappedBytes = 0;
+        header* hdr = nullptr;
+        std::vector<int> peers; //rank 0: a socket per other rank, the others: the socket to rank 0
+        std::thread watcher;
+        std::atomic<bool> stopping;
+    public:
+        //Join a group, waiting until all ranks have joined. Throws std::runtime_error if that fails or takes longer than timeout.
+        //IN: name of the group (the same in all processes, unique on the host), this process's rank (0..size-1), number of processes,
+        //floats each rank exchanges at most, seconds to wait for the others
+        ShmGroup(const std::string& name, int rank, int size, size_t floats, int timeoutSeconds = 60)
+            : rank_(rank), size_(size), stopping(false)
+        {
+#ifdef _WIN32
+            throw std::runtime_error("ShmGroup: needs POSIX shared memory and Unix domain sockets");
+#else
+            if (size <= 0 || rank < 0 || rank >= size) throw std::runtime_error("ShmGroup: bad rank " + std::to_string(rank) + " of " + std::to_string(size));
+            capacity = (floats + 15) / 16 * 16; //each slot starts on a cache line
+            shmName = "/ann-" + name;
+            const char* tmp = std::getenv("TMPDIR");
+            socketPath = std::string(tmp && *tmp ? tmp : "/tmp") + "/ann-" + name + ".sock";
+            mappedBytes = sizeof(header) + (size_t)(size + 1) * capacity * sizeof(float);
+            try {
+                if (rank == 0) create(timeoutSeconds);
+                else join(timeoutSeconds);
+            }
+            catch (...) {
+                close();
+                throw;
+            }
+            watcher = std::thread([this] { watch(); });
+#endif
+        }
+        ~ShmGroup()
+        {
+#ifndef _WIN32
+            stopping = true;
+            if (watcher.joinable()) watcher.join();
+            close();
+#endif
+        }
+        ShmGroup(const ShmGroup&) = delete;
+        ShmGroup& operator = (const ShmGroup&) = delete;
+
+        int rank() const { return rank_; }
+        int size() const { return size_; }
+        size_t slotFloats() const { return capacity; }
+        //the slot of a rank, and the reduced results (rank = size())
+        float* slot(int r) { return (float*)(base + sizeof(header)) + (size_t)r * capacity; }
+        float* result() { return slot(size_); }
+
+        //Wait until all ranks got here. Throws std::runtime_error if a rank left the group before getting here.
+        void barrier()
+        {
+            uint32_t gen = hdr->generation.load(std::memory_order_acquire);
+            if (hdr->arrived.fetch_add(1, std::memory_order_acq_rel) == (uint32_t)size_ - 1) {
+                hdr->arrived.store(0, std::memory_order_relaxed);
+                hdr->generation.fetch_add(1, std::memory_order_release);
+                return;
+            }
+            while (hdr->generation.load(std::memory_order_acquire) == gen) {
+                //a rank that passed this barrier may leave before this one sees it passed
+                if (hdr->aborted.load(std::memory_order_acquire) && hdr->generation.load(std::memory_order_acquire) == gen) {
+                    throw std::runtime_error("ShmGroup: a process of the group left");
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        //Sum n floats over all ranks, in place. All ranks must call it with the same offset and n, in the same order.
+        //IN: this rank's values, where they go in the slots (offset + n <= slotFloats()), number of values
+        void allreduce(float* data, size_t offset, size_t n)
+        {
+            std::copy(data, data + n, slot(rank_) + offset);
+            reduce(offset, n);
+            std::copy(result() + offset, result() + offset + n, data);
+        }
+        //The reduction of allreduce() for values already written to the slots at offset: result = slot 0 + slot 1 + ...,
+        //each rank summing its 1/size of the elements. Returns when the results are complete.
+        void reduce(size_t offset, size_t n)
+        {
+            barrier();
+            size_t lo = offset + n * rank_ / size_, hi = offset + n * (rank_ + 1) / size_;
+            float* out = result();
+            std::copy(slot(0) + lo, slot(0) + hi, out + lo);
+            for (int r = 1; r < size_; r++) { lin::kernels::add((int)(hi - lo), out + lo, slot(r) + lo, out + lo); }
+            barrier();
+        }
+        //Copy n floats of rank 0 to all ranks.
+        void broadcast(float* data, size_t offset, size_t n)
+        {
+            if (rank_ == 0) std::copy(data, data + n, result() + offset);
+            barrier();
+            if (rank_ != 0) std::copy(result() + offset, result() + offset + n, data);
+            barrier();
+        }
+    protected:
+#ifndef _WIN32
+        static std::runtime_error sysError(const std::string& what)
+        {
+            return std::runtime_error("ShmGroup: " + what + ": " + std::strerror(errno));
+        }
+
+        void map(int fd)
+        {
+            void* p = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED) throw sysError("can't map '" + shmName + "'");
+            base = (char*)p;
+            hdr = (header*)base;
+        }
+
+        sockaddr_un address() const
+        {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (socketPath.size() >= sizeof(addr.sun_path)) throw std::runtime_error("ShmGroup: socket path too long: " + socketPath);
+            std::strcpy(addr.sun_path, socketPath.c_str());
+            return addr;
+        }
+
+        //rank 0: create the shared memory, then accept a connection from every other rank, then let them all go
+        void create(int timeoutSeconds)
+        {
+            shm_unlink(shmName.c_str()); //left over from a crashed run
+            int fd = shm_open(shmName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0) throw sysError("can't create '" + shmName + "'");
+            if (ftruncate(fd, (off_t)mappedBytes) != 0) {
+                ::close(fd);
+                throw sysError("can't size '" + shmName + "'");
+            }
+            map(fd);
+            new (hdr) header();
+            hdr->arrived = 0;
+            hdr->generation = 0;
+            hdr->aborted = 0;
+
+            int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listener < 0) throw sysError("can't create a socket");
+            unlink(socketPath.c_str());
+            sockaddr_un addr = address();
+            if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, size_) != 0) {
+                ::close(listener);
+                throw sysError("can't listen on '" + socketPath + "'");
+            }
+            peers.assign(size_ - 1, -1);
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+            for (int joined = 0; joined < size_ - 1; ) {
+                pollfd p = { listener, POLLIN, 0 };
+                if (std::chrono::steady_clock::now() > deadline || poll(&p, 1, 100) < 0) {
+                    ::close(listener);
+                    throw std::runtime_error("ShmGroup: only " + std::to_string(joined + 1) + " of " + std::to_string(size_) + " processes joined");
+                }
+                if (!(p.revents & POLLIN)) continue;
+                int fd = accept(listener, NULL, NULL);
+                if (fd < 0) continue;
+                int32_t hello[2] = { -1, 0 }; //rank, slot size
+                if (recv(fd, hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) || hello[0] <= 0 || hello[0] >= size_
+                    || peers[hello[0] - 1] >= 0 || (size_t)hello[1] != capacity) {
+                    ::close(fd);
+                    ::close(listener);
+                    throw std::runtime_error("ShmGroup: a process joined with a bad rank or size");
+                }
+                peers[hello[0] - 1] = fd;
+                joined++;
+            }
+            ::close(listener);
+            unlink(socketPath.c_str());
+            for (int fd : peers) { send(fd, "g", 1, MSG_NOSIGNAL); }
+        }
+
+        //the other ranks: connect to rank 0, wait for the go, then map the shared memory it created
+        void join(int timeoutSeconds)
+        {
+            sockaddr_un addr = address();
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+            int fd = -1;
+            while (true) {
+                fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd < 0) throw sysError("can't create a socket");
+                if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) break;
+                ::close(fd);
+                if (std::chrono::steady_clock::now() > deadline) throw std::runtime_error("ShmGroup: rank 0 didn't open '" + socketPath + "'");
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+            peers.push_back(fd);
+            int32_t hello[2] = { rank_, (int32_t)capacity };
+            char go = 0;
+            if (send(fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) || recv(fd, &go, 1, MSG_WAITALL) != 1 || go != 'g') {
+                throw std::runtime_error("ShmGroup: rank 0 refused rank " + std::to_string(rank_));
+            }
+            int shm = shm_open(shmName.c_str(), O_RDWR, 0600);
+            if (shm < 0) throw sysError("can't open '" + shmName + "'");
+            map(shm);
+        }
+
+        //Watch the control channel: nothing is sent on it after the go, so a peer's socket turns readable only when the peer left the group
+        //(destroyed its ShmGroup, threw or crashed), and no barrier can complete any more.
+        void watch()
+        {
+            std::vector<pollfd> fds;
+            for (int fd : peers) { fds.push_back({ fd, POLLIN, 0 }); }
+            while (!stopping && !fds.empty()) {
+                if (poll(fds.data(), fds.size(), 100) <= 0) continue;
+                for (size_t i = 0; i < fds.size(); ) {
+                    if (fds[i].revents == 0) {
+                        i++;
+                        continue;
+                    }
+                    hdr->aborted.store(1, std::memory_order_release);
+                    fds.erase(fds.begin() + i);
+                }
+            }
+        }
+
+        void close()
+        {
+            for (int fd : peers) { if (fd >= 0) ::close(fd); }
+            peers.clear();
+            if (base) munmap(base, mappedBytes);
+            base = nullptr;
+            hdr = nullptr;
+            if (rank_ == 0) {
+                shm_unlink(shmName.c_str());
+                unlink(socketPath.c_str());
+            }
+        }
+#else
+        void close() {}
+#endif
+    };
+
+    //Data-parallel training of a network across the processes of a ShmGroup. Each process runs forward and backward on its own
+    //batch (of its data shard); the gradient sums of a layer are exchanged by a communication thread as soon as the layer's backward
+    //is done, while the earlier layers are still going backward. When trainStep() returns, every process has the gradient sums and
+    //batch sizes of all processes' batches, and the same optimizer step on each keeps the weights identical.
+    class DistributedDataParallel
+    {
+    protected:
+        //the gradient sums of one layer, contiguous in the slots
+        struct bucket
+        {
+            std::vector<ILayer::param> params;
+            size_t offset;
+            size_t size = 0;
+        };
+        Network& net;
+        std::vector<bucket> buckets; //per layer
+        std::vector<float> counts; //batch sizes of the layers, then the loss
+        size_t countsOffset;
+        std::unique_ptr<ShmGroup> group;
+        //the communication thread and its queue of buckets (counts: -1)
+        std::thread comm;
+        std::mutex mutex;
+        std::condition_variable queueCv, doneCv;
+        std::deque<int> queue;
+        int pending = 0;
+        bool stop = false;
+        std::exception_ptr error;
+    public:
+        //Join the group and start from rank 0's weights. All processes must build the same network.
+        //IN: network (must outlive the trainer), group name, this process's rank, number of processes, seconds to wait for the others
+        DistributedDataParallel(Network& net_, const std::string& name, int rank, int size, int timeoutSeconds = 60) : net(net_)
+        {
+            size_t floats = 0;
+            buckets.resize(net.layers.size());
+            for (size_t i = 0; i < net.layers.size(); i++) {
+                bucket& b = buckets[i];
+                net.layers[i]->params(b.params);
+                b.offset = floats;
+                for (const ILayer::param& p : b.params) { b.size += p.size; }
+                floats += b.size;
+            }
+            counts.resize(net.layers.size() + 1);
+            countsOffset = floats;
+            floats += counts.size();
+            group.reset(new ShmGroup(name, rank, size, floats, timeoutSeconds));
+            for (bucket& b : buckets) {
+                size_t at = b.offset;
+                for (const ILayer::param& p : b.params) {
+                    group->broadcast(p.value, at, p.size);
+                    at += p.size;
+                }
+            }
+            comm = std::thread([this] { commLoop(); });
+        }
+        ~DistributedDataParallel()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            queueCv.notify_all();
+            comm.join();
+        }
+
+        ShmGroup& processGroup() { return *group; }
+
+        //Forward and backward for this process's batch, with the gradients summed over all processes. Zero the gradients before
+        //(optimizer.zeroGrad()) and call the optimizer's step() after, in all processes. Throws std::runtime_error if a process left the group.
+        //IN: a batch*inputs Matrixf, the batch*labels Matrixf, metrics to add this process's outputs to (optional)
+        //OUT: the loss summed over the batches of all processes
+        float trainStep(Matrixf& inputs, Matrixf& labels, metrics::Metrics* stats = nullptr)
+        {
+            net.forward(inputs);
+            const Matrixf& out = *net.batchOutput;
+            float loss = net.lossFunc.lossSum(out.rows, out.cols, out.nums.data(), labels.nums.data());
+            if (stats) stats->add(&net.lossFunc, out, labels);
+            Matrixf outGrad = net.lossFunc.backward(*net.batchOutput, labels);
+            for (int i = (int)net.layers.size() - 1; i >= 0; i--) {
+                outGrad = net.layers[i]->backward(outGrad);
+                if (buckets[i].size > 0) submit(i);
+            }
+            for (size_t i = 0; i < net.layers.size(); i++) { counts[i] = (float)net.layers[i]->batchSize; }
+            counts.back() = loss;
+            submit(-1);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            doneCv.wait(lock, [&] { return pending == 0; });
+            if (error) {
+                std::exception_ptr e = error;
+                error = nullptr;
+                std::rethrow_exception(e);
+            }
+            for (size_t i = 0; i < net.layers.size(); i++) { net.layers[i]->batchSize = (int)counts[i]; }
+            return counts.back();
+        }
+    protected:
+        void submit(int b)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(b);
+                pending++;
+            }
+            queueCv.notify_one();
+        }
+
+        void commLoop()
+        {
+            while (true) {
+                int b;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    queueCv.wait(lock, [&] { return stop || !queue.empty(); });
+                    if (queue.empty()) return;
+                    b = queue.front();
+                    queue.pop_front();
+                }
+                try {
+                    //after an error the group is broken: the rest of the step is skipped
+                    if (!error) exchange(b);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--pending == 0) doneCv.notify_all();
+            }
+        }
+
+        void exchange(int b)
+        {
+            if (b < 0) {
+                group->allreduce(counts.data(), countsOffset, counts.size());
+                return;
+            }
+            bucket& bk = buckets[b];
+            float* own = group->slot(group->rank());
+            size_t at = bk.offset;
+            for (const ILayer::param& p : bk.params) {
+                std::copy(p.grad, p.grad + p.size, own + at);
+                at += p.size;
+            }
+            group->reduce(bk.offset, bk.size);
+            at = bk.offset;
+            for (const ILayer::param& p : bk.params) {
+                std::copy(group->result() + at, group->result() + at + p.size, p.grad);
+                at += p.size;
+            }
+        }
+    };
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include "simd.h"
+
+//Expression templates for elementwise Matrix/Vector arithmetic.
+//X + Y, X - Y and X * a don't compute anything, they return a small MatrixExpr/VectorExpr that remembers the operands.
+//The work happens when the expression is assigned to (or used to construct, or added to) a Matrix/Vector:
+//then the whole expression is evaluated in a single loop straight into the destination, without temporaries.
+//Leaves hold pointers into the operands, so don't keep an expression around (e.g. with auto) after its operands die.
+namespace linalg
+{
+    namespace expr
+    {
+        struct add { template <class T> static T apply(T a, T b) { return a + b; } };
+        struct sub { template <class T> static T apply(T a, T b) { return a - b; } };
+        struct mul { template <class T> static T apply(T a, T b) { return a * b; } };
+
+        //the elements of a Matrix/Vector
+        template <class T>
+        struct leaf
+        {
+            const T* p;
+            T operator [] (int i) const { return p[i]; }
+        };
+
+        //the elements of a VectorView
+        template <class T>
+        struct strided
+        {
+            const T* p;
+            int stride;
+            T operator [] (int i) const { return p[(size_t)i * stride]; }
+        };
+
+        //the elements of a MatrixView, in row-major order
+        template <class T>
+        struct strided2d
+        {
+            const T* p;
+            int cols;
+            int rowStride;
+            int colStride;
+            T operator [] (int i) const
+            {
+                int r = i / cols;
+                return p[(size_t)r * rowStride + (size_t)(i - r * cols) * colStride];
+            }
+        };
+
+        //a scalar broadcast to every element
+        template <class T>
+        struct scalar
+        {
+            T a;
+            T operator [] (int) const { return a; }
+        };
+
+        template <class Op, class L, class R>
+        struct binary
+        {
+            L l;
+            R r;
+            auto operator [] (int i) const -> decltype(Op::apply(l[i], r[i])) { return Op::apply(l[i], r[i]); }
+        };
+
+        //out[i] = e[i]. The overloads below send the plain one-operation cases to the SIMD kernels.
+        //Long loops are split across the thread pool like the kernels.
+        template <class T, class E>
+        void assign(int n, const E& e, T* out)
+        {
+            parallel::parallelFor(n, kernels::PARALLEL_MIN_ELEMS, [&](int lo, int hi) { for (int i = lo; i < hi; i++) { out[i] = e[i]; } }, 16);
+        }
+        template <class T>
+        void assign(int n, const binary<add, leaf<T>, leaf<T>>& e, T* out) { kernels::add(n, e.l.p, e.r.p, out); }
+        template <class T>
+        void assign(int n, const binary<sub, leaf<T>, leaf<T>>& e, T* out) { kernels::sub(n, e.l.p, e.r.p, out); }
+        template <class T>
+        void assign(int n, const binary<mul, leaf<T>, scalar<T>>& e, T* out) { kernels::scale(n, e.l.p, e.r.a, out); }
+
+        //out[i] += e[i]
+        template <class T, class E>
+        void addAssign(int n, const E& e, T* out)
+        {
+            parallel::parallelFor(n, kernels::PARALLEL_MIN_ELEMS, [&](int lo, int hi) { for (int i = lo; i < hi; i++) { out[i] += e[i]; } }, 16);
+        }
+        template <class T>
+        void addAssign(int n, const leaf<T>& e, T* out) { kernels::add(n, out, e.p, out); }
+
+        //out[i] -= e[i]
+        template <class T, class E>
+        void subAssign(int n, const E& e, T* out)
+        {
+            parallel::parallelFor(n, kernels::PARALLEL_MIN_ELEMS, [&](int lo, int hi) { for (int i = lo; i < hi; i++) { out[i] -= e[i]; } }, 16);
+        }
+        template <class T>
+        void subAssign(int n, const leaf<T>& e, T* out) { kernels::sub(n, out, e.p, out); }
+    }
+
+    //An unevaluated elementwise expression with the shape of a rows*cols matrix.
+    template <class T, class E>
+    class MatrixExpr
+    {
+    public:
+        E e;
+        int rows;
+        int cols;
+    public:
+        int size() const { return rows * cols; }
+        T operator [] (int i) const { return e[i]; }
+    };
+
+    //An unevaluated elementwise expression with the shape of a vector.
+    template <class T, class E>
+    class VectorExpr
+    {
+    public:
+        E e;
+        int n;
+    public:
+        int size() const { return n; }
+        T operator [] (int i) const { return e[i]; }
+    };
+}
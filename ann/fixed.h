@@ -0,0 +1,252 @@
+#pragma once
+#include <utility>
+#include "linalg.h"
+
+//Matrices and vectors with their dimensions as template parameters, for small layers where the size is known at compile time.
+//The elements are stored inline (on the stack, or inside the owning object), so there is no heap indirection, and every loop has
+//a constant trip count. Loops over up to FIXED_UNROLL_MAX elements are unrolled at compile time, longer ones are left to the compiler.
+//Conversions from/to Matrix and Vector copy; view() gives a MatrixView/VectorView for use with the other kernels.
+namespace linalg
+{
+    constexpr int FIXED_UNROLL_MAX = 64;
+
+    namespace fixed
+    {
+        template <class F, int... Is>
+        inline void unrolled(F& f, std::integer_sequence<int, Is...>)
+        {
+            int expand[] = { 0, (f(Is), 0)... };
+            (void)expand;
+        }
+        template <int N, class F>
+        inline void forEach(F& f, std::true_type) { unrolled(f, std::make_integer_sequence<int, N>()); }
+        template <int N, class F>
+        inline void forEach(F& f, std::false_type) { for (int i = 0; i < N; i++) { f(i); } }
+
+        //Call f(i) for i = 0..N-1, unrolled if N is at most FIXED_UNROLL_MAX.
+        template <int N, class F>
+        inline void forEach(F f) { forEach<N>(f, std::integral_constant<bool, (N <= FIXED_UNROLL_MAX)>()); }
+    }
+
+    template <class T, int N>
+    class FixedVector
+    {
+    public:
+        alignas(64) T nums[N];
+    public:
+        FixedVector() {}
+        explicit FixedVector(T a) { fixed::forEach<N>([&](int i) { nums[i] = a; }); }
+        explicit FixedVector(const Vector<T>& vec)
+        {
+            assert(vec.size() == N);
+            fixed::forEach<N>([&](int i) { nums[i] = vec.nums[i]; });
+        }
+
+        static constexpr int size() { return N; }
+
+        T dot(const FixedVector& vec) const
+        {
+            T res = 0;
+            fixed::forEach<N>([&](int i) { res += nums[i] * vec.nums[i]; });
+            return res;
+        }
+        T sum() const
+        {
+            T res = 0;
+            fixed::forEach<N>([&](int i) { res += nums[i]; });
+            return res;
+        }
+
+        Vector<T> toVector() const { return Vector<T>(std::vector<T>(nums, nums + N)); }
+        //copy the elements into vec, resizing it if needed
+        void copyTo(Vector<T>& vec) const
+        {
+            vec.nums.resize(N);
+            fixed::forEach<N>([&](int i) { vec.nums[i] = nums[i]; });
+        }
+
+        VectorView<T> view() { return VectorView<T>(nums, N); }
+        VectorView<const T> view() const { return VectorView<const T>(nums, N); }
+
+        T& operator [] (int i) { return nums[i]; }
+        const T& operator [] (int i) const { return nums[i]; }
+    };
+
+    //R*C row-major matrix
+    template <class T, int R, int C>
+    class FixedMatrix
+    {
+    public:
+        alignas(64) T nums[R * C];
+    public:
+        FixedMatrix() {}
+        explicit FixedMatrix(T a) { fixed::forEach<R * C>([&](int i) { nums[i] = a; }); }
+        explicit FixedMatrix(const Matrix<T>& mat)
+        {
+            assert(mat.rows == R && mat.cols == C);
+            fixed::forEach<R * C>([&](int i) { nums[i] = mat.nums[i]; });
+        }
+
+        static constexpr int rows() { return R; }
+        static constexpr int cols() { return C; }
+        static constexpr int size() { return R * C; }
+
+        FixedMatrix<T, C, R> transposed() const
+        {
+            FixedMatrix<T, C, R> res;
+            fixed::forEach<R>([&](int i) { fixed::forEach<C>([&](int j) { res.nums[j * R + i] = nums[i * C + j]; }); });
+            return res;
+        }
+        T sum() const
+        {
+            T res = 0;
+            fixed::forEach<R * C>([&](int i) { res += nums[i]; });
+            return res;
+        }
+
+        Matrix<T> toMatrix() const { return Matrix<T>(R, C, std::vector<T>(nums, nums + R * C)); }
+
+        MatrixView<T> view() { return MatrixView<T>(nums, R, C); }
+        MatrixView<const T> view() const { return MatrixView<const T>(nums, R, C); }
+
+        T& operator () (int i, int j) { return nums[i * C + j]; }
+        const T& operator () (int i, int j) const { return nums[i * C + j]; }
+        T* operator [] (int i) { return nums + i * C; }
+        const T* operator [] (int i) const { return nums + i * C; }
+    };
+
+    /// elementwise operators ///
+
+    template <class T, int R, int C>
+    FixedMatrix<T, R, C> operator + (const FixedMatrix<T, R, C>& A, const FixedMatrix<T, R, C>& B)
+    {
+        FixedMatrix<T, R, C> res;
+        fixed::forEach<R * C>([&](int i) { res.nums[i] = A.nums[i] + B.nums[i]; });
+        return res;
+    }
+    template <class T, int R, int C>
+    FixedMatrix<T, R, C> operator - (const FixedMatrix<T, R, C>& A, const FixedMatrix<T, R, C>& B)
+    {
+        FixedMatrix<T, R, C> res;
+        fixed::forEach<R * C>([&](int i) { res.nums[i] = A.nums[i] - B.nums[i]; });
+        return res;
+    }
+    template <class T, int R, int C>
+    FixedMatrix<T, R, C> operator * (const FixedMatrix<T, R, C>& A, T a)
+    {
+        FixedMatrix<T, R, C> res;
+        fixed::forEach<R * C>([&](int i) { res.nums[i] = A.nums[i] * a; });
+        return res;
+    }
+    template <class T, int R, int C>
+    FixedMatrix<T, R, C>& operator += (FixedMatrix<T, R, C>& A, const FixedMatrix<T, R, C>& B)
+    {
+        fixed::forEach<R * C>([&](int i) { A.nums[i] += B.nums[i]; });
+        return A;
+    }
+    template <class T, int R, int C>
+    FixedMatrix<T, R, C>& operator -= (FixedMatrix<T, R, C>& A, const FixedMatrix<T, R, C>& B)
+    {
+        fixed::forEach<R * C>([&](int i) { A.nums[i] -= B.nums[i]; });
+        return A;
+    }
+    template <class T, int R, int C>
+    FixedMatrix<T, R, C>& operator *= (FixedMatrix<T, R, C>& A, T a)
+    {
+        fixed::forEach<R * C>([&](int i) { A.nums[i] *= a; });
+        return A;
+    }
+
+    template <class T, int N>
+    FixedVector<T, N> operator + (const FixedVector<T, N>& x, const FixedVector<T, N>& y)
+    {
+        FixedVector<T, N> res;
+        fixed::forEach<N>([&](int i) { res.nums[i] = x.nums[i] + y.nums[i]; });
+        return res;
+    }
+    template <class T, int N>
+    FixedVector<T, N> operator - (const FixedVector<T, N>& x, const FixedVector<T, N>& y)
+    {
+        FixedVector<T, N> res;
+        fixed::forEach<N>([&](int i) { res.nums[i] = x.nums[i] - y.nums[i]; });
+        return res;
+    }
+    template <class T, int N>
+    FixedVector<T, N> operator * (const FixedVector<T, N>& x, T a)
+    {
+        FixedVector<T, N> res;
+        fixed::forEach<N>([&](int i) { res.nums[i] = x.nums[i] * a; });
+        return res;
+    }
+    template <class T, int N>
+    FixedVector<T, N>& operator += (FixedVector<T, N>& x, const FixedVector<T, N>& y)
+    {
+        fixed::forEach<N>([&](int i) { x.nums[i] += y.nums[i]; });
+        return x;
+    }
+    template <class T, int N>
+    FixedVector<T, N>& operator -= (FixedVector<T, N>& x, const FixedVector<T, N>& y)
+    {
+        fixed::forEach<N>([&](int i) { x.nums[i] -= y.nums[i]; });
+        return x;
+    }
+    template <class T, int N>
+    FixedVector<T, N>& operator *= (FixedVector<T, N>& x, T a)
+    {
+        fixed::forEach<N>([&](int i) { x.nums[i] *= a; });
+        return x;
+    }
+
+    /// products ///
+
+    template <class T, int R, int K, int C>
+    FixedMatrix<T, R, C> operator * (const FixedMatrix<T, R, K>& A, const FixedMatrix<T, K, C>& B)
+    {
+        FixedMatrix<T, R, C> res(T(0));
+        //i-k-j order: the innermost loop runs along rows of B and the result, which vectorizes
+        fixed::forEach<R>([&](int i) {
+            fixed::forEach<K>([&](int k) {
+                T a = A.nums[i * K + k];
+                fixed::forEach<C>([&](int j) { res.nums[i * C + j] += a * B.nums[k * C + j]; });
+            });
+        });
+        return res;
+    }
+
+    template <class T, int R, int C>
+    FixedVector<T, R> operator * (const FixedMatrix<T, R, C>& A, const FixedVector<T, C>& x)
+    {
+        FixedVector<T, R> res;
+        fixed::forEach<R>([&](int i) {
+            T s = 0;
+            fixed::forEach<C>([&](int j) { s += A.nums[i * C + j] * x.nums[j]; });
+            res.nums[i] = s;
+        });
+        return res;
+    }
+
+    //A^T * x without transposing A
+    template <class T, int R, int C>
+    FixedVector<T, C> mulTransposed(const FixedMatrix<T, R, C>& A, const FixedVector<T, R>& x)
+    {
+        FixedVector<T, C> res(T(0));
+        fixed::forEach<R>([&](int i) {
+            T a = x.nums[i];
+            fixed::forEach<C>([&](int j) { res.nums[j] += a * A.nums[i * C + j]; });
+        });
+        return res;
+    }
+
+    //A += alpha * x * y^T
+    template <class T, int R, int C>
+    void ger(T alpha, const FixedVector<T, R>& x, const FixedVector<T, C>& y, FixedMatrix<T, R, C>& A)
+    {
+        fixed::forEach<R>([&](int i) {
+            T a = alpha * x.nums[i];
+            fixed::forEach<C>([&](int j) { A.nums[i * C + j] += a * y.nums[j]; });
+        });
+    }
+
+    template <class T, int N>
+    T operator * (const FixedVector<T, N>& x, const FixedVector<T, N>& y) { return x.dot(y); }
+}
@@ -1,15 +1,23 @@
 #pragma once
+#include <stdexcept>
+#include <string>
 #include "linalg.h"
+#include "fastmath.h"
 
 namespace func
 {
     typedef linalg::Vector<float> Vectorf;
     typedef linalg::Matrix<float> Matrixf;
 
+    //The activation and loss functions below, as stored in model files (model.h). The values must not change; custom: can't be stored.
+    enum class actType : int { custom, reLU, lReLU, sigmoid, logisticLinearEnds, softMax, sinAct, expAct, tanhAct, linear };
+    enum class lossType : int { custom, MSE, Logistic, CrossEntropy, SoftmaxCrossEntropy };
+
     //Abstract class for differentiable activation functions
     class AActFunction
     {
     public:
+        virtual ~AActFunction() = default;
         //Returns the output of the activation function.
         virtual float forward(float x) = 0;
         //Returns the gradient of the activation function at x.
@@ -22,15 +30,52 @@ namespace func
             return gradient(x) * y;
         }
 
+        //Whole-buffer kernels, one virtual call per buffer instead of one per element: out = forward(x) and out = backward(x, grad)
+        //for a rows*cols buffer (one sample per row). out may alias x and grad (in-place). The defaults call the scalar functions
+        //per element; the activations below override them with inlined or SIMD loops.
+        //IN: rows, cols, inputs, (gradient w.r.t the outputs,) output buffer
+        virtual void forward(int rows, int cols, const float* x, float* out)
+        {
+            for (int i = 0; i < rows * cols; i++) { out[i] = forward(x[i]); }
+        }
+        virtual void backward(int rows, int cols, const float* x, const float* grad, float* out)
+        {
+            for (int i = 0; i < rows * cols; i++) { out[i] = backward(x[i], grad[i]); }
+        }
+
+        //Fused bias and activation: out = forward(x + bias) for a rows*cols block with row strides ldx and ldo, the same bias
+        //(cols long, or nullptr for none) added to every row. Used as the epilogue of the GEMM in Linear, on blocks of the output
+        //that are still in cache. out may alias x. The default adds the bias and runs the buffer kernel row by row.
+        //IN: rows, cols, inputs and their row stride, bias, output buffer and its row stride
+        virtual void forwardBias(int rows, int cols, const float* x, int ldx, const float* bias, float* out, int ldo)
+        {
+            for (int r = 0; r < rows; r++) {
+                const float* xr = x + (size_t)r * ldx;
+                float* outr = out + (size_t)r * ldo;
+                if (bias) linalg::kernels::add(cols, xr, bias, outr);
+                else if (outr != xr) std::copy(xr, xr + cols, outr);
+                forward(1, cols, outr, outr);
+            }
+        }
+
+        //Whether each output depends on its own input only. Only elementwise activations can be applied to a block of
+        //the columns of a sample (forwardBias as a GEMM epilogue); the others (softMax) need whole rows.
+        virtual bool elementwise() const { return true; }
+
+        //The type and the parameter (e.g. the slope of lReLU) of the activation, to store it in a model file. See makeAct().
+        virtual actType type() const { return actType::custom; }
+        virtual float param() const { return 0; }
+        //A new activation of the same type, parameter and accuracy, e.g. for a copy of a layer. The default goes through makeAct(),
+        //custom activations override it.
+        virtual AActFunction* clone() const;
+
         //Returns a Vectorf from Vectorf with each element passed through forward().
         //IN:
         //OUT: new std::vector with each element newVec[i] = forward(vec[i])
         virtual Vectorf forward(Vectorf& vec)
         {
             Vectorf newVec(vec.size());
-            for (size_t i = 0; i < vec.size(); i++) {
-                newVec[i] = forward(vec[i]);
-            }
+            forward(1, vec.size(), vec.nums.data(), newVec.nums.data());
             return newVec;
         }
 
@@ -40,12 +85,38 @@ namespace func
         virtual Vectorf backward(Vectorf& inVec, Vectorf& inGradVec)
         {
             Vectorf newVec(inVec.size());
-            for (size_t i = 0; i < inVec.size(); i++) {
-                newVec[i] = backward(inVec[i], inGradVec[i]);
-            }
+            backward(1, inVec.size(), inVec.nums.data(), inGradVec.nums.data(), newVec.nums.data());
             return newVec;
         }
 
+        //Returns a Matrixf with each element passed through forward(), e.g. a batch with one sample per row.
+        virtual Matrixf forward(Matrixf& mat)
+        {
+            Matrixf newMat(mat.rows, mat.cols);
+            forward(mat.rows, mat.cols, mat.nums.data(), newMat.nums.data());
+            return newMat;
+        }
+
+        //Returns a Matrixf with each element passed through backward().
+        virtual Matrixf backward(Matrixf& inMat, Matrixf& inGradMat)
+        {
+            Matrixf newMat(inMat.rows, inMat.cols);
+            backward(inMat.rows, inMat.cols, inMat.nums.data(), inGradMat.nums.data(), newMat.nums.data());
+            return newMat;
+        }
+
+        //In-place versions: vec/mat is replaced by the outputs, gradVec/gradMat by the gradient w.r.t the inputs.
+        void forwardInPlace(Vectorf& vec) { forward(1, vec.size(), vec.nums.data(), vec.nums.data()); }
+        void forwardInPlace(Matrixf& mat) { forward(mat.rows, mat.cols, mat.nums.data(), mat.nums.data()); }
+        void backwardInPlace(Vectorf& inVec, Vectorf& gradVec)
+        {
+            backward(1, inVec.size(), inVec.nums.data(), gradVec.nums.data(), gradVec.nums.data());
+        }
+        void backwardInPlace(Matrixf& inMat, Matrixf& gradMat)
+        {
+            backward(inMat.rows, inMat.cols, inMat.nums.data(), gradMat.nums.data(), gradMat.nums.data());
+        }
+
         float operator () (float x)
         {
             return forward(x);
@@ -54,11 +125,69 @@ namespace func
         {
             return forward(vec);
         }
+    public:
+        //accuracy of exp/sigmoid/tanh in the buffer kernels of this activation, see fastmath.h
+        linalg::kernels::mathMode accuracy = linalg::kernels::defaultMode;
+    };
+
+    //Call f(lo, hi, tmp) on chunks [lo, hi) of at most ACT_CHUNK elements covering [0, n), with tmp a stack buffer of ACT_CHUNK floats
+    //for intermediate results, so the activations can chain kernels without allocating. Long buffers are split across the thread pool.
+    constexpr int ACT_CHUNK = 256;
+    template <class F>
+    void forChunks(int n, F f)
+    {
+        int numChunks = (n + ACT_CHUNK - 1) / ACT_CHUNK;
+        linalg::parallel::parallelFor(numChunks, linalg::kernels::PARALLEL_MIN_ELEMS / ACT_CHUNK, [&](int cLo, int cHi) {
+            alignas(64) float tmp[ACT_CHUNK];
+            for (int c = cLo; c < cHi; c++) { f(c * ACT_CHUNK, std::min(n, (c + 1) * ACT_CHUNK), tmp); }
+        });
+    }
+
+    //Base of the elementwise activations. Derived implements value(x) and derivative(x) as plain inline members,
+    //which the buffer kernels call directly, so the loops are inlined and vectorizable. Long buffers are split across the thread pool.
+    template <class Derived>
+    class ElementwiseAct : public AActFunction
+    {
+    public:
+        using AActFunction::forward;
+        using AActFunction::backward;
+
+        float forward(float x) override { return self().value(x); }
+        float gradient(float x) override { return self().derivative(x); }
+        void forward(int rows, int cols, const float* x, float* out) override
+        {
+            const Derived& d = self();
+            linalg::parallel::parallelFor(rows * cols, linalg::kernels::PARALLEL_MIN_ELEMS, [&](int lo, int hi) {
+                for (int i = lo; i < hi; i++) { out[i] = d.value(x[i]); }
+            }, 16);
+        }
+        void backward(int rows, int cols, const float* x, const float* grad, float* out) override
+        {
+            const Derived& d = self();
+            linalg::parallel::parallelFor(rows * cols, linalg::kernels::PARALLEL_MIN_ELEMS, [&](int lo, int hi) {
+                for (int i = lo; i < hi; i++) { out[i] = d.derivative(x[i]) * grad[i]; }
+            }, 16);
+        }
+        //One pass, the bias add inlined into the activation. The activations whose buffer kernels go through fastmath.h
+        //override this with AActFunction's version, so the accuracy mode applies to the epilogue as well.
+        void forwardBias(int rows, int cols, const float* x, int ldx, const float* bias, float* out, int ldo) override
+        {
+            const Derived& d = self();
+            for (int r = 0; r < rows; r++) {
+                const float* xr = x + (size_t)r * ldx;
+                float* outr = out + (size_t)r * ldo;
+                if (bias) { for (int i = 0; i < cols; i++) { outr[i] = d.value(xr[i] + bias[i]); } }
+                else { for (int i = 0; i < cols; i++) { outr[i] = d.value(xr[i]); } }
+            }
+        }
+    protected:
+        const Derived& self() const { return static_cast<const Derived&>(*this); }
     };
     //Abstract class for differentiable loss functions
     class ALossFunction
     {
     public:
+        virtual ~ALossFunction() = default;
         //Return a vector of the unsummed losses.
         //IN: two vectors of equal size
         virtual Vectorf forward(Vectorf& outVec, Vectorf& labelVec) = 0;
@@ -68,69 +197,172 @@ namespace func
         //OUT: gradient vector with respect to parameter vector
         virtual Vectorf backward(Vectorf& outVec, Vectorf& labelVec) = 0;
 
+        //Calculate the loss summed over a rows*cols buffer (one sample per row), without forming the per-element losses.
+        //The losses below override it with one accumulating pass; the default goes through forward() row by row, which allocates.
+        //IN: rows, cols, outputs, labels
+        //OUT: the summed loss
+        virtual float lossSum(int rows, int cols, const float* outs, const float* labels)
+        {
+            float loss = 0;
+            for (int r = 0; r < rows; r++) {
+                Vectorf outVec(std::vector<float>(outs + (size_t)r * cols, outs + (size_t)(r + 1) * cols));
+                Vectorf labelVec(std::vector<float>(labels + (size_t)r * cols, labels + (size_t)(r + 1) * cols));
+                loss += forward(outVec, labelVec).sum();
+            }
+            return loss;
+        }
+
         //Calculate the loss.
         //IN: two vectors of equal size
         //OUT: the loss
         virtual float numericLoss(Vectorf& outVec, Vectorf& labelVec)
         {
-            return forward(outVec, labelVec).sum();
+            return lossSum(1, outVec.size(), outVec.nums.data(), labelVec.nums.data());
+        }
+
+        //Return the derivatives of the loss for a batch, one sample per row of outMat and labelMat.
+        virtual Matrixf backward(Matrixf& outMat, Matrixf& labelMat)
+        {
+            Matrixf gradMat(outMat.rows, outMat.cols);
+            gradient(outMat.rows, outMat.cols, outMat.nums.data(), labelMat.nums.data(), gradMat.nums.data());
+            return gradMat;
+        }
+
+        //The derivatives of the loss for a rows*cols buffer (one sample per row), written to grad, which may alias outs.
+        //The losses below override it with one pass over the buffers; the default goes through the Vectorf backward() row by row.
+        //IN: rows, cols, outputs, labels, gradient
+        virtual void gradient(int rows, int cols, const float* outs, const float* labels, float* grad)
+        {
+            for (int r = 0; r < rows; r++) {
+                Vectorf outVec(std::vector<float>(outs + (size_t)r * cols, outs + (size_t)(r + 1) * cols));
+                Vectorf labelVec(std::vector<float>(labels + (size_t)r * cols, labels + (size_t)(r + 1) * cols));
+                Vectorf g = backward(outVec, labelVec);
+                std::copy(g.nums.begin(), g.nums.end(), grad + (size_t)r * cols);
+            }
+        }
+
+        //Calculate the loss summed over a batch, one sample per row.
+        virtual float numericLoss(Matrixf& outMat, Matrixf& labelMat)
+        {
+            return lossSum(outMat.rows, outMat.cols, outMat.nums.data(), labelMat.nums.data());
         }
 
         float operator () (Vectorf& vec1, Vectorf& vec2)
         {
             return numericLoss(vec1, vec2);
         }
+        float operator () (Matrixf& mat1, Matrixf& mat2)
+        {
+            return numericLoss(mat1, mat2);
+        }
+
+        //the type of the loss, to store it in a model file, see makeLoss()
+        virtual lossType type() const { return lossType::custom; }
+        //A new loss function of the same type, e.g. for a copy of a network. The default goes through makeLoss(),
+        //custom losses override it.
+        virtual ALossFunction* clone() const;
     };
 
+    //out = softmax(x) for one row of n values, with the maximum subtracted before the exps so none of them overflows.
+    //out may alias x. Returns log(sum_j e^x_j) (log-sum-exp), so log(out_i) = x_i - the returned value.
+    inline float softmaxRow(int n, const float* x, float* out, linalg::kernels::mathMode accuracy = linalg::kernels::defaultMode)
+    {
+        float max = x[0];
+        for (int i = 1; i < n; i++) { max = std::max(max, x[i]); }
+        for (int i = 0; i < n; i++) { out[i] = x[i] - max; }
+        linalg::kernels::exp(n, out, out, accuracy);
+        float expSum = 0;
+        for (int i = 0; i < n; i++) { expSum += out[i]; }
+        float inv = 1 / expSum;
+        for (int i = 0; i < n; i++) { out[i] *= inv; }
+        return max + std::log(expSum);
+    }
+
     //activation functions
     namespace act
     {
         //rectified linear unit
-        class reLU : public AActFunction
+        class reLU : public ElementwiseAct<reLU>
         {
-            float forward(float x) override
+        public:
+            actType type() const override { return actType::reLU; }
+            float value(float x) const
             {
                 if (x > 0) return x;
                 else return 0;
             }
-            float gradient(float x) override
+            float derivative(float x) const
             {
                 if (x >= 0) return 1;
                 else return 0;
             }
+            void forward(int rows, int cols, const float* x, float* out) override { linalg::kernels::leakyRelu(rows * cols, 0.f, x, out); }
+            void backward(int rows, int cols, const float* x, const float* grad, float* out) override
+            {
+                linalg::kernels::leakyReluBackward(rows * cols, 0.f, x, grad, out);
+            }
         };
 
         //leaky rectified linear unit
-        class lReLU : public AActFunction
+        class lReLU : public ElementwiseAct<lReLU>
         {
-            float forward(float x) override
+        public:
+            actType type() const override { return actType::lReLU; }
+            float param() const override { return grad; }
+            float value(float x) const
             {
                 if (x > 0) return x;
                 else return grad * x;
             }
-            float gradient(float x) override
+            float derivative(float x) const
             {
                 if (x >= 0) return 1;
                 else return grad;
             }
+            void forward(int rows, int cols, const float* x, float* out) override { linalg::kernels::leakyRelu(rows * cols, grad, x, out); }
+            void backward(int rows, int cols, const float* x, const float* g, float* out) override
+            {
+                linalg::kernels::leakyReluBackward(rows * cols, grad, x, g, out);
+            }
         public:
             float grad;
             lReLU(float grad_ = 0.01F) { grad = grad_; }
         };
 
         //sigmoid function
-        class sigmoid : public AActFunction
+        class sigmoid : public ElementwiseAct<sigmoid>
         {
-            float forward(float x) override
+        public:
+            actType type() const override { return actType::sigmoid; }
+            float param() const override { return squeeze; }
+            float value(float x) const
             {
                 x = x / squeeze;
                 return 1 / (1 + exp(-x));
             }
-            float gradient(float x) override
+            float derivative(float x) const
             {
-                x = x / squeeze;
-                float ex = exp(x);
-                return (ex / pow((ex + 1), 2));
+                float s = value(x);
+                return s * (1 - s);
+            }
+            void forward(int rows, int cols, const float* x, float* out) override
+            {
+                forChunks(rows * cols, [&](int lo, int hi, float* tmp) {
+                    for (int i = lo; i < hi; i++) { tmp[i - lo] = x[i] / squeeze; }
+                    linalg::kernels::sigmoid(hi - lo, tmp, out + lo, accuracy);
+                });
+            }
+            void backward(int rows, int cols, const float* x, const float* grad, float* out) override
+            {
+                forChunks(rows * cols, [&](int lo, int hi, float* tmp) {
+                    for (int i = lo; i < hi; i++) { tmp[i - lo] = x[i] / squeeze; }
+                    linalg::kernels::sigmoid(hi - lo, tmp, tmp, accuracy);
+                    for (int i = lo; i < hi; i++) { out[i] = tmp[i - lo] * (1 - tmp[i - lo]) * grad[i]; }
+                });
+            }
+            void forwardBias(int rows, int cols, const float* x, int ldx, const float* bias, float* out, int ldo) override
+            {
+                AActFunction::forwardBias(rows, cols, x, ldx, bias, out, ldo);
             }
         public:
             float squeeze;
@@ -138,115 +370,181 @@ namespace func
         };
 
         //standard logistic function between -5 and 5, otherwise returns 0 and 1 respectively
-        class logisticLinearEnds : public AActFunction
+        class logisticLinearEnds : public ElementwiseAct<logisticLinearEnds>
         {
-            float forward(float x) override
+        public:
+            actType type() const override { return actType::logisticLinearEnds; }
+            float param() const override { return squeeze; }
+            float value(float x) const
             {
                 x = x / squeeze;
                 if (x > 5) return 1;
                 else if (x > -5) return 1 / (1 + exp(-x));
                 else return 0;
             }
-            float gradient(float x) override
+            float derivative(float x) const
             {
                 x = x / squeeze;
                 if (x > 5) return 0.0001;
-                else if (x > -5) return (exp(x) / pow((exp(x) + 1), 2));
+                else if (x > -5) {
+                    float s = 1 / (1 + exp(-x));
+                    return s * (1 - s);
+                }
                 else return -0.0001;
             }
+            void forward(int rows, int cols, const float* x, float* out) override
+            {
+                forChunks(rows * cols, [&](int lo, int hi, float* tmp) {
+                    for (int i = lo; i < hi; i++) { tmp[i - lo] = x[i] / squeeze; }
+                    linalg::kernels::sigmoid(hi - lo, tmp, tmp, accuracy);
+                    for (int i = lo; i < hi; i++) {
+                        float v = x[i] / squeeze;
+                        out[i] = v > 5 ? 1.f : v > -5 ? tmp[i - lo] : 0.f;
+                    }
+                });
+            }
+            void backward(int rows, int cols, const float* x, const float* grad, float* out) override
+            {
+                forChunks(rows * cols, [&](int lo, int hi, float* tmp) {
+                    for (int i = lo; i < hi; i++) { tmp[i - lo] = x[i] / squeeze; }
+                    linalg::kernels::sigmoid(hi - lo, tmp, tmp, accuracy);
+                    for (int i = lo; i < hi; i++) {
+                        float v = x[i] / squeeze, s = tmp[i - lo];
+                        out[i] = (v > 5 ? 0.0001f : v > -5 ? s * (1 - s) : -0.0001f) * grad[i];
+                    }
+                });
+            }
+            void forwardBias(int rows, int cols, const float* x, int ldx, const float* bias, float* out, int ldo) override
+            {
+                AActFunction::forwardBias(rows, cols, x, ldx, bias, out, ldo);
+            }
         public:
             float squeeze;
             logisticLinearEnds(float squeeze_ = 100) { squeeze = squeeze_; }
         };
 
-        //softmax function, not working as of now
+        //softmax over each row (sample): out_i = e^x_i / sum_j e^x_j. Use as the activation of the last layer for probabilities;
+        //for training a classifier, loss::SoftmaxCrossEntropy on the raw outputs is faster and more stable.
         class softMax : public AActFunction
         {
         public:
-            softMax()
-            {
-                std::cout << "\n\nWARNING: " << __FUNCTION__ << " not yet implemented\n\n\n";
-            }
+            actType type() const override { return actType::softMax; }
+            using AActFunction::forward;
+            using AActFunction::backward;
 
-            float forward(float x) override
-            {
-                if (x > 0) return x;
-                else return 0;
-            }
-            float backward(float x, float y) override
-            {
-                if (x >= 0) return y;
-                else return 0;
-            }
-            Vectorf forward(Vectorf& vec) override
+            //the softmax of a single value
+            float forward(float) override { return 1; }
+            float gradient(float) override { return 0; }
+            bool elementwise() const override { return false; }
+
+            void forward(int rows, int cols, const float* x, float* out) override
             {
-                Vectorf expVec(vec.size());
-                float expSum = 0;
-                for (size_t i = 0; i < expVec.size(); i++) {
-                    float e = exp(vec[i]);
-                    expVec[i] = e;
-                    expSum += e;
-                }
-                Vectorf newVec(vec.size());
-                for (size_t i = 0; i < vec.size(); i++) {
-                    newVec[i] = expVec[i] / expSum;
-                }
-                return newVec;
+                for (int r = 0; r < rows; r++) { softmaxRow(cols, x + (size_t)r * cols, out + (size_t)r * cols, accuracy); }
             }
-            Vectorf backward(Vectorf& sums, Vectorf& sumGrad) override
+            //The Jacobian-vector product of each row, out = p * (grad - (p . grad)) with p the softmax of the row.
+            void backward(int rows, int cols, const float* sums, const float* sumGrad, float* out) override
             {
-                Vectorf expVec(sums.size());
-                float expSum = 0;
-                for (size_t i = 0; i < expVec.size(); i++) {
-                    float e = exp(sums[i]);
-                    expVec[i] = e;
-                    expSum += e;
-                }
-                Vectorf newSumGrad(sums.size());
-                for (size_t i = 0; i < sums.size(); i++) {
-                    newSumGrad[i] = ((expSum * expVec[i]) / pow((expSum + expVec[i]), 2)) * sumGrad[i];
+                Vectorf p(cols);
+                for (int r = 0; r < rows; r++) {
+                    const float* g = sumGrad + (size_t)r * cols;
+                    float* outr = out + (size_t)r * cols;
+                    softmaxRow(cols, sums + (size_t)r * cols, p.nums.data(), accuracy);
+                    float pg = 0;
+                    for (int i = 0; i < cols; i++) { pg += p.nums[i] * g[i]; }
+                    for (int i = 0; i < cols; i++) { outr[i] = p.nums[i] * (g[i] - pg); }
                 }
-                return newSumGrad;
             }
         };
 
         //sine activation
-        class sinAct : public AActFunction
+        class sinAct : public ElementwiseAct<sinAct>
         {
-            float forward(float x) override
+        public:
+            actType type() const override { return actType::sinAct; }
+            float value(float x) const
             {
                 return (1 + sin(x)) / 2;
             }
-            float gradient(float x) override
+            float derivative(float x) const
             {
                 return cos(x) / 2;
             }
         };
 
         //exponential activation
-        class expAct : public AActFunction
+        class expAct : public ElementwiseAct<expAct>
         {
-            float forward(float x) override
+        public:
+            actType type() const override { return actType::expAct; }
+            float value(float x) const
             {
                 return exp(x);
             }
-            float gradient(float x) override
+            float derivative(float x) const
             {
                 return exp(x);
             }
+            void forward(int rows, int cols, const float* x, float* out) override { linalg::kernels::exp(rows * cols, x, out, accuracy); }
+            void forwardBias(int rows, int cols, const float* x, int ldx, const float* bias, float* out, int ldo) override
+            {
+                AActFunction::forwardBias(rows, cols, x, ldx, bias, out, ldo);
+            }
+            void backward(int rows, int cols, const float* x, const float* grad, float* out) override
+            {
+                forChunks(rows * cols, [&](int lo, int hi, float* tmp) {
+                    linalg::kernels::exp(hi - lo, x + lo, tmp, accuracy);
+                    for (int i = lo; i < hi; i++) { out[i] = tmp[i - lo] * grad[i]; }
+                });
+            }
+        };
+
+        //hyperbolic tangent
+        class tanhAct : public ElementwiseAct<tanhAct>
+        {
+        public:
+            actType type() const override { return actType::tanhAct; }
+            float value(float x) const
+            {
+                return std::tanh(x);
+            }
+            float derivative(float x) const
+            {
+                float t = std::tanh(x);
+                return 1 - t * t;
+            }
+            void forward(int rows, int cols, const float* x, float* out) override { linalg::kernels::tanh(rows * cols, x, out, accuracy); }
+            void forwardBias(int rows, int cols, const float* x, int ldx, const float* bias, float* out, int ldo) override
+            {
+                AActFunction::forwardBias(rows, cols, x, ldx, bias, out, ldo);
+            }
+            void backward(int rows, int cols, const float* x, const float* grad, float* out) override
+            {
+                forChunks(rows * cols, [&](int lo, int hi, float* tmp) {
+                    linalg::kernels::tanh(hi - lo, x + lo, tmp, accuracy);
+                    for (int i = lo; i < hi; i++) { out[i] = (1 - tmp[i - lo] * tmp[i - lo]) * grad[i]; }
+                });
+            }
         };
 
         //linear activation
-        class linear : public AActFunction
+        class linear : public ElementwiseAct<linear>
         {
-            float forward(float x) override
+        public:
+            actType type() const override { return actType::linear; }
+            float param() const override { return grad; }
+            float value(float x) const
             {
                 return grad * x;
             }
-            float gradient(float x) override
+            float derivative(float) const
             {
                 return grad;
             }
+            void forward(int rows, int cols, const float* x, float* out) override { linalg::kernels::scale(rows * cols, x, grad, out); }
+            void backward(int rows, int cols, const float*, const float* g, float* out) override
+            {
+                linalg::kernels::scale(rows * cols, g, grad, out);
+            }
         public:
             float grad;
             linear(float grad_ = 0.01F) { grad = grad_; }
@@ -259,6 +557,8 @@ namespace func
         //mean squared error loss
         class MSE : public ALossFunction
         {
+        public:
+            lossType type() const override { return lossType::MSE; }
             Vectorf forward(Vectorf& outs, Vectorf& labels) override
             {
                 Vectorf newVec(outs.size());
@@ -275,11 +575,23 @@ namespace func
                 }
                 return newVec;
             }
+            float lossSum(int rows, int cols, const float* outs, const float* labels) override
+            {
+                float loss = 0;
+                for (int i = 0; i < rows * cols; i++) { loss += (outs[i] - labels[i]) * (outs[i] - labels[i]); }
+                return loss / (2 * cols);
+            }
+            void gradient(int rows, int cols, const float* outs, const float* labels, float* grad) override
+            {
+                for (int i = 0; i < rows * cols; i++) { grad[i] = (outs[i] - labels[i]) / cols; }
+            }
         };
 
         //loss for logistic regression
         class Logistic : public ALossFunction
         {
+        public:
+            lossType type() const override { return lossType::Logistic; }
             Vectorf forward(Vectorf& outs, Vectorf& labels) override
             {
                 Vectorf newVec(outs.size());
@@ -294,24 +606,32 @@ namespace func
                 for (size_t i = 0; i < outs.size(); i++) {
                     newVec[i] = - (outs[i] - labels[i]) / (outs[i] * (1 - outs[i]));
                 }
-                newVec.print();
                 return newVec;
             }
+            float lossSum(int rows, int cols, const float* outs, const float* labels) override
+            {
+                float loss = 0;
+                for (int i = 0; i < rows * cols; i++) { loss += labels[i] * log(outs[i]) + (1 - labels[i]) * log(1 - outs[i]); }
+                return loss;
+            }
+            void gradient(int rows, int cols, const float* outs, const float* labels, float* grad) override
+            {
+                for (int i = 0; i < rows * cols; i++) { grad[i] = -(outs[i] - labels[i]) / (outs[i] * (1 - outs[i])); }
+            }
         };
 
-        //cross-entropy loss, not done yet
+        //cross-entropy loss of probabilities (e.g. the outputs of act::softMax). The outputs are clamped to CE_MIN_PROB,
+        //so neither the log nor the division blows up for a wrong prediction with a probability of (almost) zero.
+        constexpr float CE_MIN_PROB = 1e-7f;
         class CrossEntropy : public ALossFunction
         {
         public:
-            CrossEntropy()
-            {
-                std::cout << "\n\nWARNING: " << __FUNCTION__ << " not yet implemented\n\n\n";
-            }
+            lossType type() const override { return lossType::CrossEntropy; }
             Vectorf forward(Vectorf& netOut, Vectorf& label) override
             {
                 Vectorf newVec(netOut.size());
                 for (size_t i = 0; i < netOut.size(); i++) {
-                    newVec[i] = -(label[i] * log(netOut[i] + 0.00001));
+                    newVec[i] = -(label[i] * log(std::max(netOut[i], CE_MIN_PROB)));
                 }
                 return newVec;
             }
@@ -319,11 +639,133 @@ namespace func
             {
                 Vectorf newVec(netOut.size());
                 for (size_t i = 0; i < netOut.size(); i++) {
-                    newVec[i] = -(label[i] / netOut[i]);
+                    newVec[i] = -(label[i] / std::max(netOut[i], CE_MIN_PROB));
                 }
                 return newVec;
             }
+            float lossSum(int rows, int cols, const float* outs, const float* labels) override
+            {
+                float loss = 0;
+                for (int i = 0; i < rows * cols; i++) {
+                    if (labels[i] != 0) loss -= labels[i] * log(std::max(outs[i], CE_MIN_PROB));
+                }
+                return loss;
+            }
+            void gradient(int rows, int cols, const float* outs, const float* labels, float* grad) override
+            {
+                for (int i = 0; i < rows * cols; i++) { grad[i] = -(labels[i] / std::max(outs[i], CE_MIN_PROB)); }
+            }
         };
+
+        //Softmax and cross-entropy in one, on the raw outputs (logits) of the last layer, which should use act::linear(1).
+        //loss = -sum_i y_i * log(softmax(x)_i) = sum_i y_i * (logsumexp(x) - x_i), with the maximum subtracted inside the log-sum-exp.
+        //The gradient w.r.t the logits is p - y (p = softmax(x), labels summing to 1), computed in the same pass as p,
+        //so neither the softmax Jacobian nor a division by the probabilities appears. The outputs stay logits: the argmax is the
+        //predicted class, softmaxRow() gives the probabilities.
+        class SoftmaxCrossEntropy : public ALossFunction
+        {
+        public:
+            lossType type() const override { return lossType::SoftmaxCrossEntropy; }
+            linalg::kernels::mathMode accuracy; //accuracy of the exps, see fastmath.h
+        public:
+            SoftmaxCrossEntropy(linalg::kernels::mathMode accuracy_ = linalg::kernels::defaultMode) { accuracy = accuracy_; }
+            using ALossFunction::backward;
+            ALossFunction* clone() const override { return new SoftmaxCrossEntropy(accuracy); }
+
+            Vectorf forward(Vectorf& logits, Vectorf& labels) override
+            {
+                Vectorf newVec(logits.size());
+                float lse = softmaxRow(logits.size(), logits.nums.data(), newVec.nums.data(), accuracy);
+                for (int i = 0; i < logits.size(); i++) { newVec[i] = labels[i] * (lse - logits[i]); }
+                return newVec;
+            }
+            Vectorf backward(Vectorf& logits, Vectorf& labels) override
+            {
+                Vectorf newVec(logits.size());
+                backwardRow(logits.size(), logits.nums.data(), labels.nums.data(), newVec.nums.data());
+                return newVec;
+            }
+
+            //the gradient of the whole batch in one pass over the rows, split across the thread pool
+            void gradient(int rows, int cols, const float* logits, const float* labels, float* grad) override
+            {
+                linalg::parallel::parallelFor(rows, std::max(1, linalg::kernels::PARALLEL_MIN_ELEMS / std::max(1, cols)), [&](int lo, int hi) {
+                    for (int r = lo; r < hi; r++) {
+                        size_t at = (size_t)r * cols;
+                        backwardRow(cols, logits + at, labels + at, grad + at);
+                    }
+                });
+            }
+            float lossSum(int rows, int cols, const float* logits, const float* labels) override
+            {
+                float loss = 0;
+                for (int r = 0; r < rows; r++) { loss += lossRow(cols, logits + (size_t)r * cols, labels + (size_t)r * cols); }
+                return loss;
+            }
+        protected:
+            //out = softmax(x) * sum(y) - y, which is p - y for labels summing to 1
+            void backwardRow(int n, const float* x, const float* y, float* out) const
+            {
+                softmaxRow(n, x, out, accuracy);
+                float ySum = 0;
+                for (int i = 0; i < n; i++) { ySum += y[i]; }
+                for (int i = 0; i < n; i++) { out[i] = out[i] * ySum - y[i]; }
+            }
+            //log-sum-exp without storing the probabilities
+            float lossRow(int n, const float* x, const float* y) const
+            {
+                float max = x[0];
+                for (int i = 1; i < n; i++) { max = std::max(max, x[i]); }
+                float expSum = 0;
+                for (int i = 0; i < n; i++) { expSum += std::exp(x[i] - max); }
+                float lse = max + std::log(expSum);
+                float loss = 0;
+                for (int i = 0; i < n; i++) { loss += y[i] * (lse - x[i]); }
+                return loss;
+            }
+        };
+    }
+
+    //Create an activation function from its type() and param(), e.g. when loading a model.
+    inline AActFunction* makeAct(actType type, float param)
+    {
+        switch (type) {
+        case actType::reLU: return new act::reLU();
+        case actType::lReLU: return new act::lReLU(param);
+        case actType::sigmoid: return new act::sigmoid(param);
+        case actType::logisticLinearEnds: return new act::logisticLinearEnds(param);
+        case actType::softMax: return new act::softMax();
+        case actType::sinAct: return new act::sinAct();
+        case actType::expAct: return new act::expAct();
+        case actType::tanhAct: return new act::tanhAct();
+        case actType::linear: return new act::linear(param);
+        default: throw std::runtime_error("makeAct: unknown activation type " + std::to_string((int)type));
+        }
+    }
+
+    //Create a loss function from its type().
+    inline ALossFunction* makeLoss(lossType type)
+    {
+        switch (type) {
+        case lossType::MSE: return new loss::MSE();
+        case lossType::Logistic: return new loss::Logistic();
+        case lossType::CrossEntropy: return new loss::CrossEntropy();
+        case lossType::SoftmaxCrossEntropy: return new loss::SoftmaxCrossEntropy();
+        default: throw std::runtime_error("makeLoss: unknown loss type " + std::to_string((int)type));
+        }
+    }
+
+    inline AActFunction* AActFunction::clone() const
+    {
+        if (type() == actType::custom) throw std::runtime_error("clone: a custom activation must override clone()");
+        AActFunction* f = makeAct(type(), param());
+        f->accuracy = accuracy;
+        return f;
+    }
+    inline ALossFunction* ALossFunction::clone() const
+    {
+        if (type() == lossType::custom) throw std::runtime_error("clone: a custom loss must override clone()");
+        return makeLoss(type());
     }
 
     //weight initialization functions
@@ -0,0 +1,174 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include "alloc.h"
+#include "threads.h"
+
+//Cache-blocked matrix multiplication engine behind linalg's Matrix * Matrix.
+//Same scheme as GotoBLAS/BLIS: B is packed into KC*NC panels that stay in L3, A into MC*KC blocks
+//that stay in L2, and the micro-kernel keeps a MR*NR tile of C in registers while streaming both panels from L1.
+namespace linalg
+{
+    namespace kernels
+    {
+        constexpr int GEMM_MR = 6; //rows of the register tile
+        constexpr int GEMM_NR = 16; //columns of the register tile
+        constexpr int GEMM_KC = 256; //depth of the packed panels, a MR*KC and a KC*NR sliver fit in L1
+        constexpr int GEMM_MC = 96; //rows of a packed block of A, MC*KC fits in L2
+        constexpr int GEMM_NC = 2048; //columns of a packed block of B, KC*NC fits in L3
+        constexpr long long GEMM_MIN_WORK = 48 * 48 * 48; //below m*n*k = this, packing costs more than it saves
+        constexpr long long GEMM_PARALLEL_WORK = 128 * 128 * 128; //from m*n*k = this on, the blocks are spread over the thread pool
+        constexpr int GEMM_NC_TASK = 8 * GEMM_NR; //columns of a packed B block handled by one task
+
+        //Copy a mc*kc block of A into MR-row panels, each stored k-major (a[k * MR + i]). Short panels are zero padded.
+        //A(i, k) is at A[i * rsa + k * csa], so transposed operands are packed straight from their original layout.
+        template <class T>
+        void packA(int mc, int kc, const T* A, int rsa, int csa, T* packed)
+        {
+            for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                int mr = std::min(GEMM_MR, mc - ir);
+                for (int k = 0; k < kc; k++) {
+                    for (int i = 0; i < mr; i++) { packed[i] = A[(size_t)(ir + i) * rsa + (size_t)k * csa]; }
+                    for (int i = mr; i < GEMM_MR; i++) { packed[i] = 0; }
+                    packed += GEMM_MR;
+                }
+            }
+        }
+
+        //Copy a kc*nc block of B into NR-column panels, each stored k-major (b[k * NR + j]). Short panels are zero padded.
+        //B(k, j) is at B[k * rsb + j * csb].
+        template <class T>
+        void packB(int kc, int nc, const T* B, int rsb, int csb, T* packed)
+        {
+            for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                int nr = std::min(GEMM_NR, nc - jr);
+                for (int k = 0; k < kc; k++) {
+                    const T* row = B + (size_t)k * rsb + (size_t)jr * csb;
+                    if (csb == 1) { for (int j = 0; j < nr; j++) { packed[j] = row[j]; } }
+                    else { for (int j = 0; j < nr; j++) { packed[j] = row[(size_t)j * csb]; } }
+                    for (int j = nr; j < GEMM_NR; j++) { packed[j] = 0; }
+                    packed += GEMM_NR;
+                }
+            }
+        }
+
+        //Multiply a packed MR*kc panel of A by a packed kc*NR panel of B, scale by alpha and write the top-left mr*nr part into C.
+        //IN: depth, scale, packed panels, C tile and its row stride, valid rows/cols of the tile, add to C instead of overwriting
+        template <class T>
+        void microKernel(int kc, T alpha, const T* a, const T* b, T* C, int ldc, int mr, int nr, bool accumulate)
+        {
+            T ab[GEMM_MR][GEMM_NR] = {};
+            for (int k = 0; k < kc; k++) {
+                for (int i = 0; i < GEMM_MR; i++) {
+                    T ai = a[i];
+                    for (int j = 0; j < GEMM_NR; j++) { ab[i][j] += ai * b[j]; }
+                }
+                a += GEMM_MR;
+                b += GEMM_NR;
+            }
+            for (int i = 0; i < mr; i++) {
+                T* row = C + i * ldc;
+                if (accumulate) { for (int j = 0; j < nr; j++) { row[j] += alpha * ab[i][j]; } }
+                else { for (int j = 0; j < nr; j++) { row[j] = alpha * ab[i][j]; } }
+            }
+        }
+
+        //Returns the (64-byte aligned) packing buffers of the calling thread, grown on demand and reused between calls.
+        template <class T>
+        T* packBuffer(int which, size_t size)
+        {
+            thread_local storage<T> buffers[2];
+            if (buffers[which].size() < size) buffers[which].resize(size);
+            return buffers[which].data();
+        }
+
+        //Epilogue of gemm() that does nothing.
+        struct noEpilogue
+        {
+            void operator () (int, int, int, int) const {}
+        };
+
+        //C = alpha * A * B + beta * C for A (m*k), B (k*n) with arbitrary row/column strides and row-major C (m*n).
+        //Like in BLAS, C is not read if beta is 0. A transposed operand is passed by swapping its strides.
+        //epilogue(i0, j0, rows, cols) is called on each finished strip of C (at most MC*NR, starting at C(i0, j0)) right after its last
+        //micro-kernel, while the strip is still in L1, e.g. to add a bias and apply an activation function without another pass over C.
+        //It runs on the thread that computed the strip, so it must be safe to call concurrently on disjoint strips.
+        //IN: dimensions, scale of the product, operands with their row and column strides, scale of C, C with its row stride, epilogue
+        template <class T, class E>
+        void gemm(int m, int n, int k, T alpha, const T* A, int rsa, int csa, const T* B, int rsb, int csb, T beta, T* C, int ldc, E epilogue)
+        {
+            if (m <= 0 || n <= 0) return;
+            if (beta != T(0) && beta != T(1)) {
+                for (int i = 0; i < m; i++) {
+                    for (int j = 0; j < n; j++) { C[(size_t)i * ldc + j] *= beta; }
+                }
+            }
+            bool accumulate = beta != T(0);
+            if (k <= 0 || alpha == T(0)) {
+                if (!accumulate) { for (int i = 0; i < m; i++) { std::fill(C + (size_t)i * ldc, C + (size_t)i * ldc + n, T(0)); } }
+                epilogue(0, 0, m, n);
+                return;
+            }
+            int maxMC = std::min(GEMM_MC, m) + GEMM_MR;
+            int maxNC = std::min(GEMM_NC, n) + GEMM_NR;
+            T* packedB = packBuffer<T>(1, (size_t)maxNC * GEMM_KC);
+            bool threaded = (long long)m * n * k >= GEMM_PARALLEL_WORK;
+
+            for (int jc = 0; jc < n; jc += GEMM_NC) {
+                int nc = std::min(GEMM_NC, n - jc);
+                for (int pc = 0; pc < k; pc += GEMM_KC) {
+                    int kc = std::min(GEMM_KC, k - pc);
+                    bool acc = accumulate || pc > 0;
+                    bool last = pc + kc == k;
+                    packB(kc, nc, B + (size_t)pc * rsb + (size_t)jc * csb, rsb, csb, packedB);
+
+                    //One task per (MC block of A, GEMM_NC_TASK columns of the packed B): it packs its block of A
+                    //into the packing buffer of the thread running it and writes a disjoint tile of C.
+                    int mBlocks = (m + GEMM_MC - 1) / GEMM_MC;
+                    int nBlocks = threaded ? (nc + GEMM_NC_TASK - 1) / GEMM_NC_TASK : 1;
+                    int nPerTask = threaded ? GEMM_NC_TASK : nc;
+                    int tasks = mBlocks * nBlocks;
+                    parallel::parallelFor(tasks, threaded ? 1 : tasks, [&](int lo, int hi) {
+                        T* packedA = packBuffer<T>(0, (size_t)maxMC * GEMM_KC);
+                        for (int t = lo; t < hi; t++) {
+                            int ic = t / nBlocks * GEMM_MC;
+                            int mc = std::min(GEMM_MC, m - ic);
+                            int j0 = t % nBlocks * nPerTask;
+                            int j1 = std::min(nc, j0 + nPerTask);
+                            packA(mc, kc, A + (size_t)ic * rsa + (size_t)pc * csa, rsa, csa, packedA);
+                            for (int jr = j0; jr < j1; jr += GEMM_NR) {
+                                for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                                    microKernel(kc, alpha, packedA + ir * kc, packedB + jr * kc, C + (size_t)(ic + ir) * ldc + jc + jr, ldc,
+                                        std::min(GEMM_MR, mc - ir), std::min(GEMM_NR, nc - jr), acc);
+                                }
+                                if (last) epilogue(ic, jc + jr, mc, std::min(GEMM_NR, nc - jr));
+                            }
+                        }
+                    });
+                }
+            }
+        }
+
+        template <class T>
+        void gemm(int m, int n, int k, T alpha, const T* A, int rsa, int csa, const T* B, int rsb, int csb, T beta, T* C, int ldc)
+        {
+            gemm(m, n, k, alpha, A, rsa, csa, B, rsb, csb, beta, C, ldc, noEpilogue());
+        }
+
+        //C = A * B (or C += A * B) for A (m*k), B (k*n) with arbitrary row/column strides and row-major C (m*n).
+        //IN: dimensions, operands with their row and column strides, C with its row stride, add to C instead of overwriting
+        template <class T>
+        void gemm(int m, int n, int k, const T* A, int rsa, int csa, const T* B, int rsb, int csb, T* C, int ldc, bool accumulate = false)
+        {
+            gemm(m, n, k, T(1), A, rsa, csa, B, rsb, csb, accumulate ? T(1) : T(0), C, ldc);
+        }
+
+        //C = A * B (or C += A * B) for row-major A (m*k), B (k*n) and C (m*n).
+        //IN: dimensions, operands with their row strides, add to C instead of overwriting
+        template <class T>
+        void gemm(int m, int n, int k, const T* A, int lda, const T* B, int ldb, T* C, int ldc, bool accumulate = false)
+        {
+            gemm(m, n, k, T(1), A, lda, 1, B, ldb, 1, accumulate ? T(1) : T(0), C, ldc);
+        }
+    }
+}
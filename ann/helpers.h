@@ -14,6 +14,8 @@
 #include "func.h"
 #include "data.h"
 #include "linalg.h"
+#include "metrics.h"
+#include "trainer.h"
 
 namespace helpers
 {
@@ -131,55 +133,53 @@ namespace helpers
     }
 
 
-    void trainLoop(nnet::Network& net, optim::SGD& optimizer, data::DataLoader& trainLoader, int verbose = 1)
+    //One epoch of training. With a DataParallel trainer for net, each batch is split across its workers.
+    void trainLoop(nnet::Network& net, optim::SGD& optimizer, data::DataLoader& trainLoader, int verbose = 1, nnet::DataParallel* parallel = nullptr)
     {
         int i = 0;
-        float avgLoss = 0;
-        int numRight = 0;
         int printSpeed = 5000;
+        data::Matrixf inputs, labels; //the batch, one item per row
+        metrics::Metrics stats; //loss and accuracy since the last print
         trainLoader.reset();
         while (!trainLoader.endReached())
         {
-            float batAvgLoss = 0;
-            int predDigit, labelDigit;
             data::Batch bat = trainLoader.next();
+            data::toMatrices(bat, inputs, labels);
 
+            //the whole batch goes through the network at once
             optimizer.zeroGrad();
-            for (size_t i = 0; i < bat.size(); i++)
-            {
-                net.forward(*bat[i].input);
-                batAvgLoss += net.lossFunc(*net.output, *bat[i].label);
-                predDigit = distance((*net.output).nums.begin(), max_element((*net.output).nums.begin(), (*net.output).nums.end()));
-                labelDigit = distance((*bat[i].label).nums.begin(), max_element((*bat[i].label).nums.begin(), (*bat[i].label).nums.end()));
-                if (predDigit == labelDigit) numRight++;
-                net.backward(*bat[i].label);
+            if (parallel) parallel->trainStep(inputs, labels, verbose > 0 ? &stats : nullptr);
+            else {
+                net.forward(inputs);
+                if (verbose > 0) stats.add(&net.lossFunc, *net.batchOutput, labels);
+                net.backward(labels);
             }
             optimizer.step();
 
-            avgLoss += batAvgLoss / bat.size();
             int amount = ((10000 - printSpeed) / bat.size());
             if (verbose > 0 && ++i % amount == 0) {
-                avgLoss /= amount;
+                float avgLoss = stats.avgLoss();
                 if (verbose == 1) {
                     std::cout << std::fixed;
                     std::cout << std::setprecision(5);
-                    std::cout << "Average loss over " << bat.size() * amount << " items: " << avgLoss;
+                    std::cout << "Average loss over " << stats.count << " items: " << avgLoss;
                     std::cout << std::setprecision(2);
-                    std::cout << ", correctly predicted " << (float)(numRight * 100) / (bat.size() * amount) << "%\n";
+                    std::cout << ", correctly predicted " << stats.accuracy() * 100 << "%\n";
                 }
                 else if (verbose >= 2) {
                     std::cout << std::fixed;
                     std::cout << std::setprecision(3);
-                    net.output->print("latest output: ", "\n", false);
+                    //the last sample went through the last worker
+                    const data::Matrixf& outs = parallel ? *parallel->replica(parallel->numWorkers() - 1).batchOutput : *net.batchOutput;
+                    data::Vectorf(outs.view().row(outs.rows - 1)).print("latest output: ", "\n", false);
                     bat[bat.size() - 1].label->print("latest label : ", "\n", false);
                     std::cout << std::setprecision(6);
                     std::cout << "learning rate: " << optimizer.learnRate << std::endl;
                     std::cout << "Average loss over " << amount << " batches (size=" << bat.size() << "): " << avgLoss << std::endl;
-                    std::cout << "Correctly predicted of " << bat.size() * amount
-                        << " items: " << (float)(numRight * 100) / (bat.size() * amount) << "%\n\n";
+                    std::cout << "Correctly predicted of " << stats.count
+                        << " items: " << stats.accuracy() * 100 << "%\n\n";
                 }
-                avgLoss = 0;
-                numRight = 0;
+                stats.reset();
             }
         }
     }
@@ -187,29 +187,30 @@ namespace helpers
     void testNet(nnet::Network& net, data::DataLoader& testLoader)
     {
         data::Batch bat = testLoader.all();
+        const int testBatchSize = 256; //items per forward pass
 
-        float avgLoss = 0;
-        int numRight = 0;
-        for (size_t i = 0; i < bat.size(); i++) {
-            net.forward(*bat[i].input);
-            avgLoss += net.lossFunc(*net.output, *bat[i].label);
-            int predDigit = distance((*net.output).nums.begin(), max_element((*net.output).nums.begin(), (*net.output).nums.end()));
-            int labelDigit = distance((*bat[i].label).nums.begin(), max_element((*bat[i].label).nums.begin(), (*bat[i].label).nums.end()));
-            if (predDigit == labelDigit) { numRight++; }
+        metrics::Metrics stats(net.layers.back()->outSize);
+        data::Matrixf inputs, labels;
+        for (int first = 0; first < (int)bat.size(); first += testBatchSize) {
+            data::toMatrices(bat, inputs, labels, first, std::min(testBatchSize, (int)bat.size() - first));
+            net.forward(inputs);
+            stats.add(&net.lossFunc, *net.batchOutput, labels);
         }
 
-        std::cout << "\nAverage loss over " << bat.size() << " items: " << avgLoss / bat.size() << std::endl;
-        std::cout << "Correctly predicted " << (numRight * 100.0) / bat.size() << "%\n\n";
+        std::cout << "\n";
+        stats.print();
+        std::cout << "\n";
     }
 
-    void trainAndTestNet(nnet::Network& net, optim::SGD& optimizer, data::DataLoader& trainLoader, data::DataLoader& testLoader, int verbose = 1)
+    void trainAndTestNet(nnet::Network& net, optim::SGD& optimizer, data::DataLoader& trainLoader, data::DataLoader& testLoader, int verbose = 1,
+        nnet::DataParallel* parallel = nullptr)
     {
         int epoch = 0;
         std::cout << "Start train\n";
         while (true) {
             epoch++;
             Timer t;
-            trainLoop(net, optimizer, trainLoader, verbose);
+            trainLoop(net, optimizer, trainLoader, verbose, parallel);
             std::cout << "Epoch " << epoch << " complete in " << t.seconds() << " seconds.\n";
             while (true) {
                 std::cout << std::setprecision(5);
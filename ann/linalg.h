@@ -9,6 +9,12 @@
 #include <random>
 #include <stdarg.h>
 #include <stdlib.h>
+#include "alloc.h"
+#include "threads.h"
+#include "gemm.h"
+#include "simd.h"
+#include "expr.h"
+#include "view.h"
 
 #define NUMERIC_ONLY(T) T, typename = typename std::enable_if<std::is_arithmetic<T>::value, T>::type
 
@@ -23,6 +29,23 @@ namespace linalg
     //uniform: matrix with each element on a uniform distribution from (first arg) to (second arg)
     //normal: matrix with each element on a normal distribution with mean (first arg) and standard deviation (second arg)
     enum initType { zeros, ones, number, identity, uniform, normal };
+
+    //Fill out[0..n) with samples of dis. Blocks of RANDOM_BLOCK elements are filled in parallel,
+    //each from its own engine seeded with one random_device draw plus the block index.
+    constexpr int RANDOM_BLOCK = 1 << 16;
+    template <class T, class Dist>
+    void fillRandom(int n, Dist dis, T* out)
+    {
+        std::random_device dev;
+        unsigned seed = dev();
+        parallel::parallelFor((n + RANDOM_BLOCK - 1) / RANDOM_BLOCK, 1, [&](int lo, int hi) {
+            for (int b = lo; b < hi; b++) {
+                std::default_random_engine gen(seed + b);
+                Dist d = dis;
+                for (int i = b * RANDOM_BLOCK; i < std::min(n, (b + 1) * RANDOM_BLOCK); i++) { out[i] = d(gen); }
+            }
+        });
+    }
     template <class NUMERIC_ONLY(T)>
     class Matrix;
 
@@ -30,40 +53,54 @@ namespace linalg
     class Vector
     {
     public:
-        std::vector<T> nums;
+        storage<T> nums; //64-byte aligned, from the per-thread pool in alloc.h
     public:
         Vector()
         {
-            nums = std::vector<T>();
+            nums = storage<T>();
         }
         Vector(int s, T* varr = NULL)
         {
             if (varr != NULL) { nums.assign(varr, varr + s); }
-            else nums = std::vector<T>(s);
+            else nums = storage<T>(s);
         }
         Vector(std::vector<T> varr)
         {
-            nums = varr;
+            nums.assign(varr.begin(), varr.end());
         }
         Vector(Matrix<T>& mat)
         {
             nums = mat.nums;
         }
+        //Copy the elements of a view.
+        template <class U>
+        explicit Vector(const VectorView<U>& v)
+        {
+            nums = storage<T>(v.size());
+            for (int i = 0; i < size(); i++) { nums[i] = v[i]; }
+        }
+        //Evaluate an elementwise expression (e.g. a + b * 2) in one pass.
+        template <class E>
+        Vector(const VectorExpr<T, E>& ex)
+        {
+            nums = storage<T>(ex.size());
+            expr::assign(size(), ex.e, nums.data());
+        }
         Vector(std::initializer_list<T> initNums)
         {
             int s = std::distance(initNums.begin(), initNums.end());
-            nums = std::vector<T>(s);
+            nums = storage<T>(s);
             int i = 0;
             for (T num : initNums) { nums[i] = num; i++; }
         }
         Vector(int s, std::function<T(int)> initFunc)
         {
-            nums = std::vector<T>(s);
+            nums = storage<T>(s);
             for (int i = 0; i < size; i++) { nums[i] = initFunc(i); }
         }
         Vector(int s, initType type, std::initializer_list<T> args = {})
         {
-            nums = std::vector<T>(s);
+            nums = storage<T>(s);
         retryInitType:
             switch (type)
             {
@@ -89,10 +126,7 @@ namespace linalg
                         min = *(args.begin());
                         if (args.size() > 1) { max = *(args.end() - 1); }
                     }
-                    std::random_device dev;
-                    std::default_random_engine gen(dev());
-                    std::uniform_real_distribution<T> dis(min, max);
-                    for (int i = 0; i < size(); i++) { nums[i] = dis(gen); }
+                    fillRandom(size(), std::uniform_real_distribution<T>(min, max), nums.data());
                 }
                 break;
             }
@@ -105,10 +139,7 @@ namespace linalg
                         mean = *(args.begin());
                         if (args.size() > 1) { stddev = *(args.end() - 1); }
                     }
-                    std::random_device dev;
-                    std::default_random_engine gen(dev());
-                    std::normal_distribution<T> dis(mean, stddev);
-                    for (int i = 0; i < size(); i++) { nums[i] = dis(gen); }
+                    fillRandom(size(), std::normal_distribution<T>(mean, stddev), nums.data());
                 }
                 break;
             }
@@ -152,26 +183,20 @@ namespace linalg
             return sqrt(res);
         }
 
-        T dot(Vector vec)
+        T dot(const Vector& vec) const
         {
-            T res = 0;
-            for (int i = 0; i < size(); i++) { res += nums[i] * vec.nums[i]; }
-            return res;
+            return kernels::dot(size(), nums.data(), vec.nums.data());
         }
 
         Matrix<T> transposed()
         {
-            Matrix<T> newMat(size(), 1, nums);
+            Matrix<T> newMat(size(), 1, *this);
             return newMat;
         }
 
-        T sum()
+        T sum() const
         {
-            T res = 0;
-            for (int i = 0; i < size(); i++) {
-                res += nums[i];
-            }
-            return res;
+            return kernels::sum(size(), nums.data());
         }
 
         Matrix<T> asMatrix(int m = 1, int n = -1)
@@ -181,6 +206,22 @@ namespace linalg
             return newMat;
         }
 
+        //Non-owning views of the elements, see view.h. Same shapes as the copying versions above.
+        VectorView<T> view() { return VectorView<T>(nums.data(), size()); }
+        VectorView<const T> view() const { return VectorView<const T>(nums.data(), size()); }
+        MatrixView<T> transposedView() { return view().transposed(); }
+        MatrixView<const T> transposedView() const { return view().transposed(); }
+        MatrixView<T> asMatrixView(int m = 1, int n = -1) { return view().asMatrix(m, n); }
+        MatrixView<const T> asMatrixView(int m = 1, int n = -1) const { return view().asMatrix(m, n); }
+
+        template <class E>
+        Vector& operator = (const VectorExpr<T, E>& ex)
+        {
+            nums.resize(ex.size());
+            expr::assign(size(), ex.e, nums.data());
+            return *this;
+        }
+
         T& operator [] (int i) { return nums[i]; }
     };
 
@@ -188,7 +229,7 @@ namespace linalg
     class Matrix
     {
     public:
-        std::vector<T> nums;
+        storage<T> nums; //64-byte aligned, from the per-thread pool in alloc.h
         int rows;
         int cols;
     public:
@@ -196,20 +237,20 @@ namespace linalg
         {
             rows = 0;
             cols = 0;
-            nums = std::vector<T>();
+            nums = storage<T>();
         }
         Matrix(int m, int n, T* marr = NULL)
         {
             rows = m;
             cols = n;
             if (marr != NULL) { nums.assign(marr, marr + m * n); }
-            else nums = std::vector<T>(m * n);
+            else nums = storage<T>(m * n);
         }
         Matrix(int m, int n, std::vector<T> marr)
         {
             rows = m;
             cols = n;
-            nums = marr;
+            nums.assign(marr.begin(), marr.end());
         }
         Matrix(int m, int n, Vector<T>& vec)
         {
@@ -217,11 +258,31 @@ namespace linalg
             cols = n;
             nums = vec.nums;
         }
+        //Copy the elements of a view (e.g. to materialize a transposed view).
+        template <class U>
+        explicit Matrix(const MatrixView<U>& v)
+        {
+            rows = v.rows;
+            cols = v.cols;
+            nums = storage<T>(v.size());
+            for (int i = 0; i < rows; i++) {
+                for (int j = 0; j < cols; j++) { nums[i * cols + j] = v(i, j); }
+            }
+        }
+        //Evaluate an elementwise expression (e.g. a + b * 2) in one pass.
+        template <class E>
+        Matrix(const MatrixExpr<T, E>& ex)
+        {
+            rows = ex.rows;
+            cols = ex.cols;
+            nums = storage<T>(ex.size());
+            expr::assign(size(), ex.e, nums.data());
+        }
         Matrix(int m, int n, std::initializer_list<T> initNums)
         {
             rows = m;
             cols = n;
-            nums = std::vector<T>(m * n);
+            nums = storage<T>(m * n);
             int i = 0;
             for (T num : initNums) { nums[i] = num; i++; }
         }
@@ -229,14 +290,14 @@ namespace linalg
         {
             rows = m;
             cols = n;
-            nums = std::vector<T>(m * n);
+            nums = storage<T>(m * n);
             for (int i = 0; i < size; i++) { nums[i] = initFunc(i); }
         }
         Matrix(int m, int n, initType type, std::initializer_list<T> args = {})
         {
             rows = m;
             cols = n;
-            nums = std::vector<T>(m * n);
+            nums = storage<T>(m * n);
             switch (type)
             {
             case linalg::zeros:
@@ -259,10 +320,7 @@ namespace linalg
                     T min = -1, max = 1;
                     if (args.size() > 0) { min = *(args.begin());
                         if (args.size() > 1) { max = *(args.end() - 1); } }
-                    std::random_device dev;
-                    std::default_random_engine gen(dev());
-                    std::uniform_real_distribution<T> dis(min, max);
-                    for (int i = 0; i < size(); i++) { nums[i] = dis(gen); }
+                    fillRandom(size(), std::uniform_real_distribution<T>(min, max), nums.data());
                 }
                 break;
             }
@@ -274,10 +332,7 @@ namespace linalg
                     if (args.size() > 0) { mean = *(args.begin());
                         if (args.size() > 1) { stddev = *(args.end() - 1); }
                     }
-                    std::random_device dev;
-                    std::default_random_engine gen(dev());
-                    std::normal_distribution<T> dis(mean, stddev);
-                    for (int i = 0; i < size(); i++) { nums[i] = dis(gen); }
+                    fillRandom(size(), std::normal_distribution<T>(mean, stddev), nums.data());
                 }
                 break;
             }
@@ -365,13 +420,9 @@ namespace linalg
             return eigenVecs;
         }
 
-        T sum()
+        T sum() const
         {
-            T res = 0;
-            for (int i = 0; i < size; i++) {
-                res += nums[i];
-            }
-            return res;
+            return kernels::sum(size(), nums.data());
         }
 
         Vector<T> asVector()
@@ -379,7 +430,27 @@ namespace linalg
             Vector<T> newVec(*this);
             return newVec;
         }
+
+        //Non-owning views of the elements, see view.h. Rows, columns and blocks are taken from view().
+        MatrixView<T> view() { return MatrixView<T>(nums.data(), rows, cols); }
+        MatrixView<const T> view() const { return MatrixView<const T>(nums.data(), rows, cols); }
+        MatrixView<T> transposedView() { return view().transposed(); }
+        MatrixView<const T> transposedView() const { return view().transposed(); }
+        MatrixView<T> reshapedView(int m, int n = -1) { return view().reshaped(m, n); }
+        MatrixView<const T> reshapedView(int m, int n = -1) const { return view().reshaped(m, n); }
+        VectorView<T> asVectorView() { return view().asVector(); }
+        VectorView<const T> asVectorView() const { return view().asVector(); }
        
+        template <class E>
+        Matrix& operator = (const MatrixExpr<T, E>& ex)
+        {
+            rows = ex.rows;
+            cols = ex.cols;
+            nums.resize(ex.size());
+            expr::assign(size(), ex.e, nums.data());
+            return *this;
+        }
+
         T* operator [](int m) { return &(nums[m * cols]); }
     };
 
@@ -392,60 +463,122 @@ namespace linalg
         return true;
     }
 
+    //Matrix, Vector and their expressions as operands of the elementwise operators: the node that reads their elements.
+    //Types that aren't matrix (vector) operands have no node, which takes the operator templates out of overload resolution.
+    template <class X>
+    struct matOperand { static const bool value = false; };
     template <class T>
-    Matrix<T> operator + (const Matrix<T>& X, const Matrix<T>& Y)
+    struct matOperand<Matrix<T>>
     {
-        Matrix<T> newMat(X.rows, X.cols);
-        for (int i = 0; i < X.size(); i++) { newMat.nums[i] = X.nums[i] + Y.nums[i]; }
-        return newMat;
+        static const bool value = true;
+        typedef T type;
+        typedef expr::leaf<T> node;
+        static node get(const Matrix<T>& X) { return { X.nums.data() }; }
+    };
+    template <class T, class E>
+    struct matOperand<MatrixExpr<T, E>>
+    {
+        static const bool value = true;
+        typedef T type;
+        typedef E node;
+        static node get(const MatrixExpr<T, E>& X) { return X.e; }
+    };
+    template <class T>
+    struct matOperand<MatrixView<T>>
+    {
+        static const bool value = true;
+        typedef typename std::remove_const<T>::type type;
+        typedef expr::strided2d<type> node;
+        static node get(const MatrixView<T>& X) { return { X.data, X.cols, X.rowStride, X.colStride }; }
+    };
+    template <class Op, class X, class Y>
+    using matBinary = MatrixExpr<typename matOperand<X>::type, expr::binary<Op, typename matOperand<X>::node, typename matOperand<Y>::node>>;
+    template <class Op, class X>
+    using matScalar = MatrixExpr<typename matOperand<X>::type,
+        expr::binary<Op, typename matOperand<X>::node, expr::scalar<typename matOperand<X>::type>>>;
+
+    template <class X>
+    struct vecOperand { static const bool value = false; };
+    template <class T>
+    struct vecOperand<Vector<T>>
+    {
+        static const bool value = true;
+        typedef T type;
+        typedef expr::leaf<T> node;
+        static node get(const Vector<T>& X) { return { X.nums.data() }; }
+    };
+    template <class T, class E>
+    struct vecOperand<VectorExpr<T, E>>
+    {
+        static const bool value = true;
+        typedef T type;
+        typedef E node;
+        static node get(const VectorExpr<T, E>& X) { return X.e; }
+    };
+    template <class T>
+    struct vecOperand<VectorView<T>>
+    {
+        static const bool value = true;
+        typedef typename std::remove_const<T>::type type;
+        typedef expr::strided<type> node;
+        static node get(const VectorView<T>& X) { return { X.data, X.stride }; }
+    };
+    template <class Op, class X, class Y>
+    using vecBinary = VectorExpr<typename vecOperand<X>::type, expr::binary<Op, typename vecOperand<X>::node, typename vecOperand<Y>::node>>;
+    template <class Op, class X>
+    using vecScalar = VectorExpr<typename vecOperand<X>::type,
+        expr::binary<Op, typename vecOperand<X>::node, expr::scalar<typename vecOperand<X>::type>>>;
+
+    template <class X, class Y>
+    matBinary<expr::add, X, Y> operator + (const X& A, const Y& B)
+    {
+        return { { matOperand<X>::get(A), matOperand<Y>::get(B) }, A.rows, A.cols };
     }
-    template <class T, class NUMERIC_ONLY(U)>
-    Matrix<T> operator + (const Matrix<T>& X, U a)
+    template <class X, class NUMERIC_ONLY(U)>
+    matScalar<expr::add, X> operator + (const X& A, U a)
     {
-        Matrix<T> newMat(X.rows, X.cols);
-        for (int i = 0; i < X.size; i++) { newMat.nums[i] = X.nums[i] + a; }
-        return newMat;
+        return { { matOperand<X>::get(A), { (typename matOperand<X>::type)a } }, A.rows, A.cols };
     }
-    template <class T>
-    Matrix<T>& operator += (Matrix<T>& X, const Matrix<T>& Y) {
-        for (int i = 0; i < X.size(); i++) { (X.nums)[i] += (Y.nums)[i]; }
+    template <class T, class Y>
+    typename std::enable_if<matOperand<Y>::value, Matrix<T>&>::type operator += (Matrix<T>& X, const Y& B)
+    {
+        expr::addAssign(X.size(), matOperand<Y>::get(B), X.nums.data());
         return X;
     }
     template <class T, class NUMERIC_ONLY(U)>
     Matrix<T>& operator += (Matrix<T>& X, U a)
     {
-        for (int i = 0; i < X.size; i++) { X.nums[i] += a; }
+        for (int i = 0; i < X.size(); i++) { X.nums[i] += a; }
         return X;
     }
 
-    template <class T>
-    Matrix<T> operator - (const Matrix<T>& X, const Matrix<T>& Y)
+    template <class X, class Y>
+    matBinary<expr::sub, X, Y> operator - (const X& A, const Y& B)
     {
-        Matrix<T> newMat(X.rows, X.cols);
-        for (int i = 0; i < X.size; i++) { newMat.nums[i] = X.nums[i] - Y.nums[i]; }
-        return newMat;
+        return { { matOperand<X>::get(A), matOperand<Y>::get(B) }, A.rows, A.cols };
     }
-    template <class T, class NUMERIC_ONLY(U)>
-    Matrix<T> operator - (const Matrix<T>& X, U a)
+    template <class X, class NUMERIC_ONLY(U)>
+    matScalar<expr::sub, X> operator - (const X& A, U a)
     {
-        Matrix<T> newMat(X.rows, X.cols);
-        for (int i = 0; i < X.size; i++) { newMat.nums[i] = X.nums[i] - a; }
-        return newMat;
+        return { { matOperand<X>::get(A), { (typename matOperand<X>::type)a } }, A.rows, A.cols };
     }
-    template <class T>
-    Matrix<T>& operator -= (Matrix<T>& X, const Matrix<T>& Y) {
-        for (int i = 0; i < X.size(); i++) { (X.nums)[i] -= (Y.nums)[i]; }
+    template <class T, class Y>
+    typename std::enable_if<matOperand<Y>::value, Matrix<T>&>::type operator -= (Matrix<T>& X, const Y& B)
+    {
+        expr::subAssign(X.size(), matOperand<Y>::get(B), X.nums.data());
         return X;
     }
     template <class T, class NUMERIC_ONLY(U)>
     Matrix<T>& operator -= (Matrix<T>& X, U a)
     {
-        for (int i = 0; i < X.size; i++) { X.nums[i] -= a; }
+        for (int i = 0; i < X.size(); i++) { X.nums[i] -= a; }
         return X;
     }
 
+    //Reference matrix product with one dot product per output element.
+    //Used for small operands where packing isn't worth it, and to check kernels::gemm against.
     template <class T>
-    Matrix<T> operator * (const Matrix<T>& X, const Matrix<T>& Y)
+    Matrix<T> mulNaive(const Matrix<T>& X, const Matrix<T>& Y)
     {
         Matrix<T> newMat(X.rows, Y.cols);
         int x1, x2;
@@ -461,32 +594,29 @@ namespace linalg
         }
         return newMat;
     }
-    template <class T, class NUMERIC_ONLY(U)>
-    Matrix<T> operator * (const Matrix<T>& X, U a)
+    template <class T>
+    Matrix<T> operator * (const Matrix<T>& X, const Matrix<T>& Y)
     {
-        Matrix<T> newMat(X.rows, X.cols);
-        for (int i = 0; i < X.size(); i++) { newMat.nums[i] = X.nums[i] * a; }
+        if ((long long)X.rows * Y.cols * X.cols < kernels::GEMM_MIN_WORK) return mulNaive(X, Y);
+        Matrix<T> newMat(X.rows, Y.cols);
+        kernels::gemm(X.rows, Y.cols, X.cols, X.nums.data(), X.cols, Y.nums.data(), Y.cols, newMat.nums.data(), newMat.cols);
         return newMat;
     }
+    template <class X, class NUMERIC_ONLY(U)>
+    matScalar<expr::mul, X> operator * (const X& A, U a)
+    {
+        return { { matOperand<X>::get(A), { (typename matOperand<X>::type)a } }, A.rows, A.cols };
+    }
     template <class T>
     Vector<T> operator * (const Matrix<T>& X, const Vector<T>& vec)
     {
-        int x = 0;
         Vector<T> newVec(X.rows);
-        for (int i = 0; i < newVec.size(); i++)
-        {
-            newVec.nums[i] = 0;
-            x = i * X.cols;
-            for (int j = 0; j < vec.size(); j++)
-            {
-                newVec.nums[i] += X.nums[x + j] * vec.nums[j];
-            }
-        }
+        kernels::gemv(X.rows, X.cols, T(1), X.nums.data(), X.cols, vec.nums.data(), T(0), newVec.nums.data());
         return newVec;
     }
     template <class T, class NUMERIC_ONLY(U)>
     Matrix<T>& operator *= (Matrix<T>& X, U a) {
-        for (int i = 0; i < X.size(); i++) { X.nums[i] *= a; }
+        kernels::scale(X.size(), X.nums.data(), (T)a, X.nums.data());
         return X;
     }
 
@@ -498,75 +628,269 @@ namespace linalg
         return true;
     }
 
-    template <class T>
-    Vector<T> operator + (const Vector<T>& X, const Vector<T>& Y)
+    template <class X, class Y>
+    vecBinary<expr::add, X, Y> operator + (const X& A, const Y& B)
     {
-        Vector<T> newVec(X.size());
-        for (int i = 0; i < X.size(); i++) { newVec.nums[i] = X.nums[i] + Y.nums[i]; }
-        return newVec;
+        return { { vecOperand<X>::get(A), vecOperand<Y>::get(B) }, A.size() };
     }
-    template <class T, class NUMERIC_ONLY(U)>
-    Vector<T> operator + (const Vector<T>& X, U a)
+    template <class X, class NUMERIC_ONLY(U)>
+    vecScalar<expr::add, X> operator + (const X& A, U a)
     {
-        Vector<T> newVec(X.size);
-        for (int i = 0; i < X.size; i++) { newVec.nums[i] = X.nums[i] + a; }
-        return newVec;
+        return { { vecOperand<X>::get(A), { (typename vecOperand<X>::type)a } }, A.size() };
     }
-    template <class T>
-    Vector<T>& operator += (Vector<T>& X, const Vector<T>& Y) {
-        for (int i = 0; i < X.size(); i++) { (X.nums)[i] += (Y.nums)[i]; }
+    template <class T, class Y>
+    typename std::enable_if<vecOperand<Y>::value, Vector<T>&>::type operator += (Vector<T>& X, const Y& B)
+    {
+        expr::addAssign(X.size(), vecOperand<Y>::get(B), X.nums.data());
         return X;
     }
     template <class T, class NUMERIC_ONLY(U)>
     Vector<T>& operator += (Vector<T>& X, U a)
     {
-        for (int i = 0; i < X.size; i++) { X.nums[i] += a; }
+        for (int i = 0; i < X.size(); i++) { X.nums[i] += a; }
         return X;
     }
 
-    template <class T>
-    Vector<T> operator - (const Vector<T>& X, const Vector<T>& Y)
+    template <class X, class Y>
+    vecBinary<expr::sub, X, Y> operator - (const X& A, const Y& B)
     {
-        Vector<T> newVec(X.size);
-        for (int i = 0; i < X.size; i++) { newVec.nums[i] = X.nums[i] - Y.nums[i]; }
-        return newVec;
+        return { { vecOperand<X>::get(A), vecOperand<Y>::get(B) }, A.size() };
     }
-    template <class T, class NUMERIC_ONLY(U)>
-    Vector<T> operator - (const Vector<T>& X, U a)
+    template <class X, class NUMERIC_ONLY(U)>
+    vecScalar<expr::sub, X> operator - (const X& A, U a)
     {
-        Vector<T> newVec(X.size);
-        for (int i = 0; i < X.size; i++) { newVec.nums[i] = X.nums[i] - a; }
-        return newVec;
+        return { { vecOperand<X>::get(A), { (typename vecOperand<X>::type)a } }, A.size() };
     }
-    template <class T>
-    Vector<T>& operator -= (Vector<T>& X, const Vector<T>& Y) {
-        for (int i = 0; i < X.size(); i++) { (X.nums)[i] -= (Y.nums)[i]; }
+    template <class T, class Y>
+    typename std::enable_if<vecOperand<Y>::value, Vector<T>&>::type operator -= (Vector<T>& X, const Y& B)
+    {
+        expr::subAssign(X.size(), vecOperand<Y>::get(B), X.nums.data());
         return X;
     }
     template <class T, class NUMERIC_ONLY(U)>
     Vector<T>& operator -= (Vector<T>& X, U a)
     {
-        for (int i = 0; i < X.size; i++) { X.nums[i] -= a; }
+        for (int i = 0; i < X.size(); i++) { X.nums[i] -= a; }
         return X;
     }
 
     template <class T>
     T operator * (const Vector<T>& X, const Vector<T>& Y)
     {
-        T res = 0;
-        for (int i = 0; i < X.size; i++) { res += X.nums[i] * Y.nums[i]; }
-        return res;
+        return kernels::dot(X.size(), X.nums.data(), Y.nums.data());
     }
-    template <class T, class NUMERIC_ONLY(U)>
-    Vector<T> operator * (const Vector<T>& X, U a)
+    template <class X, class NUMERIC_ONLY(U)>
+    vecScalar<expr::mul, X> operator * (const X& A, U a)
     {
-        Vector<T> newVec(X.size());
-        for (int i = 0; i < X.size(); i++) { newVec.nums[i] = X.nums[i] * a; }
-        return newVec;
+        return { { vecOperand<X>::get(A), { (typename vecOperand<X>::type)a } }, A.size() };
     }
     template <class T, class NUMERIC_ONLY(U)>
     Vector<T>& operator *= (Vector<T>& X, U a) {
-        for (int i = 0; i < X.size(); i++) { X.nums[i] *= a; }
+        kernels::scale(X.size(), X.nums.data(), (T)a, X.nums.data());
+        return X;
+    }
+
+    /// View operations ///
+    template <class T, class Y>
+    typename std::enable_if<matOperand<Y>::value, const MatrixView<T>&>::type operator += (const MatrixView<T>& X, const Y& B)
+    {
+        auto e = matOperand<Y>::get(B);
+        for (int i = 0; i < X.rows; i++) {
+            for (int j = 0; j < X.cols; j++) { X(i, j) += e[i * X.cols + j]; }
+        }
+        return X;
+    }
+    template <class T, class Y>
+    typename std::enable_if<matOperand<Y>::value, const MatrixView<T>&>::type operator -= (const MatrixView<T>& X, const Y& B)
+    {
+        auto e = matOperand<Y>::get(B);
+        for (int i = 0; i < X.rows; i++) {
+            for (int j = 0; j < X.cols; j++) { X(i, j) -= e[i * X.cols + j]; }
+        }
+        return X;
+    }
+    template <class T, class Y>
+    typename std::enable_if<vecOperand<Y>::value, const VectorView<T>&>::type operator += (const VectorView<T>& X, const Y& B)
+    {
+        auto e = vecOperand<Y>::get(B);
+        for (int i = 0; i < X.size(); i++) { X[i] += e[i]; }
         return X;
     }
+    template <class T, class Y>
+    typename std::enable_if<vecOperand<Y>::value, const VectorView<T>&>::type operator -= (const VectorView<T>& X, const Y& B)
+    {
+        auto e = vecOperand<Y>::get(B);
+        for (int i = 0; i < X.size(); i++) { X[i] -= e[i]; }
+        return X;
+    }
+
+    //Matrix product of strided operands, e.g. a.transposedView() * b.asMatrixView(). The strides are handled by the packing in kernels::gemm.
+    template <class TA, class TB>
+    Matrix<typename std::remove_const<TA>::type> mul(const MatrixView<TA>& X, const MatrixView<TB>& Y)
+    {
+        typedef typename std::remove_const<TA>::type T;
+        Matrix<T> newMat(X.rows, Y.cols);
+        if ((long long)X.rows * Y.cols * X.cols < kernels::GEMM_MIN_WORK) {
+            for (int i = 0; i < X.rows; i++) {
+                for (int j = 0; j < Y.cols; j++) {
+                    T res = 0;
+                    for (int k = 0; k < X.cols; k++) { res += X(i, k) * Y(k, j); }
+                    newMat.nums[i * newMat.cols + j] = res;
+                }
+            }
+        }
+        else {
+            kernels::gemm(X.rows, Y.cols, X.cols, (const T*)X.data, X.rowStride, X.colStride,
+                (const T*)Y.data, Y.rowStride, Y.colStride, newMat.nums.data(), newMat.cols);
+        }
+        return newMat;
+    }
+    //Matrix-vector product of strided operands. Row-major and transposed row-major views go to the GEMV kernels.
+    template <class TA, class TB>
+    Vector<typename std::remove_const<TA>::type> mul(const MatrixView<TA>& X, const VectorView<TB>& vec)
+    {
+        typedef typename std::remove_const<TA>::type T;
+        Vector<T> newVec(X.rows);
+        if (X.colStride == 1 && vec.contiguous()) {
+            kernels::gemv(X.rows, X.cols, T(1), (const T*)X.data, X.rowStride, (const T*)vec.data, T(0), newVec.nums.data());
+        }
+        else if (X.rowStride == 1 && vec.contiguous()) {
+            //transposed view of a row-major matrix
+            kernels::gemvT(X.cols, X.rows, T(1), (const T*)X.data, X.colStride, (const T*)vec.data, T(0), newVec.nums.data());
+        }
+        else {
+            for (int i = 0; i < X.rows; i++) {
+                T res = 0;
+                for (int j = 0; j < X.cols; j++) { res += X(i, j) * vec[j]; }
+                newVec.nums[i] = res;
+            }
+        }
+        return newVec;
+    }
+    //Dot product of strided operands.
+    template <class TA, class TB>
+    typename std::remove_const<TA>::type mul(const VectorView<TA>& X, const VectorView<TB>& Y)
+    {
+        typedef typename std::remove_const<TA>::type T;
+        if (X.contiguous() && Y.contiguous()) return kernels::dot(X.size(), (const T*)X.data, (const T*)Y.data);
+        T res = 0;
+        for (int i = 0; i < X.size(); i++) { res += X[i] * Y[i]; }
+        return res;
+    }
+
+    //Views of Matrix/Vector operands, so they can be mixed with views in products.
+    template <class T>
+    MatrixView<const T> viewOf(const Matrix<T>& X) { return X.view(); }
+    template <class T>
+    VectorView<const T> viewOf(const Vector<T>& X) { return X.view(); }
+    template <class T>
+    const MatrixView<T>& viewOf(const MatrixView<T>& X) { return X; }
+    template <class T>
+    const VectorView<T>& viewOf(const VectorView<T>& X) { return X; }
+
+    //Products with at least one view operand (Matrix * Matrix, Matrix * Vector and Vector * Vector have their own overloads above).
+    template <class X, class Y>
+    auto operator * (const X& A, const Y& B) -> decltype(mul(viewOf(A), viewOf(B)))
+    {
+        return mul(viewOf(A), viewOf(B));
+    }
+
+    /// BLAS-style entry points ///
+    //Use as the trans argument of gemm() and gemv(): take the operand as it is (noTrans) or its transpose (trans).
+    enum transType { noTrans, trans };
+
+    //C = alpha * op(A) * op(B) + beta * C, where op(X) is X or X^T as selected by transA and transB.
+    //Transposed operands are read in their original layout, no transpose is formed. C is not read if beta is 0.
+    //A Matrix C is resized if its shape doesn't match op(A) * op(B) (beta should be 0 then), a view C must have the right shape
+    //and contiguous rows (colStride 1), e.g. a preallocated buffer that is reused for batches of different sizes.
+    //epilogue(i0, j0, rows, cols) is called on each finished block of C, see kernels::gemm.
+    //A and B can also be views, e.g. of weights that live outside of a Matrix.
+    template <class T, class E>
+    void gemm(transType transA, transType transB, T alpha, MatrixView<const T> A, MatrixView<const T> B, T beta, MatrixView<T> C, E epilogue)
+    {
+        MatrixView<const T> a = transA == trans ? A.transposed() : A;
+        MatrixView<const T> b = transB == trans ? B.transposed() : B;
+        assert(C.rows == a.rows && C.cols == b.cols && C.colStride == 1);
+        if ((long long)a.rows * b.cols * a.cols < kernels::GEMM_MIN_WORK) {
+            for (int i = 0; i < a.rows; i++) {
+                for (int j = 0; j < b.cols; j++) {
+                    T res = 0;
+                    for (int k = 0; k < a.cols; k++) { res += a(i, k) * b(k, j); }
+                    T& c = C(i, j);
+                    c = kernels::scaleResult(alpha, res, beta, c);
+                }
+                epilogue(i, 0, 1, b.cols);
+            }
+        }
+        else {
+            kernels::gemm(a.rows, b.cols, a.cols, alpha, a.data, a.rowStride, a.colStride, b.data, b.rowStride, b.colStride,
+                beta, C.data, C.rowStride, epilogue);
+        }
+    }
+    template <class T>
+    void gemm(transType transA, transType transB, T alpha, MatrixView<const T> A, MatrixView<const T> B, T beta, MatrixView<T> C)
+    {
+        gemm(transA, transB, alpha, A, B, beta, C, kernels::noEpilogue());
+    }
+    template <class T, class E>
+    void gemm(transType transA, transType transB, T alpha, MatrixView<const T> A, MatrixView<const T> B, T beta, Matrix<T>& C, E epilogue)
+    {
+        int rows = transA == trans ? A.cols : A.rows, cols = transB == trans ? B.rows : B.cols;
+        if (C.rows != rows || C.cols != cols) C = Matrix<T>(rows, cols);
+        gemm(transA, transB, alpha, A, B, beta, C.view(), epilogue);
+    }
+    template <class T>
+    void gemm(transType transA, transType transB, T alpha, MatrixView<const T> A, MatrixView<const T> B, T beta, Matrix<T>& C)
+    {
+        gemm(transA, transB, alpha, A, B, beta, C, kernels::noEpilogue());
+    }
+    template <class T, class E>
+    void gemm(transType transA, transType transB, T alpha, const Matrix<T>& A, const Matrix<T>& B, T beta, Matrix<T>& C, E epilogue)
+    {
+        gemm(transA, transB, alpha, A.view(), B.view(), beta, C, epilogue);
+    }
+    template <class T>
+    void gemm(transType transA, transType transB, T alpha, const Matrix<T>& A, const Matrix<T>& B, T beta, Matrix<T>& C)
+    {
+        gemm(transA, transB, alpha, A.view(), B.view(), beta, C, kernels::noEpilogue());
+    }
+
+    //y = alpha * op(A) * x + beta * y, where op(A) is A or A^T as selected by transA.
+    //For A^T, A is read row by row (kernels::gemvT) instead of forming the transpose. y is not read if beta is 0,
+    //and is resized if its size doesn't match op(A) (beta should be 0 then).
+    template <class T>
+    void gemv(transType transA, T alpha, const Matrix<T>& A, const Vector<T>& x, T beta, Vector<T>& y)
+    {
+        int m = transA == trans ? A.cols : A.rows;
+        if (y.size() != m) y = Vector<T>(m);
+        if (transA == trans) kernels::gemvT(A.rows, A.cols, alpha, A.nums.data(), A.cols, x.nums.data(), beta, y.nums.data());
+        else kernels::gemv(A.rows, A.cols, alpha, A.nums.data(), A.cols, x.nums.data(), beta, y.nums.data());
+    }
+
+    //A += alpha * x * y^T (rank-1 update), added in place without forming the outer product.
+    template <class T>
+    void ger(T alpha, const Vector<T>& x, const Vector<T>& y, Matrix<T>& A)
+    {
+        kernels::ger(x.size(), y.size(), alpha, x.nums.data(), y.nums.data(), A.nums.data(), A.cols);
+    }
+
+    //C += alpha * X^T * Y (rank-k update): the sum of the outer products of the k rows of X (k*m) and Y (k*n), e.g. one row per sample of a batch.
+    //Small updates are done as k rank-1 updates, larger ones as one GEMM that accumulates into C.
+    template <class T>
+    void gerk(T alpha, MatrixView<const T> X, MatrixView<const T> Y, MatrixView<T> C)
+    {
+        assert(X.colStride == 1 && Y.colStride == 1 && C.colStride == 1 && X.rows == Y.rows && C.rows == X.cols && C.cols == Y.cols);
+        int k = X.rows, m = X.cols, n = Y.cols;
+        if ((long long)m * n * k < kernels::GEMM_MIN_WORK) {
+            for (int p = 0; p < k; p++) {
+                kernels::ger(m, n, alpha, X.data + (size_t)p * X.rowStride, Y.data + (size_t)p * Y.rowStride, C.data, C.rowStride);
+            }
+        }
+        else kernels::gemm(m, n, k, alpha, X.data, 1, X.rowStride, Y.data, Y.rowStride, 1, T(1), C.data, C.rowStride);
+    }
+    template <class T>
+    void gerk(T alpha, const Matrix<T>& X, const Matrix<T>& Y, Matrix<T>& C)
+    {
+        gerk(alpha, X.view(), Y.view(), C.view());
+    }
 }
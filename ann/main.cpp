@@ -36,11 +36,13 @@ int main()
         new nnet::Linear(16, 16, func::act::reLU()),
         new nnet::Linear(16, 16, func::act::reLU()),
         new nnet::Linear(16, 16, func::act::reLU()),
-        new nnet::Linear(16, 10, func::act::sigmoid()) },
-        new func::loss::MSE()); //use mean squared error as loss function
+        new nnet::Linear(16, 10, func::act::linear(1)) },
+        new func::loss::SoftmaxCrossEntropy()); //the last layer outputs logits, the loss applies the softmax
 
     //create stochastic gradient descent optimizer with learn rate=0.1 and learn rate decay speed=0.001
     optim::SGD optimizer(net.layers, 0.1, 0.01);
+    //keep all weights and gradient sums in one buffer, so each step and each zeroGrad() is one pass over it
+    optimizer.useFlat(net.flattenParams());
 
 
     //#########################
@@ -51,6 +53,7 @@ int main()
     //helpers::trainAndTestNet(net, optimizer, trainLoader, testLoader, 1 /*set verbosity*/);
 
     cout << "started training" << endl;
+    nnet::Matrixf inputs, labels; //a batch of inputs and labels, one item per row
     for (int epoch = 1; epoch <= 2; epoch++) 
     {
         float avgLoss = 0;
@@ -59,20 +62,17 @@ int main()
             //zero the accumulated weight gradient sums
             optimizer.zeroGrad();
 
-            //obtain next batch
+            //obtain next batch and copy it into the rows of the input and label matrices
             data::Batch batch = trainLoader.next();
+            data::toMatrices(batch, inputs, labels);
 
-            //for each element in the batch...
-            for (auto element : batch) 
-            {
-                //...propagate forward
-                net.forward(*element.input);
+            //propagate the whole batch forward...
+            net.forward(inputs);
 
-                //and propagate backward 
-                net.backward(*element.label);
+            //...and backward
+            net.backward(labels);
 
-                avgLoss += net.lossFunc(*net.output, *element.label);
-            }
+            avgLoss += net.lossFunc(*net.batchOutput, labels);
             //update the weights with the average weight gradient
             optimizer.step();
 
@@ -114,16 +114,10 @@ int main()
 
 //TODO: Add include guards...
 
-//TODO: Calling forward & backward on batches:                                   
-//TODO: when computing for a batch, create a batch_size * features_size          
-//TODO: matrix of inputs and multiply it by the weight mat (for vectorization)   
-//TODO: do similarly for backprop                                                
 
 //TODO: normalize + scale mnist
 //TODO: test on custom images
 //TODO: Make SGD an actual optimizer, why is the code inside the Layer class?
 //TODO: CrossEntropyLoss & softMax & Momentum
 
-//TODO: Conv layers
-//TODO: Autograd
 //TODO: Maybe make this work in a python module
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "func.h"
+
+//Running evaluation metrics of a classifier: summed loss, argmax accuracy and the confusion matrix, accumulated from the batch outputs
+//of Network in one pass over each row (the loss of the row, then the argmax of output and label while the row is in cache).
+//Nothing is allocated per batch and nothing is printed on the way, print() is for the end of an evaluation.
+namespace metrics
+{
+    typedef linalg::Matrix<float> Matrixf;
+
+    //index of the largest of n values (the first one on ties)
+    inline int argmax(const float* x, int n)
+    {
+        int best = 0;
+        for (int i = 1; i < n; i++) {
+            if (x[i] > x[best]) best = i;
+        }
+        return best;
+    }
+
+    class Metrics
+    {
+    public:
+        int numClasses; //0: don't count the confusion matrix
+        double lossSum = 0; //summed loss of all samples
+        long long count = 0; //samples seen
+        long long numRight = 0; //samples where argmax(output) == argmax(label)
+        std::vector<long long> confusion; //numClasses*numClasses counts, confusion[label * numClasses + prediction]
+    public:
+        //IN: number of classes (outputs of the network) for the confusion matrix, 0 for none
+        Metrics(int numClasses_ = 0) : numClasses(numClasses_), confusion((size_t)numClasses_ * numClasses_, 0) {}
+
+        void reset()
+        {
+            lossSum = 0;
+            count = 0;
+            numRight = 0;
+            std::fill(confusion.begin(), confusion.end(), 0);
+        }
+
+        //Add a batch.
+        //IN: loss function (nullptr: don't sum the loss), batch outputs and labels, one sample per row
+        void add(func::ALossFunction* lossFunc, const Matrixf& outs, const Matrixf& labels)
+        {
+            add(lossFunc, outs.rows, outs.cols, outs.nums.data(), labels.nums.data());
+        }
+        void add(func::ALossFunction* lossFunc, int rows, int cols, const float* outs, const float* labels)
+        {
+            double loss = 0;
+            for (int r = 0; r < rows; r++) {
+                const float* out = outs + (size_t)r * cols;
+                const float* label = labels + (size_t)r * cols;
+                if (lossFunc) loss += lossFunc->lossSum(1, cols, out, label);
+                int pred = argmax(out, cols), truth = argmax(label, cols);
+                if (pred == truth) numRight++;
+                if (numClasses == cols) confusion[(size_t)truth * numClasses + pred]++;
+            }
+            lossSum += loss;
+            count += rows;
+        }
+
+        //Add the counts of other metrics, e.g. of another thread.
+        void add(const Metrics& other)
+        {
+            lossSum += other.lossSum;
+            count += other.count;
+            numRight += other.numRight;
+            if (other.confusion.size() == confusion.size()) {
+                for (size_t i = 0; i < confusion.size(); i++) { confusion[i] += other.confusion[i]; }
+            }
+        }
+
+        float avgLoss() const { return count ? (float)(lossSum / count) : 0.f; }
+        //fraction of correct predictions, 0 to 1
+        float accuracy() const { return count ? (float)numRight / count : 0.f; }
+        long long confusionAt(int label, int prediction) const { return confusion[(size_t)label * numClasses + prediction]; }
+
+        //Print the loss, the accuracy and the confusion matrix (rows: labels, columns: predictions).
+        void print(std::ostream& os = std::cout) const
+        {
+            os << "Average loss over " << count << " items: " << avgLoss() << std::endl;
+            os << "Correctly predicted " << accuracy() * 100 << "%\n";
+            if (numClasses == 0 || count == 0) return;
+            os << "Confusion matrix (rows: label, columns: prediction):\n";
+            for (int i = 0; i < numClasses; i++) {
+                for (int j = 0; j < numClasses; j++) { os << std::setw(7) << confusionAt(i, j); }
+                os << "\n";
+            }
+        }
+    };
+}
@@ -0,0 +1,260 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "nnet.h"
+
+//Binary model files: the topology, activation and loss types and the weights of a Network.
+//Layout (little-endian, all offsets from the start of the file):
+//  modelHeader                 64 bytes
+//  layerRecord * numLayers     64 bytes each
+//  per layer: weights (outSize*inSize floats, row-major), then biases (outSize floats), each starting at a multiple of 64 bytes
+//loadModel() maps the file read-only and the layers compute straight from the mapped weights, so nothing is copied, the file is
+//paged in on first use, and all processes that load the same file share one copy of it in the page cache.
+//Linear and FixedLinear layers can be stored; a FixedLinear is loaded as a Linear (same math, sizes known only at runtime).
+namespace nnet
+{
+    constexpr char MODEL_MAGIC[8] = { 'A', 'N', 'N', 'M', 'O', 'D', 'E', 'L' };
+    constexpr uint32_t MODEL_VERSION = 1;
+    constexpr uint32_t MODEL_ENDIAN_CHECK = 0x01020304; //reads differently on a machine of the other byte order
+    constexpr size_t MODEL_ALIGNMENT = 64;
+
+    enum class layerKind : int32_t { linear = 1 };
+
+    struct modelHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t endianCheck;
+        uint32_t numLayers;
+        int32_t loss; //func::lossType
+        uint64_t fileSize;
+        uint8_t reserved[32];
+    };
+    struct layerRecord
+    {
+        int32_t kind; //layerKind
+        int32_t act; //func::actType
+        float actParam; //AActFunction::param()
+        int32_t actAccuracy; //AActFunction::accuracy
+        int32_t inSize;
+        int32_t outSize;
+        int32_t hasBias;
+        int32_t reserved0;
+        uint64_t weightsOffset;
+        uint64_t biasesOffset;
+        uint8_t reserved[16];
+    };
+    static_assert(sizeof(modelHeader) == 64 && sizeof(layerRecord) == 64, "model file records must be 64 bytes");
+
+    //A file mapped read-only into memory, unmapped on destruction.
+    class MappedFile
+    {
+    public:
+        const char* data = nullptr;
+        size_t size = 0;
+    protected:
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = NULL;
+#endif
+    public:
+        explicit MappedFile(const std::string& path)
+        {
+#ifdef _WIN32
+            file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("can't open '" + path + "'");
+            LARGE_INTEGER fileSize;
+            GetFileSizeEx(file, &fileSize);
+            size = (size_t)fileSize.QuadPart;
+            if (size > 0) {
+                mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+                if (mapping != NULL) data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            }
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw std::runtime_error("can't open '" + path + "'");
+            struct stat st;
+            fstat(fd, &st);
+            size = (size_t)st.st_size;
+            if (size > 0) {
+                void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p != MAP_FAILED) data = (const char*)p;
+            }
+            close(fd); //the mapping keeps the file open
+#endif
+            if (data == nullptr) {
+                unmap();
+                throw std::runtime_error("can't map '" + path + "'");
+            }
+        }
+        ~MappedFile() { unmap(); }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator = (const MappedFile&) = delete;
+    protected:
+        void unmap()
+        {
+#ifdef _WIN32
+            if (data) UnmapViewOfFile(data);
+            if (mapping != NULL) CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+            mapping = NULL;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if (data) munmap((void*)data, size);
+#endif
+            data = nullptr;
+        }
+    };
+
+    inline uint64_t alignOffset(uint64_t offset) { return (offset + MODEL_ALIGNMENT - 1) / MODEL_ALIGNMENT * MODEL_ALIGNMENT; }
+
+    //Write the layers, activations, loss type and weights of a network to a model file.
+    //Throws std::runtime_error for layers or activations that can't be stored and if the file can't be written.
+    //IN: network, path
+    inline void saveModel(const Network& net, const std::string& path)
+    {
+        modelHeader header = {};
+        std::memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+        header.version = MODEL_VERSION;
+        header.endianCheck = MODEL_ENDIAN_CHECK;
+        header.numLayers = (uint32_t)net.layers.size();
+        header.loss = (int32_t)net.lossFunc.type();
+
+        std::vector<layerRecord> records(net.layers.size());
+        uint64_t offset = sizeof(modelHeader) + records.size() * sizeof(layerRecord);
+        for (size_t i = 0; i < net.layers.size(); i++) {
+            const ILayer* l = net.layers[i];
+            const func::AActFunction* act = l->activation();
+            if (act == nullptr) throw std::runtime_error("saveModel: layer " + std::to_string(i) + " can't be stored");
+            lin::MatrixView<const float> w = l->weightsView();
+            if (w.rows != l->outSize || w.cols != l->inSize) throw std::runtime_error("saveModel: layer " + std::to_string(i) + " can't be stored");
+            if (act->type() == func::actType::custom) throw std::runtime_error("saveModel: layer " + std::to_string(i) + " has a custom activation");
+            layerRecord& rec = records[i];
+            rec = {};
+            rec.kind = (int32_t)layerKind::linear;
+            rec.act = (int32_t)act->type();
+            rec.actParam = act->param();
+            rec.actAccuracy = (int32_t)act->accuracy;
+            rec.inSize = l->inSize;
+            rec.outSize = l->outSize;
+            rec.hasBias = l->hasBias();
+            rec.weightsOffset = alignOffset(offset);
+            rec.biasesOffset = alignOffset(rec.weightsOffset + (uint64_t)l->outSize * l->inSize * sizeof(float));
+            offset = rec.biasesOffset + (uint64_t)l->outSize * sizeof(float);
+        }
+        header.fileSize = offset;
+
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        if (!ofs) throw std::runtime_error("saveModel: can't open '" + path + "'");
+        ofs.write((const char*)&header, sizeof(header));
+        ofs.write((const char*)records.data(), records.size() * sizeof(layerRecord));
+        uint64_t pos = sizeof(modelHeader) + records.size() * sizeof(layerRecord);
+        const char zeros[MODEL_ALIGNMENT] = {};
+        //write the elements of m at offset at, padding the gap before it with zeros
+        auto writeAt = [&](uint64_t at, lin::MatrixView<const float> m) {
+            ofs.write(zeros, at - pos);
+            for (int r = 0; r < m.rows; r++) {
+                if (m.colStride == 1) ofs.write((const char*)&m(r, 0), m.cols * sizeof(float));
+                else { for (int c = 0; c < m.cols; c++) { ofs.write((const char*)&m(r, c), sizeof(float)); } }
+            }
+            pos = at + (uint64_t)m.size() * sizeof(float);
+        };
+        for (size_t i = 0; i < net.layers.size(); i++) {
+            const ILayer* l = net.layers[i];
+            writeAt(records[i].weightsOffset, l->weightsView());
+            std::vector<float> b(l->outSize, 0.f);
+            if (l->hasBias()) {
+                lin::VectorView<const float> bv = l->biasesView();
+                for (int j = 0; j < l->outSize; j++) { b[j] = bv[j]; }
+            }
+            writeAt(records[i].biasesOffset, lin::MatrixView<const float>(b.data(), 1, l->outSize));
+        }
+        if (!ofs) throw std::runtime_error("saveModel: writing '" + path + "' failed");
+    }
+
+    //Load a network from a model file.
+    //With map = true, the file is memory-mapped and the Linear layers compute from the mapped weights (mapWeights()), without copying
+    //them; the mapping stays open as long as the network (Network::mapping). A layer that is trained copies its weights first.
+    //With map = false, the weights are read into the layers' own matrices.
+    //Throws std::runtime_error if the file can't be read or isn't a valid model file: a bad header, an unknown layer kind, activation,
+    //accuracy or loss type, layer sizes that don't chain, or weights outside the file.
+    //IN: path, map the file, loss function for the network (nullptr: the one stored in the file)
+    //OUT: the network, owned by the caller
+    inline Network* loadModel(const std::string& path, bool map = true, func::ALossFunction* lossFunc = nullptr)
+    {
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+        const char* data = file->data;
+        auto fail = [&](const std::string& what) { return std::runtime_error("loadModel: '" + path + "': " + what); };
+
+        if (file->size < sizeof(modelHeader)) throw fail("file too small");
+        modelHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, MODEL_MAGIC, sizeof(header.magic)) != 0) throw fail("not a model file");
+        if (header.endianCheck != MODEL_ENDIAN_CHECK) throw fail("stored with a different byte order");
+        if (header.version != MODEL_VERSION) throw fail("unsupported version " + std::to_string(header.version));
+        const uint64_t dataStart = sizeof(modelHeader) + (uint64_t)header.numLayers * sizeof(layerRecord);
+        if (header.fileSize != file->size || header.numLayers == 0 || dataStart > file->size) throw fail("truncated or corrupt");
+        if (header.loss < (int32_t)func::lossType::custom || header.loss > (int32_t)func::lossType::SoftmaxCrossEntropy) {
+            throw fail("unknown loss type " + std::to_string(header.loss));
+        }
+        if (header.loss == (int32_t)func::lossType::custom && lossFunc == nullptr) throw fail("stored with a custom loss, pass a loss function");
+        //a block of bytes at a 64-byte aligned offset, after the records and inside the file (written so that it can't overflow)
+        auto inFile = [&](uint64_t offset, uint64_t bytes) {
+            return offset % MODEL_ALIGNMENT == 0 && offset >= dataStart && offset <= file->size && bytes <= file->size - offset;
+        };
+
+        std::vector<ILayer*> layers;
+        func::ALossFunction* loss = lossFunc;
+        try {
+            if (loss == nullptr) loss = func::makeLoss((func::lossType)header.loss);
+            for (uint32_t i = 0; i < header.numLayers; i++) {
+                layerRecord rec;
+                std::memcpy(&rec, data + sizeof(modelHeader) + i * sizeof(layerRecord), sizeof(rec));
+                if (rec.kind != (int32_t)layerKind::linear) throw fail("layer " + std::to_string(i) + ": unknown kind " + std::to_string(rec.kind));
+                if (rec.act <= (int32_t)func::actType::custom || rec.act > (int32_t)func::actType::linear || !std::isfinite(rec.actParam)) {
+                    throw fail("layer " + std::to_string(i) + ": unknown activation " + std::to_string(rec.act));
+                }
+                if (rec.actAccuracy < (int32_t)linalg::kernels::exact || rec.actAccuracy > (int32_t)linalg::kernels::defaultMode) {
+                    throw fail("layer " + std::to_string(i) + ": unknown accuracy " + std::to_string(rec.actAccuracy));
+                }
+                if (rec.inSize <= 0 || rec.outSize <= 0 || (i > 0 && rec.inSize != layers.back()->outSize)) {
+                    throw fail("layer " + std::to_string(i) + ": bad sizes " + std::to_string(rec.outSize) + "x" + std::to_string(rec.inSize));
+                }
+                if (!inFile(rec.weightsOffset, (uint64_t)rec.outSize * rec.inSize * sizeof(float))
+                    || !inFile(rec.biasesOffset, (uint64_t)rec.outSize * sizeof(float))) throw fail("layer " + std::to_string(i) + ": weights outside the file");
+                func::AActFunction* act = func::makeAct((func::actType)rec.act, rec.actParam);
+                act->accuracy = (linalg::kernels::mathMode)rec.actAccuracy;
+                Linear* l = new Linear(rec.inSize, rec.outSize, act, rec.hasBias != 0, nullptr);
+                layers.push_back(l);
+                l->mapWeights((const float*)(data + rec.weightsOffset), (const float*)(data + rec.biasesOffset));
+                if (!map) l->copyMappedWeights();
+            }
+        }
+        catch (...) {
+            for (ILayer* l : layers) delete l;
+            if (loss != lossFunc) delete loss;
+            throw;
+        }
+
+        Network* net = new Network(layers, loss);
+        if (map) net->mapping = file;
+        return net;
+    }
+}
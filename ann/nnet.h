@@ -5,11 +5,15 @@
 #include <cmath>
 #include <vector>
 #include <functional>
+#include <memory>
 #include <stdarg.h>
 #include <random>
 #include <map>
 #include <fstream>
 #include <iterator>
+#ifndef NOMINMAX
+#define NOMINMAX //keep std::min/std::max usable
+#endif
 #include <windows.h>
 #include <intrin.h>
 #include <chrono>
@@ -17,7 +21,9 @@
 #include <cassert>
 
 #include "linalg.h"
+#include "fixed.h"
 #include "func.h"
+#include "autograd.h"
 #include "optim.h"
 
 #define ILAYER_ONLY(T) T=Linear, typename = typename std::enable_if<std::is_base_of<ILayer, T>::value, T>::type
@@ -38,8 +44,97 @@ namespace nnet
         Vectorf* prevOuts; //the outputs of the previous layer
         Matrixf weights; //the layer's weight matrix
         Vectorf biases; //the layer's bias weights
+        Matrixf batchOuts; //the outputs of this layer for the last batch, one sample per row
+        Matrixf* prevBatchOuts; //the batch outputs of the previous layer
+        //layers are deleted through ILayer pointers (Network, clones, loadModel())
+        virtual ~ILayer() = default;
         virtual Vectorf forward(Vectorf& inVec) = 0;
         virtual Vectorf backward(Vectorf& outGrad) = 0;
+
+        //Batch versions of forward() and backward(): one sample per row of the batch*features matrices.
+        //The defaults go through the single-sample versions row by row, layers override them to work on the whole batch at once.
+        //IN: the batch outputs of the previous layer
+        //OUT: batchOuts
+        virtual Matrixf& forward(Matrixf& inBatch)
+        {
+            batchOuts = Matrixf(inBatch.rows, outSize);
+            for (int r = 0; r < inBatch.rows; r++) {
+                Vectorf inVec(inBatch.view().row(r));
+                Vectorf outVec = forward(inVec);
+                std::copy(outVec.nums.begin(), outVec.nums.end(), batchOuts[r]);
+            }
+            return batchOuts;
+        }
+        //IN: gradient w.r.t the batch outputs, returned from backward() of the next layer
+        //OUT: gradient w.r.t the batch outputs of the previous layer
+        virtual Matrixf backward(Matrixf& outGrad)
+        {
+            //the single-sample backward() needs the state of its own forward pass, so each sample is run forward again first
+            Matrixf inGrad(outGrad.rows, inSize);
+            Vectorf* savedPrevOuts = prevOuts;
+            for (int r = 0; r < outGrad.rows; r++) {
+                Vectorf inVec(prevBatchOuts->view().row(r)), gradVec(outGrad.view().row(r));
+                prevOuts = &inVec;
+                forward(inVec);
+                Vectorf newGrad = backward(gradVec);
+                std::copy(newGrad.nums.begin(), newGrad.nums.end(), inGrad[r]);
+            }
+            prevOuts = savedPrevOuts;
+            return inGrad;
+        }
+        //Set the weight matrix (outSize*inSize). Layers that keep their weights somewhere else than in weights override this.
+        virtual void setWeights(const Matrixf& w) { weights = w; }
+        //The shape of the weight matrix (rows, cols) for the initialization by Network; {0, 0} for layers without weights.
+        virtual std::pair<int, int> weightsShape() const { return { outSize, inSize }; }
+
+        //Inference only: the outputs for a batch, written to out (resized to batch*outSize) instead of batchOuts. Reads the weights
+        //and nothing else of the layer, keeps no state for backward(), so any number of threads can call it at once (while no one trains).
+        //IN: the batch inputs (batch*inSize), output matrix
+        virtual void predict(const Matrixf& inBatch, Matrixf& out) const = 0;
+
+        //The weights (outSize*inSize), biases, bias flag and activation the layer computes with, e.g. to save it (model.h).
+        //Layers that keep them somewhere else than in weights/biases override these.
+        virtual lin::MatrixView<const float> weightsView() const { return weights.view(); }
+        virtual lin::VectorView<const float> biasesView() const { return biases.view(); }
+        virtual bool hasBias() const { return false; }
+        virtual const func::AActFunction* activation() const { return nullptr; }
+
+        //Record the batched forward pass on an autograd tape (autograd.h) instead of running it, so the tape's backward()
+        //computes the gradients: they are added to the layer's gradient sums like by the batched backward().
+        //Throws std::runtime_error for layers that can't be recorded.
+        //IN: tape, the batch inputs (batch*inSize)
+        //OUT: the batch outputs (batch*outSize)
+        virtual autograd::Var forward(autograd::Tape&, autograd::Var)
+        {
+            throw std::runtime_error("this layer can't be recorded on an autograd tape");
+        }
+
+        //A trained tensor of the layer: its values and the gradient sum backward() adds to, both of size floats.
+        struct param
+        {
+            float* value;
+            float* grad;
+            size_t size;
+        };
+        //Append the layer's trained tensors to out, in a fixed order, e.g. to combine the gradients of replicas (trainer.h).
+        //The default is for layers without weights.
+        virtual void params(std::vector<param>&) {}
+        //Whether the layer can compute on its trained tensors in memory of the network (bindParams()). The default: only if it has none.
+        virtual bool canBindParams()
+        {
+            std::vector<param> own;
+            params(own);
+            return own.empty();
+        }
+        //Compute on the trained tensors at the memory in to (one per params() entry, same order and sizes, already holding the
+        //values and gradient sums) instead of own copies, which are freed. Only called if canBindParams(). See Network::flattenParams().
+        virtual void bindParams(const std::vector<param>&) {}
+        //A new layer of the same type, shape, activation and weights, with zero gradient sums and nothing of the last pass.
+        //Throws std::runtime_error for layers that can't be copied.
+        virtual ILayer* clone() const
+        {
+            throw std::runtime_error("this layer can't be cloned");
+        }
     };
     
     //Linear network layer
@@ -47,19 +142,31 @@ namespace nnet
     {
     public:
         Vectorf sums; //the weighted sums of each neuron
+        Matrixf batchSums; //the weighted sums of each neuron for the last batch, one sample per row
         Matrixf weightsGradSum; //the sum of multiple weight gradients (for SGD)
         Vectorf biasesGradSum; //the sum of multiple bias gradients
         bool bias = false; //use bias neuron
         func::AActFunction* actFunc; //the activation function used by each neuron
-        int batchSize = 0; //the current batch size to determine how large the step for SGD should be
+        bool keepSums = true; //store the weighted sums for backward(). Without, the batched forward() writes the outputs only
+        //Read-only weights (outSize*inSize) and biases in memory owned by someone else, e.g. a memory-mapped model file (model.h),
+        //used instead of weights/biases when set. See mapWeights().
+        const float* mappedWeights = nullptr;
+        const float* mappedBiases = nullptr;
+        //Weights, biases and their gradient sums in memory owned by the network (Network::flattenParams()), used instead of
+        //weights/biases/weightsGradSum/biasesGradSum when set. See bindParams().
+        float* boundWeights = nullptr;
+        float* boundBiases = nullptr;
+        float* boundWeightsGrad = nullptr;
+        float* boundBiasesGrad = nullptr;
+        Vectorf biasGrad; //scratch of the backward passes
     public:
         //IN: amount of inputs, amount of outputs, activation function, weight initialization function
         template <class T>
-        Linear(int inChan, int outChan, T, bool bias_ = true, std::function<Matrixf(int, int)> weightInit = func::weightInit::heInitHalfStd)
+        Linear(int inChan, int outChan, T act, bool bias_ = true, std::function<Matrixf(int, int)> weightInit = func::weightInit::heInitHalfStd)
         {
             //static_assert(std::is_base_of<func::AActFunction, T>::value);
             bias = bias_;
-            actFunc = new T;
+            actFunc = new T(act); //a copy, so parameters like linear(1) are kept
             inSize = inChan;
             outSize = outChan;
             sums = Vectorf(outChan);
@@ -89,6 +196,58 @@ namespace nnet
             delete actFunc;
         }
 
+        lin::MatrixView<const float> weightsView() const override
+        {
+            if (mappedWeights) return lin::MatrixView<const float>(mappedWeights, outSize, inSize);
+            return boundWeights ? lin::MatrixView<const float>(boundWeights, outSize, inSize) : weights.view();
+        }
+        lin::VectorView<const float> biasesView() const override
+        {
+            if (mappedBiases) return lin::VectorView<const float>(mappedBiases, outSize);
+            return boundBiases ? lin::VectorView<const float>(boundBiases, outSize) : biases.view();
+        }
+        //the trained weights, biases and gradient sums, wherever they are (not mapped weights: copyMappedWeights() first)
+        float* weightsData() { return boundWeights ? boundWeights : weights.nums.data(); }
+        float* biasesData() { return boundBiases ? boundBiases : biases.nums.data(); }
+        float* weightsGradData() { return boundWeightsGrad ? boundWeightsGrad : weightsGradSum.nums.data(); }
+        float* biasesGradData() { return boundBiasesGrad ? boundBiasesGrad : biasesGradSum.nums.data(); }
+
+        void setWeights(const Matrixf& w) override
+        {
+            if (boundWeights == nullptr) weights = w;
+            else {
+                assert(w.rows == outSize && w.cols == inSize);
+                std::copy(w.nums.begin(), w.nums.end(), boundWeights);
+            }
+        }
+        bool hasBias() const override { return bias; }
+        const func::AActFunction* activation() const override { return actFunc; }
+
+        //Compute with the weights and biases at w and b (which must outlive the layer) instead of own copies, without copying them.
+        //The own weights, biases and their gradient sums are freed. The first backward() copies the weights back into the layer.
+        //IN: outSize*inSize weights, row-major, outSize biases
+        void mapWeights(const float* w, const float* b)
+        {
+            if (boundWeights) throw std::runtime_error("mapWeights: the layer's weights are bound to the network's flat buffer");
+            mappedWeights = w;
+            mappedBiases = b;
+            weights = Matrixf();
+            biases = Vectorf();
+            weightsGradSum = Matrixf();
+            biasesGradSum = Vectorf();
+        }
+        //Copy the mapped weights and biases into the layer's own matrices, so it can be trained.
+        void copyMappedWeights()
+        {
+            if (mappedWeights == nullptr) return;
+            weights = Matrixf(outSize, inSize, std::vector<float>(mappedWeights, mappedWeights + (size_t)outSize * inSize));
+            biases = Vectorf(std::vector<float>(mappedBiases, mappedBiases + outSize));
+            weightsGradSum = Matrixf(outSize, inSize, lin::zeros);
+            biasesGradSum = Vectorf(outSize, lin::zeros);
+            mappedWeights = nullptr;
+            mappedBiases = nullptr;
+        }
+
         //Compute the outputs of the layer from the inputs.
         //IN: the outputs of the previous layer
         //OUT: the outputs of this layer
@@ -96,13 +255,12 @@ namespace nnet
         {
             //multiply the inputs by the weight matrix to get the weighted sums.
             //Save them to use in backward pass.
-            sums = weights * inVec; 
-            //pass the (biased) weighted sums thru the act. func to get the outputs
-            if (bias) {
-                Vectorf vec = sums + biases;
-                outs = actFunc->forward(vec);
-            }
-            else outs = actFunc->forward(sums);
+            lin::MatrixView<const float> w = weightsView();
+            if (sums.size() != outSize) sums = Vectorf(outSize);
+            lin::kernels::gemv(outSize, inSize, 1.f, w.data, inSize, inVec.nums.data(), 0.f, sums.nums.data());
+            //pass the (biased) weighted sums thru the act. func to get the outputs, adding the biases on the way
+            if (outs.size() != outSize) outs = Vectorf(outSize);
+            actFunc->forwardBias(1, outSize, sums.nums.data(), outSize, bias ? biasesView().data : nullptr, outs.nums.data(), outSize);
 
             return outs;
         }
@@ -113,31 +271,155 @@ namespace nnet
         Vectorf backward(Vectorf& outGrad) override
         {
             //we need to "go back" for each function we used in the net. The derivative of the loss function has already been calculated in the net's backward().
+            copyMappedWeights();
 
             //from the recursive definition of the gradient of loss w.r.t the sums of a layer: compute d(outs)/d(sums) first, 
             //which is the derivative of the activation function:
             Vectorf sumGrad = actFunc->backward(sums, outGrad);
             //to then get the gradient w.r.t the weights, the resulting sumGrad needs to be multiplied by d(sums)/d(weights) (chain rule),
-            //which is equal to the outputs of the previous layer:
-            Matrixf weightsGrad = sumGrad.transposed() * (*prevOuts).asMatrix();
-            //add the weight gradient to the sum to then use it in SGD:
-            weightsGradSum += weightsGrad;
-            if (bias) biasesGradSum += actFunc->backward(biases, outGrad);
+            //which is equal to the outputs of the previous layer. The weight gradient (the outer product sumGrad * prevOuts^T)
+            //is added straight to the sum used in SGD, in one pass and without forming it:
+            lin::kernels::ger(outSize, inSize, 1.f, sumGrad.nums.data(), prevOuts->nums.data(), weightsGradData(), inSize);
+            if (bias) addBiasGrad(outGrad.nums.data());
             batchSize++;
             //to get the gradient w.r.t the outputs of the previous layer, multiply sumGrad by d(sums)/d(outs-1) (=weights of the previous layer).
-            //The transpose appears because the gradient is computed backwards.
-            Vectorf newOutGrad = weights.transposed() * sumGrad;
+            //The transpose appears because the gradient is computed backwards. gemvT reads the weights in their own layout, nothing is transposed.
+            Vectorf newOutGrad(inSize);
+            lin::kernels::gemvT(outSize, inSize, 1.f, weightsData(), inSize, sumGrad.nums.data(), 0.f, newOutGrad.nums.data());
             return newOutGrad;
         }
 
+        //Compute the outputs of the layer for a batch. The weighted sums of all samples are one GEMM: batchSums = inBatch * weights^T.
+        //For elementwise activations, the bias and the activation are applied by the GEMM's epilogue to each block of batchSums
+        //as soon as it is finished, while it is still in cache, instead of in separate passes over the whole batch.
+        //IN: the batch outputs of the previous layer (batch*inSize)
+        //OUT: the batch outputs of this layer (batch*outSize)
+        Matrixf& forward(Matrixf& inBatch) override
+        {
+            //without keepSums, the GEMM writes into batchOuts and the epilogue works in place
+            if (!keepSums) {
+                predict(inBatch, batchOuts);
+                return batchOuts;
+            }
+            if (batchOuts.rows != inBatch.rows || batchOuts.cols != outSize) batchOuts = Matrixf(inBatch.rows, outSize);
+            if (batchSums.rows != inBatch.rows || batchSums.cols != outSize) batchSums = Matrixf(inBatch.rows, outSize);
+            forward(inBatch.rows, inBatch.nums.data(), batchSums.nums.data(), batchOuts.nums.data());
+            return batchOuts;
+        }
+
+        //Same as the batched forward() without keeping the weighted sums: the GEMM writes into out and the epilogue works in place.
+        void predict(const Matrixf& inBatch, Matrixf& out) const override
+        {
+            if (out.rows != inBatch.rows || out.cols != outSize) out = Matrixf(inBatch.rows, outSize);
+            forward(inBatch.rows, inBatch.nums.data(), nullptr, out.nums.data());
+        }
+
+        //The batched forward pass on buffers owned by the caller (row-major, one sample per row), used by forward(), predict() and
+        //Plan (plan.h), which reuses its buffers across layers and steps. Reads the weights and nothing else of the layer.
+        //IN: batch size, inputs (batch*inSize), weighted sums (batch*outSize) or nullptr to not keep them, outputs (batch*outSize)
+        void forward(int rows, const float* in, float* batchSumsOut, float* out) const
+        {
+            lin::MatrixView<float> s(batchSumsOut ? batchSumsOut : out, rows, outSize);
+            const float* b = bias ? biasesView().data : nullptr;
+            if (actFunc->elementwise()) {
+                lin::gemm(lin::noTrans, lin::trans, 1.f, lin::MatrixView<const float>(in, rows, inSize), weightsView(), 0.f, s, [&](int i0, int j0, int r, int c) {
+                    actFunc->forwardBias(r, c, &s(i0, j0), outSize, b ? b + j0 : nullptr, out + (size_t)i0 * outSize + j0, outSize);
+                });
+            }
+            else {
+                lin::gemm(lin::noTrans, lin::trans, 1.f, lin::MatrixView<const float>(in, rows, inSize), weightsView(), 0.f, s);
+                actFunc->forwardBias(rows, outSize, s.data, outSize, b, out, outSize);
+            }
+        }
+
+        //Same as the single-sample backward() summed over the batch, with the products done as GEMMs.
+        //outGrad is overwritten with the gradient w.r.t the weighted sums.
+        //IN: gradient w.r.t the batch outputs (batch*outSize)
+        //OUT: gradient w.r.t the batch outputs of the previous layer (batch*inSize)
+        Matrixf backward(Matrixf& outGrad) override
+        {
+            Matrixf newOutGrad(outGrad.rows, inSize);
+            backward(outGrad.rows, prevBatchOuts->nums.data(), batchSums.nums.data(), outGrad.nums.data(), newOutGrad.nums.data());
+            return newOutGrad;
+        }
+
+        //The batched backward pass on buffers owned by the caller, see the batched forward() on buffers.
+        //Adds the weight and bias gradients to the sums and overwrites outGrad with the gradient w.r.t the weighted sums.
+        //IN: batch size, inputs and weighted sums of the forward pass, gradient w.r.t the outputs (batch*outSize),
+        //gradient w.r.t the inputs (batch*inSize) or nullptr if it isn't needed (the first layer)
+        void backward(int rows, const float* in, const float* batchSumsIn, float* outGrad, float* inGrad)
+        {
+            copyMappedWeights();
+            if (bias) {
+                for (int r = 0; r < rows; r++) { addBiasGrad(outGrad + (size_t)r * outSize); }
+            }
+            actFunc->backward(rows, outSize, batchSumsIn, outGrad, outGrad);
+            lin::MatrixView<const float> sumGrad(outGrad, rows, outSize);
+            //the weight gradients of all samples (sumGrad^T * inputs) are added to weightsGradSum by one rank-k update
+            lin::gerk(1.f, sumGrad, lin::MatrixView<const float>(in, rows, inSize), lin::MatrixView<float>(weightsGradData(), outSize, inSize));
+            batchSize += rows;
+            if (inGrad) lin::gemm(lin::noTrans, lin::noTrans, 1.f, sumGrad, weightsView(), 0.f, lin::MatrixView<float>(inGrad, rows, inSize));
+        }
+
+        //add the bias gradient of one sample to the sum: the activation's derivative at the biases times the output gradient
+        void addBiasGrad(const float* outGrad)
+        {
+            if (biasGrad.size() != outSize) biasGrad = Vectorf(outSize);
+            actFunc->backward(1, outSize, biasesData(), outGrad, biasGrad.nums.data());
+            lin::kernels::add(outSize, biasesGradData(), biasGrad.nums.data(), biasesGradData());
+        }
+
+        //One dense operation on the tape: the weights and biases are parameters whose gradients go to weightsGradSum and
+        //biasesGradSum. Unlike backward(), which takes the activation's derivative at the unbiased sums and, for the bias gradient,
+        //at the biases, the tape takes it at the biased sums for all gradients (the exact gradient; the same for linear activations).
+        autograd::Var forward(autograd::Tape& tape, autograd::Var in) override
+        {
+            copyMappedWeights();
+            batchSize += in.rows();
+            autograd::Var w = tape.param(weightsView(), weightsGradData());
+            autograd::Var b = bias ? tape.param(lin::MatrixView<const float>(biasesData(), 1, outSize), biasesGradData()) : autograd::Var();
+            return tape.dense(in, w, b, *actFunc);
+        }
+
+        void params(std::vector<param>& out) override
+        {
+            copyMappedWeights();
+            out.push_back({ weightsData(), weightsGradData(), (size_t)outSize * inSize });
+            if (bias) out.push_back({ biasesData(), biasesGradData(), (size_t)outSize });
+        }
+        bool canBindParams() override { return true; }
+        void bindParams(const std::vector<param>& to) override
+        {
+            copyMappedWeights();
+            boundWeights = to[0].value;
+            boundWeightsGrad = to[0].grad;
+            weights = Matrixf();
+            weightsGradSum = Matrixf();
+            if (bias) {
+                boundBiases = to[1].value;
+                boundBiasesGrad = to[1].grad;
+                biases = Vectorf();
+                biasesGradSum = Vectorf();
+            }
+        }
+        ILayer* clone() const override
+        {
+            Linear* l = new Linear(inSize, outSize, actFunc->clone(), bias, nullptr);
+            l->weights = Matrixf(weightsView());
+            l->biases = Vectorf(biasesView());
+            l->keepSums = keepSums;
+            return l;
+        }
+
         //Update the weights of the layer with the negative of weightsGradSum (accumulated during backward() calls) times a learning rate (SGD).
         //IN: learning rate
         void update(float lr) override
         {
             //update the weights with the negative of the weight gradient times the learning rate. 
             //divide by batch size because the weight update step size should be independent from batch size
-            weights -= weightsGradSum * (lr / batchSize);
-            if (bias) biases -= biasesGradSum * (lr / batchSize);
+            if (mappedWeights) return; //not trained since mapWeights()
+            lin::kernels::axpy(outSize * inSize, -lr / batchSize, weightsGradData(), weightsData());
+            if (bias) lin::kernels::axpy(outSize, -lr / batchSize, biasesGradData(), biasesData());
         }
 
         //Set weightsGradSum to zero.
@@ -145,8 +427,133 @@ namespace nnet
         void zeroGrad() override
         {
             //zero the weight gradient sum. The update step should be independent from batch to batch in SGD.
-            weightsGradSum *= 0;
-            if (bias) biasesGradSum *= 0;
+            if (mappedWeights) return; //no gradient sums
+            std::fill(weightsGradData(), weightsGradData() + (size_t)outSize * inSize, 0.f);
+            if (bias) std::fill(biasesGradData(), biasesGradData() + outSize, 0.f);
+            batchSize = 0;
+        }
+    };
+
+    //Linear layer with its size fixed at compile time, for small latency-critical models.
+    //Weights, biases, gradients and the saved sums live inline in FixedMatrix/FixedVector members (weights/biases of ILayer stay empty),
+    //and all loops are unrolled or have a constant trip count. Besides the Vectorf interface used by Network, forward() and backward()
+    //can be called with FixedVectors, then a pass through a chain of FixedLinear layers doesn't touch the heap at all.
+    template <int In, int Out>
+    class FixedLinear : public ILayer
+    {
+    public:
+        lin::FixedMatrix<float, Out, In> fixedWeights;
+        lin::FixedVector<float, Out> fixedBiases;
+        lin::FixedMatrix<float, Out, In> weightsGradSum; //the sum of multiple weight gradients (for SGD)
+        lin::FixedVector<float, Out> biasesGradSum; //the sum of multiple bias gradients
+        lin::FixedVector<float, In> ins; //the inputs of the last forward()
+        lin::FixedVector<float, Out> sums; //the weighted sums of each neuron (plus the biases)
+        bool bias = false; //use bias neuron
+        func::AActFunction* actFunc; //the activation function used by each neuron
+    public:
+        //IN: activation function, use bias, weight initialization function
+        template <class T>
+        FixedLinear(T act, bool bias_ = true, std::function<Matrixf(int, int)> weightInit = func::weightInit::heInitHalfStd)
+            : FixedLinear(new T(act), bias_, weightInit) {}
+        template <class T>
+        FixedLinear(T* fptr, bool bias_ = true, std::function<Matrixf(int, int)> weightInit = func::weightInit::heInitHalfStd)
+            : fixedWeights(0.f), fixedBiases(0.f), weightsGradSum(0.f), biasesGradSum(0.f), ins(0.f), sums(0.f)
+        {
+            bias = bias_;
+            actFunc = fptr;
+            inSize = In;
+            outSize = Out;
+            outs = Vectorf(Out);
+            if (weightInit != NULL) setWeights(weightInit(Out, In));
+        }
+        ~FixedLinear()
+        {
+            delete actFunc;
+        }
+
+        using ILayer::forward;
+        using ILayer::backward;
+
+        void setWeights(const Matrixf& w) override { fixedWeights = lin::FixedMatrix<float, Out, In>(w); }
+
+        //Compute the outputs of the layer from the inputs.
+        //IN: the outputs of the previous layer
+        //OUT: the outputs of this layer
+        lin::FixedVector<float, Out> forward(const lin::FixedVector<float, In>& inVec)
+        {
+            ins = inVec;
+            sums = fixedWeights * inVec;
+            if (bias) sums += fixedBiases;
+            lin::FixedVector<float, Out> res;
+            actFunc->forward(1, Out, sums.nums, res.nums);
+            return res;
+        }
+        Vectorf forward(Vectorf& inVec) override
+        {
+            forward(lin::FixedVector<float, In>(inVec)).copyTo(outs);
+            return outs;
+        }
+
+        lin::MatrixView<const float> weightsView() const override { return fixedWeights.view(); }
+        lin::VectorView<const float> biasesView() const override { return fixedBiases.view(); }
+        bool hasBias() const override { return bias; }
+        const func::AActFunction* activation() const override { return actFunc; }
+
+        void predict(const Matrixf& inBatch, Matrixf& out) const override
+        {
+            if (out.rows != inBatch.rows || out.cols != Out) out = Matrixf(inBatch.rows, Out);
+            lin::FixedVector<float, In> x;
+            for (int r = 0; r < inBatch.rows; r++) {
+                std::copy(inBatch.nums.data() + (size_t)r * In, inBatch.nums.data() + (size_t)(r + 1) * In, x.nums);
+                lin::FixedVector<float, Out> s = fixedWeights * x;
+                if (bias) s += fixedBiases;
+                actFunc->forward(1, Out, s.nums, out[r]);
+            }
+        }
+
+        //Add the gradients w.r.t the weights to weightsGradSum and return the gradient w.r.t the inputs.
+        //IN: gradient w.r.t the outputs, returned from backward() of the next layer
+        //OUT: gradient w.r.t the outputs of the previous layer
+        lin::FixedVector<float, In> backward(const lin::FixedVector<float, Out>& outGrad)
+        {
+            lin::FixedVector<float, Out> sumGrad;
+            actFunc->backward(1, Out, sums.nums, outGrad.nums, sumGrad.nums);
+            lin::ger(1.f, sumGrad, ins, weightsGradSum);
+            if (bias) biasesGradSum += sumGrad;
+            batchSize++;
+            return lin::mulTransposed(fixedWeights, sumGrad);
+        }
+        Vectorf backward(Vectorf& outGrad) override
+        {
+            return backward(lin::FixedVector<float, Out>(outGrad)).toVector();
+        }
+
+        void params(std::vector<param>& out) override
+        {
+            out.push_back({ fixedWeights.nums, weightsGradSum.nums, (size_t)Out * In });
+            if (bias) out.push_back({ fixedBiases.nums, biasesGradSum.nums, (size_t)Out });
+        }
+        ILayer* clone() const override
+        {
+            FixedLinear* l = new FixedLinear(actFunc->clone(), bias, nullptr);
+            l->fixedWeights = fixedWeights;
+            l->fixedBiases = fixedBiases;
+            return l;
+        }
+
+        //Update the weights with the negative of weightsGradSum times a learning rate (SGD).
+        //IN: learning rate
+        void update(float lr) override
+        {
+            fixedWeights -= weightsGradSum * (lr / batchSize);
+            if (bias) fixedBiases -= biasesGradSum * (lr / batchSize);
+        }
+
+        //Set weightsGradSum to zero.
+        void zeroGrad() override
+        {
+            weightsGradSum *= 0.f;
+            if (bias) biasesGradSum *= 0.f;
             batchSize = 0;
         }
     };
@@ -159,6 +566,11 @@ namespace nnet
         std::vector<ILayer*> layers; //each layer in the network
         func::ALossFunction& lossFunc; //the loss function
         Vectorf* output; //the outputs of the last layer
+        Matrixf* batchOutput; //the batch outputs of the last layer, one sample per row
+        std::shared_ptr<void> mapping; //memory the layers' weights point into (a mapped model file, see model.h), freed with the network
+        lin::storage<float> flatValues, flatGrads; //the parameters and gradient sums of all layers after flattenParams()
+    protected:
+        bool isFlat = false;
     public:
         //IN: Any amount of layers, loss function
         template <class ILAYER_ONLY(T), class U>
@@ -167,22 +579,7 @@ namespace nnet
         {
             lossFuncPtr = new U;
             layers.assign(lrs.begin(), lrs.end());
-
-            //set prevOuts of each layer to point to the outputs of the previous layers
-            for (auto it = layers.begin() + 1; it != layers.end(); it++) {
-                (*it)->prevOuts = (&(*(it - 1))->outs);
-            }
-            layers[0]->prevOuts = new Vectorf(layers[0]->inSize);
-
-            //intialize weights
-            if (weightInit != NULL) {
-                for (auto l : layers) {
-                    l->weights = weightInit(l->outSize, l->inSize);
-                    if (weightsMult != 1) l->weights *= weightsMult;
-                }
-            }
-
-            output = &(layers[layers.size() - 1]->outs);
+            connectLayers(weightInit, weightsMult);
         }
         template <class ILAYER_ONLY(T), class U>
         Network(std::initializer_list<T*> lrs, U* lossFncPtr, std::function<Matrixf(int, int)> weightInit = NULL, float weightsMult= 1)
@@ -190,33 +587,97 @@ namespace nnet
         {
             lossFuncPtr = lossFncPtr;
             layers.assign(lrs.begin(), lrs.end());
+            connectLayers(weightInit, weightsMult);
+        }
+        //From layers built at runtime, e.g. by loadModel(). The network owns the layers and the loss function.
+        Network(const std::vector<ILayer*>& lrs, func::ALossFunction* lossFncPtr) : lossFunc(*lossFncPtr)
+        {
+            lossFuncPtr = lossFncPtr;
+            layers = lrs;
+            connectLayers(NULL, 1);
+        }
 
-            //set prevOuts to point to the outputs of the previous layers
+    protected:
+        void connectLayers(std::function<Matrixf(int, int)> weightInit, float weightsMult)
+        {
+            //set prevOuts of each layer to point to the outputs of the previous layers
             for (auto it = layers.begin() + 1; it != layers.end(); it++) {
                 (*it)->prevOuts = (&(*(it - 1))->outs);
+                (*it)->prevBatchOuts = (&(*(it - 1))->batchOuts);
             }
             layers[0]->prevOuts = new Vectorf(layers[0]->inSize);
-            
+            layers[0]->prevBatchOuts = new Matrixf();
+
             //intialize weights
             if (weightInit != NULL) {
                 for (auto l : layers) {
-                    l->weights = weightInit(l->outSize, l->inSize);
-                    if (weightsMult != 1) l->weights *= weightsMult;
+                    std::pair<int, int> shape = l->weightsShape();
+                    if (shape.first == 0) continue;
+                    Matrixf w = weightInit(shape.first, shape.second);
+                    if (weightsMult != 1) w *= weightsMult;
+                    l->setWeights(w);
                 }
             }
 
             output = &(layers[layers.size() - 1]->outs);
+            batchOutput = &(layers[layers.size() - 1]->batchOuts);
         }
-
+    public:
         ~Network()
         {
             delete lossFuncPtr;
             delete layers[0]->prevOuts;
+            delete layers[0]->prevBatchOuts;
             for (int i = 0; i < layers.size(); i++) {
                 delete layers[i];
             }
         }
 
+        //Move the trained tensors and gradient sums of all layers into two contiguous buffers of the network, flatValues and
+        //flatGrads, each tensor starting on a cache line, and let the layers compute on them there (ILayer::bindParams()). Then
+        //the optimizer steps all of them in one pass (optim::SGD::useFlat()), zeroing the gradients is one fill and exchanging
+        //them between replicas one copy (trainer.h). Flatten before creating trainers, they keep pointers to the tensors.
+        //Throws std::runtime_error, changing nothing, if a layer can't be bound (FixedLinear keeps its weights inline).
+        //OUT: the buffers, for SGD::useFlat()
+        optim::flatBuffer flattenParams()
+        {
+            for (size_t i = 0; i < layers.size(); i++) {
+                if (!layers[i]->canBindParams()) throw std::runtime_error("flattenParams: layer " + std::to_string(i) + " can't be flattened");
+            }
+            const size_t align = 64 / sizeof(float);
+            std::vector<std::vector<ILayer::param>> from(layers.size());
+            size_t size = 0;
+            for (size_t i = 0; i < layers.size(); i++) {
+                layers[i]->params(from[i]);
+                for (const ILayer::param& p : from[i]) { size += (p.size + align - 1) / align * align; }
+            }
+            //built aside: the old buffers (when flattening again) are freed only after all tensors are copied out of them
+            lin::storage<float> values(size, 0.f), grads(size, 0.f);
+            size_t offset = 0;
+            for (size_t i = 0; i < layers.size(); i++) {
+                std::vector<ILayer::param> to;
+                for (const ILayer::param& p : from[i]) {
+                    std::copy(p.value, p.value + p.size, values.data() + offset);
+                    std::copy(p.grad, p.grad + p.size, grads.data() + offset);
+                    to.push_back({ values.data() + offset, grads.data() + offset, p.size });
+                    offset += (p.size + align - 1) / align * align;
+                }
+                layers[i]->bindParams(to);
+            }
+            flatValues.swap(values);
+            flatGrads.swap(grads);
+            isFlat = true;
+            return { flatValues.data(), flatGrads.data(), flatValues.size() };
+        }
+        bool flat() const { return isFlat; }
+
+        //Append the trained tensors of all layers to out (ILayer::params()), after flattenParams() one covering the whole buffer.
+        void params(std::vector<ILayer::param>& out)
+        {
+            if (isFlat) out.push_back({ flatValues.data(), flatGrads.data(), flatValues.size() });
+            else { for (ILayer* l : layers) { l->params(out); } }
+        }
+
         //Propagate forward with an input vector; call forward() on each layer.
         //IN: a Vectorf of inputs to the network
         void forward(Vectorf input)
@@ -239,5 +700,66 @@ namespace nnet
                 outGrad = layers[i]->backward(outGrad);
             }
         }
+
+        //Propagate a batch forward, one sample per row; call the batch forward() on each layer. The outputs end up in *batchOutput.
+        //IN: a batch*inputs Matrixf
+        void forward(Matrixf& inputs)
+        {
+            *layers[0]->prevBatchOuts = inputs;
+            Matrixf* in = layers[0]->prevBatchOuts;
+            for (int i = 0; i < layers.size(); i++) {
+                in = &layers[i]->forward(*in);
+            }
+        }
+
+        //Propagate a batch backward; call the batch backward() on each layer.
+        //IN: a batch*labels Matrixf, one label per row
+        void backward(Matrixf& labels)
+        {
+            Matrixf outGrad = lossFunc.backward(*batchOutput, labels);
+            for (int i = layers.size() - 1; i >= 0; i--) {
+                outGrad = layers[i]->backward(outGrad);
+            }
+        }
+
+        //Record a batch forward pass on an autograd tape (ILayer::forward(Tape&, Var)). Back-propagating the loss,
+        //tape.backward(tape.loss(out, labels, lossFunc)), adds the gradients to the layers' sums, so update() works as usual.
+        //IN: tape, a batch*inputs Matrixf (must stay unchanged until backward is done)
+        //OUT: the batch outputs
+        autograd::Var forward(autograd::Tape& tape, const Matrixf& inputs)
+        {
+            autograd::Var x = tape.input(inputs);
+            for (ILayer* l : layers) { x = l->forward(tape, x); }
+            return x;
+        }
+
+        //Inference only: run a batch through the layers' predict(), leaving the network unchanged (output, batchOutput,
+        //the layers' outs and sums are not touched), so one network can serve any number of threads at once.
+        //The layer outputs alternate between the two scratch matrices, which are resized as needed and can be reused between calls.
+        //IN: a batch*inputs Matrixf, the outputs (batch*outputs), two scratch matrices owned by the caller
+        void predict(const Matrixf& inputs, Matrixf& outputs, Matrixf& scratchA, Matrixf& scratchB) const
+        {
+            Matrixf* scratch[2] = { &scratchA, &scratchB };
+            const Matrixf* in = &inputs;
+            for (size_t i = 0; i < layers.size(); i++) {
+                Matrixf* out = i + 1 == layers.size() ? &outputs : scratch[i % 2];
+                layers[i]->predict(*in, *out);
+                in = out;
+            }
+        }
+        //Same with thread-local scratch matrices, kept for the next call on the same thread.
+        void predict(const Matrixf& inputs, Matrixf& outputs) const
+        {
+            thread_local Matrixf scratchA, scratchB;
+            predict(inputs, outputs, scratchA, scratchB);
+        }
+        //IN: a Vectorf of inputs
+        //OUT: the outputs of the network
+        Vectorf predict(const Vectorf& input) const
+        {
+            Matrixf in(1, input.size(), std::vector<float>(input.nums.begin(), input.nums.end())), out;
+            predict(in, out);
+            return Vectorf(std::vector<float>(out.nums.begin(), out.nums.end()));
+        }
     };
 }
\ No newline at end of file
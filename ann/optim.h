@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <vector>
 #include "nnet.h"
 
@@ -11,10 +12,20 @@ namespace optim
     {
     public:
         linalg::Matrix<float> weights;
+        int batchSize = 0; //the number of samples in the gradient sums, to determine how large the step for SGD should be
         virtual void update(float lr) = 0;
         virtual void zeroGrad() = 0;
     };
 
+    //All values and all gradient sums of a model's parameters in two contiguous buffers of size floats each, the gradient of
+    //values[i] at grads[i], e.g. from nnet::Network::flattenParams()
+    struct flatBuffer
+    {
+        float* values = nullptr;
+        float* grads = nullptr;
+        size_t size = 0;
+    };
+
     //Stochastic gradient descent optimizer (so far it's not much of an optimizer, the steps are still done on the layers)
     class SGD
     {
@@ -24,6 +35,7 @@ namespace optim
         float learnRateDecaySpeed;
         int callCount = 0;
         std::vector<IOptimizable*> parameters;
+        flatBuffer flat; //see useFlat()
     public:
         //IN: IOptimizable parameters, learning rate, decay speed of learning rate
         template <class IOPTIMIZABLE_ONLY(T)>
@@ -35,6 +47,10 @@ namespace optim
             learnRateDecaySpeed = decaySpeed;
         }
 
+        //Step and zero all parameters at once in a flat buffer that holds all of them (and nothing else), instead of element by
+        //element: one vectorized pass over the values and one fill of the gradients.
+        void useFlat(const flatBuffer& buffer) { flat = buffer; }
+
         //Updates each element with learning rate
         void step()
         {
@@ -42,6 +58,20 @@ namespace optim
                 learnRate = initialLearnRate * (1 / (1 + sqrt(callCount * learnRateDecaySpeed)));
                 callCount++;
             }
+            //the flat step needs one batch size for all elements (the same unless some were trained on their own);
+            //elements without samples have zero gradients
+            int batch = 0;
+            bool uniform = flat.size > 0;
+            for (int i = 0; i < parameters.size() && uniform; i++) {
+                int b = parameters[i]->batchSize;
+                if (b == 0) continue;
+                if (batch != 0 && b != batch) uniform = false;
+                batch = b;
+            }
+            if (uniform) {
+                if (batch > 0) linalg::kernels::axpy((int)flat.size, -learnRate / batch, flat.grads, flat.values);
+                return;
+            }
             for (int i = 0; i < parameters.size(); i++) {
                 parameters[i]->update(learnRate);
             }
@@ -50,6 +80,11 @@ namespace optim
         //Sets the accumulated gradient of each element to zeros
         void zeroGrad()
         {
+            if (flat.size > 0) {
+                std::fill(flat.grads, flat.grads + flat.size, 0.f);
+                for (int i = 0; i < parameters.size(); i++) { parameters[i]->batchSize = 0; }
+                return;
+            }
             for (int i = 0; i < parameters.size(); i++) {
                 parameters[i]->zeroGrad();
             }
@@ -0,0 +1,300 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "nnet.h"
+#include "metrics.h"
+#include "trainer.h"
+
+//Pipeline parallelism: the layers of a network are split into stages of contiguous layers, each run by its own thread, and a batch
+//is split into micro-batches that flow through the stages, so all stages work at once on different micro-batches even when a single
+//layer is too small to be split across threads. Stages pass micro-batch numbers through bounded single-producer/single-consumer
+//queues: forward to the next stage, backward to the previous one. The data itself stays in buffers of the pipeline.
+//Each stage runs the 1F1B schedule: after a warm-up of forwards (more the earlier the stage), it alternates one forward and one
+//backward, so stage s holds at most numStages - s micro-batches in flight, and the activations of numStages micro-batches are kept
+//instead of all of them. A trainStep() runs all micro-batches forward and backward before it returns (a flush), so the gradient
+//sums are those of the whole batch and the optimizer steps as usual. A stage that throws aborts the queues, so the other stages
+//stop waiting for it and the step throws the stage's exception.
+namespace nnet
+{
+    //Bounded queue for one producer and one consumer thread, without locks. push() waits while it's full, pop() while it's empty.
+    //After abort(), waiting in either throws std::runtime_error, until reset().
+    template <class T>
+    class SpscQueue
+    {
+        std::vector<T> items;
+        alignas(64) std::atomic<size_t> head; //next item to pop, written by the consumer
+        alignas(64) std::atomic<size_t> tail; //next free place, written by the producer
+        std::atomic<bool> aborted;
+    public:
+        explicit SpscQueue(size_t capacity = 1) : items(std::max<size_t>(capacity, 1)), head(0), tail(0), aborted(false) {}
+
+        void push(const T& item)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            while (t - head.load(std::memory_order_acquire) == items.size()) { wait(); }
+            items[t % items.size()] = item;
+            tail.store(t + 1, std::memory_order_release);
+        }
+        T pop()
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+            while (tail.load(std::memory_order_acquire) == h) { wait(); }
+            T item = items[h % items.size()];
+            head.store(h + 1, std::memory_order_release);
+            return item;
+        }
+        //Make the waiting push() or pop() and all later ones throw. Any thread may call it.
+        void abort() { aborted.store(true, std::memory_order_release); }
+        //Empty the queue and clear abort(), while neither thread uses it.
+        void reset()
+        {
+            head.store(0, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+            aborted.store(false, std::memory_order_relaxed);
+        }
+    protected:
+        void wait()
+        {
+            if (aborted.load(std::memory_order_acquire)) throw std::runtime_error("SpscQueue: aborted");
+            std::this_thread::yield();
+        }
+    };
+
+    class Pipeline
+    {
+    protected:
+        //what the pipeline keeps of a layer, per slot: a micro-batch m uses the buffers of slot m % numSlots
+        struct layerState
+        {
+            ILayer* layer;
+            Linear* linear; //nullptr: run through the layer's Matrixf interface
+            std::vector<Matrixf> outs; //the outputs
+            std::vector<Matrixf> sums; //the weighted sums (Linear)
+            std::vector<Matrixf> grads; //the gradient w.r.t the outputs
+            Matrixf in; //other layers: the inputs they read (their prevBatchOuts point here while the pipeline exists)
+            Matrixf* savedPrev = nullptr;
+        };
+        Network& net;
+        std::vector<int> starts; //the first layer of each stage, plus the number of layers
+        int microBatches;
+        int numSlots;
+        std::vector<layerState> layers;
+        std::vector<std::unique_ptr<SpscQueue<int>>> forwardQueues; //from stage s to s + 1
+        std::vector<std::unique_ptr<SpscQueue<int>>> backwardQueues; //from stage s + 1 to s
+        //the current step
+        std::vector<Matrixf> microInputs, microLabels;
+        metrics::Metrics* stats = nullptr;
+        float loss = 0;
+        //the stage threads (stage 0 runs on the thread calling trainStep())
+        std::unique_ptr<WorkerThreads> threads;
+        std::mutex mutex;
+        std::exception_ptr error; //the first exception of a stage in the current step
+    public:
+        //Split the layers into numStages stages of about equal work (weights, or inputs plus outputs for layers without).
+        //IN: network (must outlive the pipeline and not be trained through otherwise meanwhile), number of stages (threads),
+        //number of micro-batches each batch is split into (at least numStages to keep all stages busy)
+        Pipeline(Network& net_, int numStages, int microBatches_) : Pipeline(net_, balancedStages(net_, numStages), microBatches_) {}
+        //IN: network, the first layer of each stage (starting with 0, increasing), number of micro-batches
+        Pipeline(Network& net_, const std::vector<int>& firstLayers, int microBatches_) : net(net_), starts(firstLayers), microBatches(microBatches_)
+        {
+            int L = (int)net.layers.size();
+            if (starts.empty() || starts[0] != 0) throw std::runtime_error("Pipeline: the first stage must start at layer 0");
+            for (size_t s = 1; s < starts.size(); s++) {
+                if (starts[s] <= starts[s - 1] || starts[s] >= L) throw std::runtime_error("Pipeline: bad first layer of stage " + std::to_string(s));
+            }
+            if (microBatches <= 0) throw std::runtime_error("Pipeline: microBatches must be positive");
+            starts.push_back(L);
+            numSlots = std::min(microBatches, numStages());
+
+            layers.resize(L);
+            for (int i = 0; i < L; i++) {
+                layerState& st = layers[i];
+                st.layer = net.layers[i];
+                st.linear = dynamic_cast<Linear*>(st.layer);
+                st.outs.resize(numSlots);
+                st.grads.resize(numSlots);
+                if (st.linear) st.sums.resize(numSlots);
+                else {
+                    st.savedPrev = st.layer->prevBatchOuts;
+                    st.layer->prevBatchOuts = &st.in;
+                }
+            }
+            for (int s = 0; s + 1 < numStages(); s++) {
+                forwardQueues.emplace_back(new SpscQueue<int>(numSlots));
+                backwardQueues.emplace_back(new SpscQueue<int>(numSlots));
+            }
+            threads.reset(new WorkerThreads(numStages()));
+        }
+        ~Pipeline()
+        {
+            threads.reset();
+            for (layerState& st : layers) {
+                if (!st.linear) st.layer->prevBatchOuts = st.savedPrev;
+            }
+        }
+        Pipeline(const Pipeline&) = delete;
+        Pipeline& operator = (const Pipeline&) = delete;
+
+        int numStages() const { return (int)starts.size() - 1; }
+        //the first layer of stage s (s = numStages(): the number of layers)
+        int firstLayer(int s) const { return starts[s]; }
+
+        //Forward and backward for a batch, as micro-batches through the stages. The layers' gradient sums and batch sizes are
+        //accumulated as by Network::forward()/backward(), then call the optimizer's step(). If a layer throws, all stages stop and the
+        //exception is rethrown; the gradient sums are partial then, zero them before the next step.
+        //IN: a batch*inputs Matrixf, the batch*labels Matrixf, metrics to add the outputs of the batch to (optional)
+        //OUT: the loss summed over the batch
+        float trainStep(const Matrixf& inputs, const Matrixf& labels, metrics::Metrics* stats_ = nullptr)
+        {
+            assert(labels.rows == inputs.rows && inputs.cols == net.layers[0]->inSize);
+            microInputs.resize(microBatches);
+            microLabels.resize(microBatches);
+            for (int m = 0; m < microBatches; m++) {
+                int lo = (int)((long long)inputs.rows * m / microBatches), hi = (int)((long long)inputs.rows * (m + 1) / microBatches);
+                copyRows(inputs, lo, hi, microInputs[m]);
+                copyRows(labels, lo, hi, microLabels[m]);
+            }
+            stats = stats_;
+            loss = 0;
+            error = nullptr;
+            for (size_t q = 0; q < forwardQueues.size(); q++) {
+                forwardQueues[q]->reset();
+                backwardQueues[q]->reset();
+            }
+            threads->run([this](int s) { stageJob(s); });
+            if (error) std::rethrow_exception(error);
+            return loss;
+        }
+
+        //Split the layers into numStages contiguous groups of about equal work.
+        //OUT: the first layer of each stage
+        static std::vector<int> balancedStages(const Network& net, int numStages)
+        {
+            int L = (int)net.layers.size();
+            if (numStages <= 0 || numStages > L) throw std::runtime_error("Pipeline: need between 1 and " + std::to_string(L) + " stages");
+            std::vector<double> prefix(L + 1, 0);
+            for (int i = 0; i < L; i++) {
+                std::pair<int, int> w = net.layers[i]->weightsShape();
+                double work = w.first > 0 ? (double)w.first * w.second : (double)net.layers[i]->inSize + net.layers[i]->outSize;
+                prefix[i + 1] = prefix[i] + work;
+            }
+            std::vector<int> firstLayers = { 0 };
+            for (int s = 1; s < numStages; s++) {
+                //the first layer whose work starts at or past s/numStages of the total, leaving at least one layer per stage
+                double target = prefix[L] * s / numStages;
+                int i = firstLayers.back() + 1;
+                while (i < L - (numStages - s) && prefix[i] < target) i++;
+                firstLayers.push_back(i);
+            }
+            return firstLayers;
+        }
+    protected:
+        static void copyRows(const Matrixf& m, int lo, int hi, Matrixf& out)
+        {
+            if (out.rows != hi - lo || out.cols != m.cols) out = Matrixf(hi - lo, m.cols);
+            std::copy(m.nums.begin() + (size_t)lo * m.cols, m.nums.begin() + (size_t)hi * m.cols, out.nums.begin());
+        }
+        static Matrixf& sized(Matrixf& m, int rows, int cols)
+        {
+            if (m.rows != rows || m.cols != cols) m = Matrixf(rows, cols);
+            return m;
+        }
+
+        //a stage that throws keeps its exception (unless another stage's came first) and aborts the queues, so the stages waiting for
+        //it throw too, instead of waiting forever
+        void stageJob(int s)
+        {
+            try {
+                runStage(s);
+            }
+            catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (error == nullptr) error = std::current_exception();
+                }
+                for (size_t q = 0; q < forwardQueues.size(); q++) {
+                    forwardQueues[q]->abort();
+                    backwardQueues[q]->abort();
+                }
+            }
+        }
+
+        //1F1B: numStages - 1 - s forwards to fill the pipeline, then one forward and one backward in turn, then the remaining backwards
+        void runStage(int s)
+        {
+            int warmup = std::min(numStages() - 1 - s, microBatches);
+            int f = 0, b = 0;
+            for (; f < warmup; f++) { forwardMicro(s, f); }
+            while (f < microBatches) {
+                forwardMicro(s, f++);
+                backwardMicro(s, b++);
+            }
+            while (b < microBatches) { backwardMicro(s, b++); }
+        }
+
+        //the inputs of layer i for micro-batch m
+        const Matrixf& inputOf(int i, int m) { return i == 0 ? microInputs[m] : layers[i - 1].outs[m % numSlots]; }
+
+        void forwardMicro(int s, int m)
+        {
+            if (s > 0) {
+                int got = forwardQueues[s - 1]->pop();
+                assert(got == m);
+            }
+            int slot = m % numSlots, rows = microInputs[m].rows;
+            //an empty micro-batch (a batch smaller than microBatches) only passes its number on
+            for (int i = starts[s]; rows > 0 && i < starts[s + 1]; i++) {
+                layerState& st = layers[i];
+                const Matrixf& in = inputOf(i, m);
+                Matrixf& out = sized(st.outs[slot], rows, st.layer->outSize);
+                if (st.linear) st.linear->forward(rows, in.nums.data(), sized(st.sums[slot], rows, st.layer->outSize).nums.data(), out.nums.data());
+                else {
+                    st.in = in;
+                    out = st.layer->forward(st.in);
+                }
+            }
+            if (s + 1 < numStages()) forwardQueues[s]->push(m);
+        }
+
+        void backwardMicro(int s, int m)
+        {
+            int slot = m % numSlots, rows = microInputs[m].rows;
+            int L = (int)layers.size();
+            if (s + 1 < numStages()) {
+                int got = backwardQueues[s]->pop();
+                assert(got == m);
+            }
+            else if (rows > 0) {
+                //the last stage starts backward at the loss
+                layerState& last = layers[L - 1];
+                const Matrixf& out = last.outs[slot];
+                const Matrixf& y = microLabels[m];
+                loss += net.lossFunc.lossSum(rows, out.cols, out.nums.data(), y.nums.data());
+                if (stats) stats->add(&net.lossFunc, out, y);
+                net.lossFunc.gradient(rows, out.cols, out.nums.data(), y.nums.data(), sized(last.grads[slot], rows, out.cols).nums.data());
+            }
+            for (int i = starts[s + 1] - 1; rows > 0 && i >= starts[s]; i--) {
+                layerState& st = layers[i];
+                const Matrixf& in = inputOf(i, m);
+                float* inGrad = i > 0 ? sized(layers[i - 1].grads[slot], rows, st.layer->inSize).nums.data() : nullptr;
+                if (st.linear) st.linear->backward(rows, in.nums.data(), st.sums[slot].nums.data(), st.grads[slot].nums.data(), inGrad);
+                else {
+                    //the layer's own state is of a later micro-batch by now: run this one forward again first
+                    st.in = in;
+                    st.layer->forward(st.in);
+                    Matrixf g = st.grads[slot];
+                    Matrixf newGrad = st.layer->backward(g);
+                    if (inGrad) std::copy(newGrad.nums.begin(), newGrad.nums.end(), inGrad);
+                }
+            }
+            if (s > 0) backwardQueues[s - 1]->push(m);
+        }
+    };
+}
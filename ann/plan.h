@@ -0,0 +1,234 @@
+#pragma once
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "nnet.h"
+
+//Static execution plans: a Network compiled once for a largest batch size into a fixed list of steps over preallocated buffers.
+//Compiling infers the shape of every value a pass produces (layer outputs, weighted sums, gradients), checks that the layers fit
+//together, and assigns the values to buffers by their lifetimes, so a buffer is reused as soon as the value in it is dead:
+//an inference plan needs two buffers however deep the network is, a training plan keeps what backward needs and lets the gradients
+//share the rest. Running the plan allocates nothing for Linear layers: they compute straight on the buffers with the bias and activation
+//fused into the GEMM epilogue, the loss gradient is written into the buffer the last layer's backward works in place on, and the
+//input gradient of the first layer isn't computed at all. Other layers run through their Matrixf interface, which allocates.
+namespace nnet
+{
+    class Plan
+    {
+    public:
+        //a value of the pass: its width (floats per sample), the steps it lives in and the buffer it's assigned to
+        struct value
+        {
+            std::string name;
+            int width;
+            int def; //the step that writes it
+            int lastUse; //the last step that reads it
+            int buffer = -1;
+        };
+        //one layer of the network, with the values it reads and writes (-1: none, for inputs: the caller's inputs)
+        struct step
+        {
+            ILayer* layer;
+            Linear* linear; //nullptr: not a Linear, run through the layer's Matrixf interface
+            int in = -1, sums = -1, out = -1, outGrad = -1, inGrad = -1;
+        };
+    protected:
+        Network& net;
+        int maxBatch;
+        bool training;
+        std::vector<value> values;
+        std::vector<step> steps;
+        std::vector<lin::storage<float>> buffers;
+        int rows = 0; //the size of the last batch
+    public:
+        //Compile a network. Throws std::runtime_error if the sizes of adjacent layers don't match.
+        //IN: network (must outlive the plan), the largest batch the plan runs, compile for training (trainStep()) or inference only
+        Plan(Network& net_, int maxBatch_, bool training_ = true) : net(net_), maxBatch(maxBatch_), training(training_)
+        {
+            if (maxBatch <= 0) throw std::runtime_error("Plan: maxBatch must be positive");
+            inferShapes();
+            assignBuffers();
+        }
+
+        //Run a batch forward. Throws std::runtime_error if the batch is larger than the plan's or has the wrong width.
+        //IN: a batch*inputs Matrixf with at most maxBatch rows
+        //OUT: the outputs (batch*outputs), valid until the next call
+        lin::MatrixView<const float> forward(const Matrixf& inputs)
+        {
+            if (inputs.rows > maxBatch || inputs.cols != net.layers[0]->inSize) {
+                throw std::runtime_error("Plan: a " + std::to_string(inputs.rows) + "x" + std::to_string(inputs.cols) + " batch doesn't fit a plan for up to "
+                    + std::to_string(maxBatch) + "x" + std::to_string(net.layers[0]->inSize));
+            }
+            rows = inputs.rows;
+            for (const step& s : steps) {
+                const float* in = s.in < 0 ? inputs.nums.data() : data(s.in);
+                if (s.linear) s.linear->forward(rows, in, s.sums < 0 ? nullptr : data(s.sums), data(s.out));
+                else forwardLayer(s, in);
+            }
+            return output();
+        }
+
+        //Forward and backward for a batch. The layers' gradient sums are accumulated as by Network::forward()/backward(),
+        //so the optimizer and update() work as usual. Only for plans compiled for training. Throws std::runtime_error if the plan
+        //is for inference, or the batch doesn't fit (see forward()) or doesn't match the labels.
+        //IN: a batch*inputs Matrixf with at most maxBatch rows, the batch*labels Matrixf
+        //OUT: the loss summed over the batch
+        float trainStep(const Matrixf& inputs, const Matrixf& labels)
+        {
+            if (!training) throw std::runtime_error("Plan: trainStep() on a plan compiled for inference");
+            if (labels.rows != inputs.rows || labels.cols != net.layers.back()->outSize) {
+                throw std::runtime_error("Plan: " + std::to_string(labels.rows) + "x" + std::to_string(labels.cols) + " labels for a batch of "
+                    + std::to_string(inputs.rows) + " with " + std::to_string(net.layers.back()->outSize) + " outputs");
+            }
+            forward(inputs);
+            int outSize = net.layers.back()->outSize;
+            const float* outs = data(steps.back().out);
+            float loss = net.lossFunc.lossSum(rows, outSize, outs, labels.nums.data());
+            net.lossFunc.gradient(rows, outSize, outs, labels.nums.data(), data(steps.back().outGrad));
+            for (int i = (int)steps.size() - 1; i >= 0; i--) {
+                const step& s = steps[i];
+                const float* in = s.in < 0 ? inputs.nums.data() : data(s.in);
+                float* inGrad = s.inGrad < 0 ? nullptr : data(s.inGrad);
+                if (s.linear) s.linear->backward(rows, in, data(s.sums), data(s.outGrad), inGrad);
+                else backwardLayer(s, inGrad);
+            }
+            return loss;
+        }
+
+        //the outputs of the last forward() or trainStep()
+        lin::MatrixView<const float> output() const
+        {
+            return lin::MatrixView<const float>(data(steps.back().out), rows, net.layers.back()->outSize);
+        }
+
+        int batchCapacity() const { return maxBatch; }
+        size_t numBuffers() const { return buffers.size(); }
+        //the memory of all buffers
+        size_t bufferBytes() const
+        {
+            size_t bytes = 0;
+            for (const lin::storage<float>& b : buffers) { bytes += b.size() * sizeof(float); }
+            return bytes;
+        }
+        const std::vector<value>& planValues() const { return values; }
+
+        //Print the values of the pass, their lifetimes and buffers.
+        void print(std::ostream& os = std::cout) const
+        {
+            os << (training ? "Training" : "Inference") << " plan for batches of up to " << maxBatch << ": "
+                << values.size() << " values in " << buffers.size() << " buffers (" << bufferBytes() / 1024 << " KiB)\n";
+            for (const value& v : values) {
+                os << "  " << v.name << ": " << v.width << " per sample, steps " << v.def << " - " << v.lastUse << ", buffer " << v.buffer << "\n";
+            }
+        }
+    protected:
+        float* data(int v) { return buffers[values[v].buffer].data(); }
+        const float* data(int v) const { return buffers[values[v].buffer].data(); }
+
+        int addValue(const std::string& name, int width, int def, int lastUse)
+        {
+            value v;
+            v.name = name;
+            v.width = width;
+            v.def = def;
+            v.lastUse = lastUse;
+            values.push_back(v);
+            return (int)values.size() - 1;
+        }
+
+        //Check the layer sizes and create the values of the pass with their lifetimes, in steps:
+        //forward of layer i is step i, the loss gradient step L, backward of layer i step 2L - i (L layers).
+        void inferShapes()
+        {
+            std::vector<ILayer*>& layers = net.layers;
+            int L = (int)layers.size();
+            if (L == 0) throw std::runtime_error("Plan: the network has no layers");
+            for (int i = 1; i < L; i++) {
+                if (layers[i]->inSize != layers[i - 1]->outSize) {
+                    throw std::runtime_error("Plan: layer " + std::to_string(i) + " takes " + std::to_string(layers[i]->inSize)
+                        + " inputs, but layer " + std::to_string(i - 1) + " has " + std::to_string(layers[i - 1]->outSize) + " outputs");
+                }
+            }
+            const int end = training ? 2 * L + 1 : L; //after the last step: the outputs stay readable
+            steps.resize(L);
+            for (int i = 0; i < L; i++) {
+                step& s = steps[i];
+                s.layer = layers[i];
+                s.linear = dynamic_cast<Linear*>(layers[i]);
+                s.in = i == 0 ? -1 : steps[i - 1].out;
+                //the outputs are read by the next layer's forward, and its backward when training (they're its inputs)
+                int lastUse = i + 1 == L ? end : training ? 2 * L - (i + 1) : i + 1;
+                s.out = addValue("outs " + std::to_string(i), layers[i]->outSize, i, lastUse);
+                if (training && s.linear) s.sums = addValue("sums " + std::to_string(i), layers[i]->outSize, i, 2 * L - i);
+            }
+            if (!training) return;
+            for (int i = L - 1; i >= 0; i--) {
+                step& s = steps[i];
+                //the gradient w.r.t the outputs of layer i is written by the loss (last layer) or by backward of layer i + 1
+                if (i == L - 1) s.outGrad = addValue("loss grad", layers[i]->outSize, L, 2 * L - i);
+                else s.outGrad = steps[i + 1].inGrad;
+                //the first layer's input gradient is only needed by layers that always compute it
+                if (i > 0) s.inGrad = addValue("grad " + std::to_string(i - 1), layers[i]->inSize, 2 * L - i, 2 * L - i + 1);
+            }
+        }
+
+        //Assign the values to buffers in the order they are written: a value takes the smallest free buffer that's large enough,
+        //or grows the largest free one, or gets a new buffer. Values that are last read before the step that writes a value are free
+        //by then; a step's inputs and outputs never share a buffer.
+        void assignBuffers()
+        {
+            std::vector<int> order(values.size());
+            for (size_t i = 0; i < order.size(); i++) { order[i] = (int)i; }
+            std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return values[a].def < values[b].def; });
+            std::vector<size_t> capacity;
+            std::vector<int> busyUntil; //the lastUse of the value in each buffer
+            for (int v : order) {
+                value& val = values[v];
+                size_t need = (size_t)val.width * maxBatch;
+                int best = -1, largest = -1;
+                for (int b = 0; b < (int)capacity.size(); b++) {
+                    if (busyUntil[b] >= val.def) continue;
+                    if (capacity[b] >= need && (best < 0 || capacity[b] < capacity[best])) best = b;
+                    if (largest < 0 || capacity[b] > capacity[largest]) largest = b;
+                }
+                if (best < 0) best = largest;
+                if (best < 0) {
+                    best = (int)capacity.size();
+                    capacity.push_back(0);
+                    busyUntil.push_back(0);
+                }
+                capacity[best] = std::max(capacity[best], need);
+                busyUntil[best] = val.lastUse;
+                val.buffer = best;
+            }
+            buffers.clear();
+            for (size_t c : capacity) { buffers.emplace_back(c); }
+        }
+
+        //Layers other than Linear: copy the inputs into the matrix the layer reads them from (the previous layer's batchOuts,
+        //unused by the plan), run its batched forward() and copy the outputs into the plan's buffer.
+        void forwardLayer(const step& s, const float* in)
+        {
+            Matrixf& x = *s.layer->prevBatchOuts;
+            if (x.rows != rows || x.cols != s.layer->inSize) x = Matrixf(rows, s.layer->inSize);
+            std::copy(in, in + (size_t)rows * s.layer->inSize, x.nums.begin());
+            if (training) {
+                Matrixf& y = s.layer->forward(x);
+                std::copy(y.nums.begin(), y.nums.end(), data(s.out));
+            }
+            else {
+                s.layer->predict(x, s.layer->batchOuts);
+                std::copy(s.layer->batchOuts.nums.begin(), s.layer->batchOuts.nums.end(), data(s.out));
+            }
+        }
+        void backwardLayer(const step& s, float* inGrad)
+        {
+            const float* g = data(s.outGrad);
+            Matrixf outGrad(rows, s.layer->outSize, std::vector<float>(g, g + (size_t)rows * s.layer->outSize));
+            Matrixf grad = s.layer->backward(outGrad);
+            if (inGrad) std::copy(grad.nums.begin(), grad.nums.end(), inGrad);
+        }
+    };
+}
@@ -0,0 +1,596 @@
+#pragma once
+#include <algorithm>
+#include <immintrin.h>
+#include "threads.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LINALG_TARGET(isa)
+#else
+#include <cpuid.h>
+#define LINALG_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+//Explicit SSE/AVX2/AVX-512 kernels for the float elementwise ops, reductions and GEMV in linalg.
+//The widest ISA the cpu (and os) supports is detected once with CPUID and the matching kernels are stored in a table.
+//Every kernel has a generic scalar template with the same name, so linalg's operators just call kernels::add etc.
+//and overload resolution picks the SIMD version for float.
+namespace linalg
+{
+    namespace kernels
+    {
+        enum simdLevel { scalar, sse, avx2, avx512 };
+        constexpr int PARALLEL_MIN_ELEMS = 1 << 16; //below this many elements (or multiply-adds) a kernel runs on the calling thread
+
+        /// scalar reference kernels, used for non-float types and when no SIMD ISA is available ///
+
+        //out[i] = x[i] + y[i], out may alias x or y
+        template <class T>
+        void add(int n, const T* x, const T* y, T* out) { for (int i = 0; i < n; i++) { out[i] = x[i] + y[i]; } }
+        //out[i] = x[i] - y[i], out may alias x or y
+        template <class T>
+        void sub(int n, const T* x, const T* y, T* out) { for (int i = 0; i < n; i++) { out[i] = x[i] - y[i]; } }
+        //out[i] = x[i] * a, out may alias x
+        template <class T>
+        void scale(int n, const T* x, T a, T* out) { for (int i = 0; i < n; i++) { out[i] = x[i] * a; } }
+        template <class T>
+        T dot(int n, const T* x, const T* y)
+        {
+            T res = 0;
+            for (int i = 0; i < n; i++) { res += x[i] * y[i]; }
+            return res;
+        }
+        template <class T>
+        T sum(int n, const T* x)
+        {
+            T res = 0;
+            for (int i = 0; i < n; i++) { res += x[i]; }
+            return res;
+        }
+        //y[i] += a * x[i]
+        template <class T>
+        void axpy(int n, T a, const T* x, T* y) { for (int i = 0; i < n; i++) { y[i] += a * x[i]; } }
+        //out[i] = x[i] > 0 ? x[i] : slope * x[i] (leaky ReLU, plain ReLU for slope 0), out may alias x
+        template <class T>
+        void leakyRelu(int n, T slope, const T* x, T* out) { for (int i = 0; i < n; i++) { out[i] = x[i] > 0 ? x[i] : slope * x[i]; } }
+        //out[i] = x[i] >= 0 ? g[i] : slope * g[i], the gradient of leakyRelu times g, out may alias x or g
+        template <class T>
+        void leakyReluBackward(int n, T slope, const T* x, const T* g, T* out)
+        {
+            for (int i = 0; i < n; i++) { out[i] = x[i] >= 0 ? g[i] : slope * g[i]; }
+        }
+
+        //alpha * r + beta * y, without reading y if beta is 0 (BLAS semantics, y may be uninitialized)
+        template <class T>
+        T scaleResult(T alpha, T r, T beta, T y) { return beta == T(0) ? alpha * r : alpha * r + beta * y; }
+
+        //y = alpha * A * x + beta * y for row-major A (m*n) with row stride lda
+        template <class T>
+        void gemv(int m, int n, T alpha, const T* A, int lda, const T* x, T beta, T* y)
+        {
+            for (int i = 0; i < m; i++) { y[i] = scaleResult(alpha, dot(n, A + (size_t)i * lda, x), beta, y[i]); }
+        }
+
+        /// SSE, 4 floats per register ///
+        namespace sseImpl
+        {
+            LINALG_TARGET("sse2") inline float hsum(__m128 v)
+            {
+                v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+                v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+                return _mm_cvtss_f32(v);
+            }
+            LINALG_TARGET("sse2") inline void add(int n, const float* x, const float* y, float* out)
+            {
+                int i = 0;
+                for (; i + 4 <= n; i += 4) { _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i))); }
+                for (; i < n; i++) { out[i] = x[i] + y[i]; }
+            }
+            LINALG_TARGET("sse2") inline void sub(int n, const float* x, const float* y, float* out)
+            {
+                int i = 0;
+                for (; i + 4 <= n; i += 4) { _mm_storeu_ps(out + i, _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i))); }
+                for (; i < n; i++) { out[i] = x[i] - y[i]; }
+            }
+            LINALG_TARGET("sse2") inline void scale(int n, const float* x, float a, float* out)
+            {
+                __m128 va = _mm_set1_ps(a);
+                int i = 0;
+                for (; i + 4 <= n; i += 4) { _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(x + i), va)); }
+                for (; i < n; i++) { out[i] = x[i] * a; }
+            }
+            LINALG_TARGET("sse2") inline float dot(int n, const float* x, const float* y)
+            {
+                __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+                int i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+                    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(y + i + 4)));
+                }
+                float res = hsum(_mm_add_ps(acc0, acc1));
+                for (; i < n; i++) { res += x[i] * y[i]; }
+                return res;
+            }
+            LINALG_TARGET("sse2") inline float sum(int n, const float* x)
+            {
+                __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+                int i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    acc0 = _mm_add_ps(acc0, _mm_loadu_ps(x + i));
+                    acc1 = _mm_add_ps(acc1, _mm_loadu_ps(x + i + 4));
+                }
+                float res = hsum(_mm_add_ps(acc0, acc1));
+                for (; i < n; i++) { res += x[i]; }
+                return res;
+            }
+            LINALG_TARGET("sse2") inline void axpy(int n, float a, const float* x, float* y)
+            {
+                __m128 va = _mm_set1_ps(a);
+                int i = 0;
+                for (; i + 4 <= n; i += 4) { _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i)))); }
+                for (; i < n; i++) { y[i] += a * x[i]; }
+            }
+            LINALG_TARGET("sse2") inline void leakyRelu(int n, float slope, const float* x, float* out)
+            {
+                __m128 vs = _mm_set1_ps(slope), zero = _mm_setzero_ps();
+                int i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    __m128 v = _mm_loadu_ps(x + i);
+                    __m128 pos = _mm_cmpgt_ps(v, zero);
+                    _mm_storeu_ps(out + i, _mm_or_ps(_mm_and_ps(pos, v), _mm_andnot_ps(pos, _mm_mul_ps(v, vs))));
+                }
+                for (; i < n; i++) { out[i] = x[i] > 0 ? x[i] : slope * x[i]; }
+            }
+            LINALG_TARGET("sse2") inline void leakyReluBackward(int n, float slope, const float* x, const float* g, float* out)
+            {
+                __m128 vs = _mm_set1_ps(slope), zero = _mm_setzero_ps();
+                int i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    __m128 vg = _mm_loadu_ps(g + i);
+                    __m128 pos = _mm_cmpge_ps(_mm_loadu_ps(x + i), zero);
+                    _mm_storeu_ps(out + i, _mm_or_ps(_mm_and_ps(pos, vg), _mm_andnot_ps(pos, _mm_mul_ps(vg, vs))));
+                }
+                for (; i < n; i++) { out[i] = x[i] >= 0 ? g[i] : slope * g[i]; }
+            }
+            LINALG_TARGET("sse2") inline void gemv(int m, int n, float alpha, const float* A, int lda, const float* x, float beta, float* y)
+            {
+                for (int i = 0; i < m; i++) { y[i] = scaleResult(alpha, dot(n, A + (size_t)i * lda, x), beta, y[i]); }
+            }
+        }
+
+        /// AVX2 + FMA, 8 floats per register ///
+        namespace avx2Impl
+        {
+            LINALG_TARGET("avx2,fma") inline float hsum(__m256 v)
+            {
+                __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+                lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+                lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+                return _mm_cvtss_f32(lo);
+            }
+            LINALG_TARGET("avx2,fma") inline void add(int n, const float* x, const float* y, float* out)
+            {
+                int i = 0;
+                for (; i + 8 <= n; i += 8) { _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i))); }
+                for (; i < n; i++) { out[i] = x[i] + y[i]; }
+            }
+            LINALG_TARGET("avx2,fma") inline void sub(int n, const float* x, const float* y, float* out)
+            {
+                int i = 0;
+                for (; i + 8 <= n; i += 8) { _mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i))); }
+                for (; i < n; i++) { out[i] = x[i] - y[i]; }
+            }
+            LINALG_TARGET("avx2,fma") inline void scale(int n, const float* x, float a, float* out)
+            {
+                __m256 va = _mm256_set1_ps(a);
+                int i = 0;
+                for (; i + 8 <= n; i += 8) { _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), va)); }
+                for (; i < n; i++) { out[i] = x[i] * a; }
+            }
+            LINALG_TARGET("avx2,fma") inline float dot(int n, const float* x, const float* y)
+            {
+                __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+                int i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+                    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), acc1);
+                }
+                for (; i + 8 <= n; i += 8) { acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0); }
+                float res = hsum(_mm256_add_ps(acc0, acc1));
+                for (; i < n; i++) { res += x[i] * y[i]; }
+                return res;
+            }
+            LINALG_TARGET("avx2,fma") inline float sum(int n, const float* x)
+            {
+                __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+                int i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(x + i));
+                    acc1 = _mm256_add_ps(acc1, _mm256_loadu_ps(x + i + 8));
+                }
+                for (; i + 8 <= n; i += 8) { acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(x + i)); }
+                float res = hsum(_mm256_add_ps(acc0, acc1));
+                for (; i < n; i++) { res += x[i]; }
+                return res;
+            }
+            LINALG_TARGET("avx2,fma") inline void axpy(int n, float a, const float* x, float* y)
+            {
+                __m256 va = _mm256_set1_ps(a);
+                int i = 0;
+                for (; i + 8 <= n; i += 8) { _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i))); }
+                for (; i < n; i++) { y[i] += a * x[i]; }
+            }
+            LINALG_TARGET("avx2,fma") inline void leakyRelu(int n, float slope, const float* x, float* out)
+            {
+                __m256 vs = _mm256_set1_ps(slope), zero = _mm256_setzero_ps();
+                int i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m256 v = _mm256_loadu_ps(x + i);
+                    _mm256_storeu_ps(out + i, _mm256_blendv_ps(_mm256_mul_ps(v, vs), v, _mm256_cmp_ps(v, zero, _CMP_GT_OQ)));
+                }
+                for (; i < n; i++) { out[i] = x[i] > 0 ? x[i] : slope * x[i]; }
+            }
+            LINALG_TARGET("avx2,fma") inline void leakyReluBackward(int n, float slope, const float* x, const float* g, float* out)
+            {
+                __m256 vs = _mm256_set1_ps(slope), zero = _mm256_setzero_ps();
+                int i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m256 vg = _mm256_loadu_ps(g + i);
+                    __m256 pos = _mm256_cmp_ps(_mm256_loadu_ps(x + i), zero, _CMP_GE_OQ);
+                    _mm256_storeu_ps(out + i, _mm256_blendv_ps(_mm256_mul_ps(vg, vs), vg, pos));
+                }
+                for (; i < n; i++) { out[i] = x[i] >= 0 ? g[i] : slope * g[i]; }
+            }
+            //four rows at a time so each load of x is reused four times
+            LINALG_TARGET("avx2,fma") inline void gemv(int m, int n, float alpha, const float* A, int lda, const float* x, float beta, float* y)
+            {
+                int i = 0;
+                for (; i + 4 <= m; i += 4) {
+                    const float* a0 = A + (size_t)i * lda;
+                    const float* a1 = a0 + lda;
+                    const float* a2 = a1 + lda;
+                    const float* a3 = a2 + lda;
+                    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+                    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+                    int j = 0;
+                    for (; j + 8 <= n; j += 8) {
+                        __m256 vx = _mm256_loadu_ps(x + j);
+                        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + j), vx, acc0);
+                        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + j), vx, acc1);
+                        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + j), vx, acc2);
+                        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + j), vx, acc3);
+                    }
+                    float r0 = hsum(acc0), r1 = hsum(acc1), r2 = hsum(acc2), r3 = hsum(acc3);
+                    for (; j < n; j++) {
+                        r0 += a0[j] * x[j];
+                        r1 += a1[j] * x[j];
+                        r2 += a2[j] * x[j];
+                        r3 += a3[j] * x[j];
+                    }
+                    y[i] = scaleResult(alpha, r0, beta, y[i]);
+                    y[i + 1] = scaleResult(alpha, r1, beta, y[i + 1]);
+                    y[i + 2] = scaleResult(alpha, r2, beta, y[i + 2]);
+                    y[i + 3] = scaleResult(alpha, r3, beta, y[i + 3]);
+                }
+                for (; i < m; i++) { y[i] = scaleResult(alpha, dot(n, A + (size_t)i * lda, x), beta, y[i]); }
+            }
+        }
+
+        /// AVX-512F, 16 floats per register. Tails are handled with masked loads/stores ///
+        namespace avx512Impl
+        {
+            LINALG_TARGET("avx512f") inline __mmask16 tailMask(int rem) { return (__mmask16)((1u << rem) - 1); }
+            LINALG_TARGET("avx512f") inline void add(int n, const float* x, const float* y, float* out)
+            {
+                int i = 0;
+                for (; i + 16 <= n; i += 16) { _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i))); }
+                if (i < n) {
+                    __mmask16 k = tailMask(n - i);
+                    _mm512_mask_storeu_ps(out + i, k, _mm512_add_ps(_mm512_maskz_loadu_ps(k, x + i), _mm512_maskz_loadu_ps(k, y + i)));
+                }
+            }
+            LINALG_TARGET("avx512f") inline void sub(int n, const float* x, const float* y, float* out)
+            {
+                int i = 0;
+                for (; i + 16 <= n; i += 16) { _mm512_storeu_ps(out + i, _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i))); }
+                if (i < n) {
+                    __mmask16 k = tailMask(n - i);
+                    _mm512_mask_storeu_ps(out + i, k, _mm512_sub_ps(_mm512_maskz_loadu_ps(k, x + i), _mm512_maskz_loadu_ps(k, y + i)));
+                }
+            }
+            LINALG_TARGET("avx512f") inline void scale(int n, const float* x, float a, float* out)
+            {
+                __m512 va = _mm512_set1_ps(a);
+                int i = 0;
+                for (; i + 16 <= n; i += 16) { _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), va)); }
+                if (i < n) {
+                    __mmask16 k = tailMask(n - i);
+                    _mm512_mask_storeu_ps(out + i, k, _mm512_mul_ps(_mm512_maskz_loadu_ps(k, x + i), va));
+                }
+            }
+            LINALG_TARGET("avx512f") inline float dot(int n, const float* x, const float* y)
+            {
+                __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+                int i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+                    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), acc1);
+                }
+                for (; i + 16 <= n; i += 16) { acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0); }
+                if (i < n) {
+                    __mmask16 k = tailMask(n - i);
+                    acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(k, x + i), _mm512_maskz_loadu_ps(k, y + i), acc1);
+                }
+                return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+            }
+            LINALG_TARGET("avx512f") inline float sum(int n, const float* x)
+            {
+                __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+                int i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    acc0 = _mm512_add_ps(acc0, _mm512_loadu_ps(x + i));
+                    acc1 = _mm512_add_ps(acc1, _mm512_loadu_ps(x + i + 16));
+                }
+                for (; i + 16 <= n; i += 16) { acc0 = _mm512_add_ps(acc0, _mm512_loadu_ps(x + i)); }
+                if (i < n) { acc1 = _mm512_add_ps(acc1, _mm512_maskz_loadu_ps(tailMask(n - i), x + i)); }
+                return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+            }
+            LINALG_TARGET("avx512f") inline void axpy(int n, float a, const float* x, float* y)
+            {
+                __m512 va = _mm512_set1_ps(a);
+                int i = 0;
+                for (; i + 16 <= n; i += 16) { _mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i))); }
+                if (i < n) {
+                    __mmask16 k = tailMask(n - i);
+                    _mm512_mask_storeu_ps(y + i, k, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(k, x + i), _mm512_maskz_loadu_ps(k, y + i)));
+                }
+            }
+            LINALG_TARGET("avx512f") inline __m512 leakyRelu(__m512 v, __m512 vs)
+            {
+                return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(v, _mm512_setzero_ps(), _CMP_GT_OQ), _mm512_mul_ps(v, vs), v);
+            }
+            LINALG_TARGET("avx512f") inline void leakyRelu(int n, float slope, const float* x, float* out)
+            {
+                __m512 vs = _mm512_set1_ps(slope);
+                int i = 0;
+                for (; i + 16 <= n; i += 16) { _mm512_storeu_ps(out + i, leakyRelu(_mm512_loadu_ps(x + i), vs)); }
+                if (i < n) {
+                    __mmask16 k = tailMask(n - i);
+                    _mm512_mask_storeu_ps(out + i, k, leakyRelu(_mm512_maskz_loadu_ps(k, x + i), vs));
+                }
+            }
+            LINALG_TARGET("avx512f") inline __m512 leakyReluBackward(__m512 v, __m512 vg, __m512 vs)
+            {
+                return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(v, _mm512_setzero_ps(), _CMP_GE_OQ), _mm512_mul_ps(vg, vs), vg);
+            }
+            LINALG_TARGET("avx512f") inline void leakyReluBackward(int n, float slope, const float* x, const float* g, float* out)
+            {
+                __m512 vs = _mm512_set1_ps(slope);
+                int i = 0;
+                for (; i + 16 <= n; i += 16) { _mm512_storeu_ps(out + i, leakyReluBackward(_mm512_loadu_ps(x + i), _mm512_loadu_ps(g + i), vs)); }
+                if (i < n) {
+                    __mmask16 k = tailMask(n - i);
+                    _mm512_mask_storeu_ps(out + i, k, leakyReluBackward(_mm512_maskz_loadu_ps(k, x + i), _mm512_maskz_loadu_ps(k, g + i), vs));
+                }
+            }
+            //four rows at a time so each load of x is reused four times
+            LINALG_TARGET("avx512f") inline void gemv(int m, int n, float alpha, const float* A, int lda, const float* x, float beta, float* y)
+            {
+                int i = 0;
+                for (; i + 4 <= m; i += 4) {
+                    const float* a0 = A + (size_t)i * lda;
+                    const float* a1 = a0 + lda;
+                    const float* a2 = a1 + lda;
+                    const float* a3 = a2 + lda;
+                    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+                    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+                    int j = 0;
+                    for (; j + 16 <= n; j += 16) {
+                        __m512 vx = _mm512_loadu_ps(x + j);
+                        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a0 + j), vx, acc0);
+                        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a1 + j), vx, acc1);
+                        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(a2 + j), vx, acc2);
+                        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(a3 + j), vx, acc3);
+                    }
+                    if (j < n) {
+                        __mmask16 k = tailMask(n - j);
+                        __m512 vx = _mm512_maskz_loadu_ps(k, x + j);
+                        acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(k, a0 + j), vx, acc0);
+                        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(k, a1 + j), vx, acc1);
+                        acc2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(k, a2 + j), vx, acc2);
+                        acc3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(k, a3 + j), vx, acc3);
+                    }
+                    y[i] = scaleResult(alpha, _mm512_reduce_add_ps(acc0), beta, y[i]);
+                    y[i + 1] = scaleResult(alpha, _mm512_reduce_add_ps(acc1), beta, y[i + 1]);
+                    y[i + 2] = scaleResult(alpha, _mm512_reduce_add_ps(acc2), beta, y[i + 2]);
+                    y[i + 3] = scaleResult(alpha, _mm512_reduce_add_ps(acc3), beta, y[i + 3]);
+                }
+                for (; i < m; i++) { y[i] = scaleResult(alpha, dot(n, A + (size_t)i * lda, x), beta, y[i]); }
+            }
+        }
+
+        /// runtime dispatch ///
+
+        //Query CPUID (and XGETBV, to make sure the os saves the wider registers) for the widest usable ISA.
+        inline simdLevel detectSimd()
+        {
+            unsigned int r1[4] = {}, r7[4] = {};
+#ifdef _MSC_VER
+            int info[4];
+            __cpuid(info, 0);
+            int maxLeaf = info[0];
+            __cpuid(info, 1);
+            for (int i = 0; i < 4; i++) r1[i] = info[i];
+            if (maxLeaf >= 7) { __cpuidex(info, 7, 0); for (int i = 0; i < 4; i++) r7[i] = info[i]; }
+#else
+            unsigned int maxLeaf = __get_cpuid_max(0, nullptr);
+            if (maxLeaf < 1) return scalar;
+            __cpuid(1, r1[0], r1[1], r1[2], r1[3]);
+            if (maxLeaf >= 7) __cpuid_count(7, 0, r7[0], r7[1], r7[2], r7[3]);
+#endif
+            bool sse2 = r1[3] & (1u << 26);
+            if (!sse2) return scalar;
+            bool osxsave = r1[2] & (1u << 27);
+            if (!osxsave) return sse;
+#ifdef _MSC_VER
+            unsigned long long xcr0 = _xgetbv(0);
+#else
+            unsigned int lo, hi;
+            __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            unsigned long long xcr0 = ((unsigned long long)hi << 32) | lo;
+#endif
+            bool avxState = (xcr0 & 0x6) == 0x6; //xmm and ymm
+            bool avx512State = (xcr0 & 0xE6) == 0xE6; //plus opmask and zmm
+            bool fma = r1[2] & (1u << 12);
+            bool avx2Bit = r7[1] & (1u << 5);
+            bool avx512f = r7[1] & (1u << 16);
+            if (avxState && avx512State && avx512f && fma && avx2Bit) return avx512;
+            if (avxState && fma && avx2Bit) return avx2;
+            return sse;
+        }
+
+        //Function pointers to the float kernels of one ISA
+        struct simdTable
+        {
+            simdLevel level;
+            void (*add)(int, const float*, const float*, float*);
+            void (*sub)(int, const float*, const float*, float*);
+            void (*scale)(int, const float*, float, float*);
+            float (*dot)(int, const float*, const float*);
+            float (*sum)(int, const float*);
+            void (*axpy)(int, float, const float*, float*);
+            void (*gemv)(int, int, float, const float*, int, const float*, float, float*);
+            void (*leakyRelu)(int, float, const float*, float*);
+            void (*leakyReluBackward)(int, float, const float*, const float*, float*);
+        };
+
+        inline simdTable makeSimdTable(simdLevel level)
+        {
+            switch (level)
+            {
+            case avx512:
+                return { avx512, avx512Impl::add, avx512Impl::sub, avx512Impl::scale, avx512Impl::dot, avx512Impl::sum, avx512Impl::axpy, avx512Impl::gemv,
+                    avx512Impl::leakyRelu, avx512Impl::leakyReluBackward };
+            case avx2:
+                return { avx2, avx2Impl::add, avx2Impl::sub, avx2Impl::scale, avx2Impl::dot, avx2Impl::sum, avx2Impl::axpy, avx2Impl::gemv,
+                    avx2Impl::leakyRelu, avx2Impl::leakyReluBackward };
+            case sse:
+                return { sse, sseImpl::add, sseImpl::sub, sseImpl::scale, sseImpl::dot, sseImpl::sum, sseImpl::axpy, sseImpl::gemv,
+                    sseImpl::leakyRelu, sseImpl::leakyReluBackward };
+            default:
+                return { scalar, add<float>, sub<float>, scale<float>, dot<float>, sum<float>, axpy<float>, gemv<float>,
+                    leakyRelu<float>, leakyReluBackward<float> };
+            }
+        }
+
+        //The table in use. Filled with the widest supported ISA on first use.
+        inline simdTable& activeSimd()
+        {
+            static simdTable table = makeSimdTable(detectSimd());
+            return table;
+        }
+
+        //Returns the ISA the float kernels currently run on.
+        inline simdLevel getSimdLevel() { return activeSimd().level; }
+
+        //Force a narrower ISA (e.g. to compare against the scalar kernels). Levels above the detected one are clamped.
+        inline void setSimdLevel(simdLevel level)
+        {
+            simdLevel supported = detectSimd();
+            activeSimd() = makeSimdTable(level < supported ? level : supported);
+        }
+
+        /// float overloads, preferred over the templates above by overload resolution ///
+        //Above PARALLEL_MIN_ELEMS elements the work is split across the thread pool in threads.h.
+        inline void add(int n, const float* x, const float* y, float* out)
+        {
+            parallel::parallelFor(n, PARALLEL_MIN_ELEMS, [&](int lo, int hi) { activeSimd().add(hi - lo, x + lo, y + lo, out + lo); }, 16);
+        }
+        inline void sub(int n, const float* x, const float* y, float* out)
+        {
+            parallel::parallelFor(n, PARALLEL_MIN_ELEMS, [&](int lo, int hi) { activeSimd().sub(hi - lo, x + lo, y + lo, out + lo); }, 16);
+        }
+        inline void scale(int n, const float* x, float a, float* out)
+        {
+            parallel::parallelFor(n, PARALLEL_MIN_ELEMS, [&](int lo, int hi) { activeSimd().scale(hi - lo, x + lo, a, out + lo); }, 16);
+        }
+        inline void axpy(int n, float a, const float* x, float* y)
+        {
+            parallel::parallelFor(n, PARALLEL_MIN_ELEMS, [&](int lo, int hi) { activeSimd().axpy(hi - lo, a, x + lo, y + lo); }, 16);
+        }
+        inline void leakyRelu(int n, float slope, const float* x, float* out)
+        {
+            parallel::parallelFor(n, PARALLEL_MIN_ELEMS, [&](int lo, int hi) { activeSimd().leakyRelu(hi - lo, slope, x + lo, out + lo); }, 16);
+        }
+        inline void leakyReluBackward(int n, float slope, const float* x, const float* g, float* out)
+        {
+            parallel::parallelFor(n, PARALLEL_MIN_ELEMS, [&](int lo, int hi) {
+                activeSimd().leakyReluBackward(hi - lo, slope, x + lo, g + lo, out + lo);
+            }, 16);
+        }
+
+        //Reductions are split into at most 256 fixed blocks that depend only on n, and the block results are added in order,
+        //so the result doesn't change with the number of threads.
+        template <class F>
+        float blockedSum(int n, F partial)
+        {
+            if (n < 2 * PARALLEL_MIN_ELEMS) return partial(0, n);
+            int block = std::max(PARALLEL_MIN_ELEMS / 4, (n + 255) / 256);
+            block = (block + 15) / 16 * 16;
+            int numBlocks = (n + block - 1) / block;
+            float partials[256];
+            parallel::parallelFor(numBlocks, 1, [&](int lo, int hi) {
+                for (int b = lo; b < hi; b++) { partials[b] = partial(b * block, std::min(n, (b + 1) * block)); }
+            });
+            float res = 0;
+            for (int b = 0; b < numBlocks; b++) res += partials[b];
+            return res;
+        }
+        inline float dot(int n, const float* x, const float* y)
+        {
+            return blockedSum(n, [&](int lo, int hi) { return activeSimd().dot(hi - lo, x + lo, y + lo); });
+        }
+        inline float sum(int n, const float* x)
+        {
+            return blockedSum(n, [&](int lo, int hi) { return activeSimd().sum(hi - lo, x + lo); });
+        }
+
+        //split by rows of A
+        inline void gemv(int m, int n, float alpha, const float* A, int lda, const float* x, float beta, float* y)
+        {
+            int minRows = std::max(4, PARALLEL_MIN_ELEMS / std::max(1, n));
+            parallel::parallelFor(m, minRows, [&](int lo, int hi) {
+                activeSimd().gemv(hi - lo, n, alpha, A + (size_t)lo * lda, lda, x, beta, y + lo);
+            }, 4);
+        }
+
+        //y = alpha * A^T * x + beta * y for row-major A (m*n), so y has n elements and x has m.
+        //A is read row by row with one axpy per row, which is the access pattern of its actual layout; the transpose is never formed.
+        //(Defined after the float overloads so axpy and scale resolve to the SIMD kernels for float.)
+        //Large products are split by columns of A (elements of y), each thread streaming its column range of every row.
+        template <class T>
+        void gemvT(int m, int n, T alpha, const T* A, int lda, const T* x, T beta, T* y)
+        {
+            int minCols = std::max(16, PARALLEL_MIN_ELEMS / std::max(1, m));
+            parallel::parallelFor(n, minCols, [&](int lo, int hi) {
+                T* ys = y + lo;
+                if (beta == T(0)) std::fill(ys, y + hi, T(0));
+                else if (beta != T(1)) scale(hi - lo, ys, beta, ys);
+                for (int i = 0; i < m; i++) { axpy(hi - lo, alpha * x[i], A + (size_t)i * lda + lo, ys); }
+            }, 16);
+        }
+
+        //A += alpha * x * y^T for row-major A (m*n), x with m and y with n elements (rank-1 update, BLAS ger).
+        //One axpy per row of A, so the outer product is added in a single pass without being formed.
+        //Large updates are split by rows of A.
+        template <class T>
+        void ger(int m, int n, T alpha, const T* x, const T* y, T* A, int lda)
+        {
+            int minRows = std::max(1, PARALLEL_MIN_ELEMS / std::max(1, n));
+            parallel::parallelFor(m, minRows, [&](int lo, int hi) {
+                for (int i = lo; i < hi; i++) {
+                    if (x[i] != T(0)) axpy(n, alpha * x[i], y, A + (size_t)i * lda);
+                }
+            });
+        }
+    }
+}
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <functional>
+#include "check.h"
+#include "../nnet.h"
+
+//The tape's gradients against central differences of the loss, for dense (with and without biases, elementwise and softMax
+//activations), matmul with all transpositions, add (same shape and a broadcast row), mul, act and the losses, and for
+//Network::forward(Tape&) on a network with biases. Network::backward() is compared with the tape only where both are exact:
+//Linear::backward() keeps the original code's shortcut of taking the activation's derivative at the unbiased sums (and at the
+//biases for the bias gradient), so for a nonlinear activation with nonzero biases it isn't the gradient of the loss.
+using namespace linalg;
+
+const float STEP = 1e-2f;
+
+//a tensor that gets a gradient: its values and gradient sum
+struct tensor
+{
+    float* value;
+    float* grad;
+    size_t size;
+};
+
+//the largest error of the gradients backward() adds to the tensors, against central differences of the recorded loss
+static double worstError(const std::function<autograd::Var(autograd::Tape&)>& record, const std::vector<tensor>& tensors)
+{
+    for (const tensor& t : tensors) { std::fill(t.grad, t.grad + t.size, 0.f); }
+    autograd::Tape tape;
+    tape.backward(record(tape));
+    double worst = 0;
+    for (const tensor& t : tensors) {
+        std::vector<float> grad(t.grad, t.grad + t.size);
+        for (size_t i = 0; i < t.size; i++) {
+            float v = t.value[i];
+            t.value[i] = v + STEP;
+            autograd::Tape up;
+            double lossUp = record(up).value()(0, 0);
+            t.value[i] = v - STEP;
+            autograd::Tape down;
+            double lossDown = record(down).value()(0, 0);
+            t.value[i] = v;
+            double numeric = (lossUp - lossDown) / (2 * STEP);
+            worst = std::max(worst, std::fabs(numeric - grad[i]) / (1 + std::fabs(numeric)));
+        }
+    }
+    return worst;
+}
+
+static tensor of(Matrix<float>& value, Matrix<float>& grad) { return { value.nums.data(), grad.nums.data(), (size_t)value.size() }; }
+
+static std::vector<tensor> networkTensors(nnet::Network& net)
+{
+    std::vector<nnet::ILayer::param> params;
+    for (nnet::ILayer* l : net.layers) { l->params(params); }
+    std::vector<tensor> tensors;
+    for (nnet::ILayer::param& p : params) { tensors.push_back({ p.value, p.grad, p.size }); }
+    return tensors;
+}
+
+int main()
+{
+    func::act::tanhAct tanhAct;
+    func::act::sigmoid sigmoid(1);
+    func::act::softMax softMax;
+    func::loss::MSE mse;
+    func::loss::SoftmaxCrossEntropy crossEntropy;
+    Matrix<float> x(6, 5, uniform), w(4, 5, uniform), b(1, 4, uniform), y(6, 4, uniform), classes(6, 4, zeros);
+    Matrix<float> gx(6, 5), gw(4, 5), gb(1, 4);
+    for (int r = 0; r < 6; r++) { classes[r][r % 4] = 1; }
+
+    //dense with biases, without, and with a per-row activation
+    CHECK(worstError([&](autograd::Tape& t) { return t.loss(t.dense(t.param(x, gx), t.param(w, gw), t.param(b, gb), tanhAct), y, mse); },
+        { of(x, gx), of(w, gw), of(b, gb) }) < 2e-3);
+    CHECK(worstError([&](autograd::Tape& t) { return t.loss(t.dense(t.param(x, gx), t.param(w, gw), autograd::Var(), sigmoid), classes, crossEntropy); },
+        { of(x, gx), of(w, gw) }) < 2e-3);
+    CHECK(worstError([&](autograd::Tape& t) { return t.loss(t.dense(t.param(x, gx), t.param(w, gw), t.param(b, gb), softMax), y, mse); },
+        { of(x, gx), of(w, gw), of(b, gb) }) < 2e-3);
+
+    //matmul in all four transpositions, summed with add, a broadcast row, mul and act
+    Matrix<float> a(3, 6, uniform), c(3, 4, uniform), ga(3, 6), gc(3, 4);
+    Matrix<float> at(6, 3, uniform), ct(4, 3, uniform), gat(6, 3), gct(4, 3);
+    CHECK(worstError([&](autograd::Tape& t) {
+        autograd::Var p = t.matmul(t.param(a, ga), t.param(c, gc), trans, noTrans); //6x4
+        autograd::Var q = t.matmul(t.param(at, gat), t.param(ct, gct), noTrans, trans);
+        autograd::Var r = t.matmul(t.param(a, ga), t.param(ct, gct), trans, trans);
+        autograd::Var s = t.matmul(t.param(at, gat), t.param(c, gc), noTrans, noTrans);
+        autograd::Var h = t.act(t.matmul(t.param(x, gx), t.param(w, gw), noTrans, trans), tanhAct);
+        autograd::Var sum = t.add(t.add(t.mul(h, t.act(p, sigmoid)), t.add(q, r)), t.add(s, t.param(b, gb)));
+        return t.loss(t.act(sum, softMax), classes, mse);
+    }, { of(a, ga), of(c, gc), of(at, gat), of(ct, gct), of(x, gx), of(w, gw), of(b, gb) }) < 2e-3);
+
+    //a network on the tape, with biases and nonlinear activations: the exact gradient
+    nnet::Network net({ new nnet::Linear(5, 8, func::act::tanhAct()), new nnet::Linear(8, 8, func::act::sigmoid(1)), new nnet::Linear(8, 4, func::act::linear(1)) },
+        new func::loss::SoftmaxCrossEntropy());
+    for (nnet::ILayer* l : net.layers) { l->biases = Vector<float>(l->outSize, uniform); }
+    CHECK(worstError([&](autograd::Tape& t) { return t.loss(net.forward(t, x), classes, net.lossFunc); }, networkTensors(net)) < 2e-3);
+
+    //the tape against Network::backward(): linear activations with biases, and the weight gradients of ReLU without biases
+    //(the bias gradient of backward() is the derivative at the biases times the summed output gradient)
+    for (bool relu : { false, true }) {
+        nnet::Network* tapeNet = relu
+            ? new nnet::Network({ new nnet::Linear(5, 8, func::act::reLU()), new nnet::Linear(8, 4, func::act::reLU()) }, new func::loss::MSE())
+            : new nnet::Network({ new nnet::Linear(5, 8, func::act::linear(1)), new nnet::Linear(8, 4, func::act::linear(2)) }, new func::loss::MSE());
+        for (nnet::ILayer* l : tapeNet->layers) { l->biases = Vector<float>(l->outSize, relu ? zeros : uniform); }
+        std::vector<nnet::ILayer*> cloned;
+        for (nnet::ILayer* l : tapeNet->layers) { cloned.push_back(l->clone()); }
+        nnet::Network reference(cloned, tapeNet->lossFunc.clone());
+        for (nnet::ILayer* l : tapeNet->layers) { l->zeroGrad(); }
+        for (nnet::ILayer* l : reference.layers) { l->zeroGrad(); }
+
+        autograd::Tape tape;
+        autograd::Var loss = tape.loss(tapeNet->forward(tape, x), y, tapeNet->lossFunc);
+        tape.backward(loss);
+        reference.forward(x);
+        float expectedLoss = reference.lossFunc.lossSum(6, 4, reference.batchOutput->nums.data(), y.nums.data());
+        reference.backward(y);
+        CHECK(tests::close(loss.value()(0, 0), expectedLoss));
+        std::vector<tensor> got = networkTensors(*tapeNet), expected = networkTensors(reference);
+        for (size_t k = 0; k < got.size(); k += relu ? 2 : 1) {
+            for (size_t i = 0; i < got[k].size; i++) { CHECK(tests::close(got[k].grad[i], expected[k].grad[i], 1e-3)); }
+        }
+        for (size_t i = 0; i < tapeNet->layers.size(); i++) { CHECK(tapeNet->layers[i]->batchSize == reference.layers[i]->batchSize); }
+        delete tapeNet;
+    }
+    std::puts("autograd ok");
+    return 0;
+}
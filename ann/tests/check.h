@@ -0,0 +1,15 @@
+#pragma once
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+//The tests: one console program per file, built like main.cpp (same headers, same environment), that prints "<name> ok" and
+//returns 0, or prints the first failed check and returns 1. The threaded ones are also meant to be run built with
+//-fsanitize=thread, where they must finish without reports.
+#define CHECK(c) do { if (!(c)) { std::printf("FAIL %s (%s:%d)\n", #c, __FILE__, __LINE__); std::fflush(stdout); return 1; } } while (0)
+
+namespace tests
+{
+    //a == b up to rounding: relative tolerance rel, absolute tolerance rel for values near 0
+    inline bool close(double a, double b, double rel = 1e-4) { return std::fabs(a - b) <= rel + rel * std::fabs(b); }
+}
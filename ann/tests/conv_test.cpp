@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include "check.h"
+#include "../conv.h"
+
+//Conv2D, MaxPool2D and AvgPool2D: backward() against central differences of loss = sum(outputs .* R), for the inputs, the weights
+//and the biases, on the direct and the im2col path, with padding and strides. The inputs of the pooling layers are distinct values
+//further apart than the difference step, so no max of a window changes while a value is moved. Windows that don't fit are rejected.
+using namespace linalg;
+
+const float STEP = 1e-2f;
+
+//inputs for the pooling layers: 3 steps apart, shuffled and centered
+static Matrix<float> distinctInputs(int rows, int cols, std::mt19937& rng)
+{
+    Matrix<float> x(rows, cols);
+    std::vector<int> order(x.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), rng);
+    for (int i = 0; i < x.size(); i++) { x.nums[i] = 3 * STEP * (order[i] - x.size() / 2); }
+    return x;
+}
+
+//the largest difference between the central differences of the loss in each of n values and their gradients
+template <class F>
+static double worstError(float* values, const float* grads, int n, F loss)
+{
+    double worst = 0;
+    for (int i = 0; i < n; i++) {
+        float v = values[i];
+        values[i] = v + STEP;
+        double up = loss();
+        values[i] = v - STEP;
+        double down = loss();
+        values[i] = v;
+        double numeric = (up - down) / (2 * STEP);
+        worst = std::max(worst, std::fabs(numeric - grads[i]) / (1 + std::fabs(numeric)));
+    }
+    return worst;
+}
+
+//the worst gradient error of a layer for the inputs, and for the weights and biases of a Conv2D
+static double gradError(nnet::ILayer& layer, Matrix<float>& x, nnet::Conv2D* conv)
+{
+    Matrix<float> r(x.rows, layer.outSize, uniform);
+    auto loss = [&] {
+        Matrix<float> out;
+        layer.predict(x, out);
+        double sum = 0;
+        for (int i = 0; i < out.size(); i++) { sum += (double)out.nums[i] * r.nums[i]; }
+        return sum;
+    };
+    layer.zeroGrad();
+    layer.forward(x);
+    Matrix<float> outGrad = r;
+    Matrix<float> inGrad = layer.backward(outGrad);
+    double worst = worstError(x.nums.data(), inGrad.nums.data(), x.size(), loss);
+    if (conv) {
+        worst = std::max(worst, worstError(conv->weights.nums.data(), conv->weightsGradSum.nums.data(), conv->weights.size(), loss));
+        worst = std::max(worst, worstError(conv->biases.nums.data(), conv->biasesGradSum.nums.data(), conv->outChannels, loss));
+    }
+    return worst;
+}
+
+template <class F>
+static bool throws(F make)
+{
+    try {
+        make();
+    }
+    catch (std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    for (int padding = 0; padding < 2; padding++) {
+        for (bool direct : { true, false }) {
+            nnet::Conv2D conv(3, 9, 11, 5, 3, func::act::tanhAct(), 1, padding);
+            conv.direct = direct;
+            conv.biases = Vector<float>(5, uniform);
+            Matrix<float> x(4, conv.inSize, uniform);
+            CHECK(gradError(conv, x, &conv) < 2e-2);
+        }
+    }
+    {
+        nnet::Conv2D conv(2, 10, 9, 4, 4, func::act::sigmoid(1), 2, 1);
+        Matrix<float> x(3, conv.inSize, uniform);
+        CHECK(conv.outHeight == 5 && conv.outWidth == 4);
+        CHECK(gradError(conv, x, &conv) < 2e-2);
+    }
+    {
+        nnet::MaxPool2D pool(3, 8, 8, 2);
+        Matrix<float> x = distinctInputs(2, pool.inSize, rng);
+        CHECK(pool.outSize == 3 * 4 * 4);
+        CHECK(gradError(pool, x, nullptr) < 1e-3);
+    }
+    {
+        nnet::MaxPool2D pool(2, 7, 7, 3, 2); //overlapping windows
+        Matrix<float> x = distinctInputs(2, pool.inSize, rng);
+        CHECK(gradError(pool, x, nullptr) < 1e-3);
+    }
+    {
+        nnet::AvgPool2D pool(3, 9, 9, 3, 2);
+        Matrix<float> x = distinctInputs(2, pool.inSize, rng);
+        CHECK(gradError(pool, x, nullptr) < 1e-3);
+    }
+
+    //windows larger than the (padded) image, including ones the output size formula alone would round up to one output
+    CHECK(throws([] { nnet::Conv2D(1, 4, 4, 2, 5, func::act::reLU()); }));
+    CHECK(throws([] { nnet::Conv2D(1, 4, 6, 2, 7, func::act::reLU(), 2, 1); }));
+    CHECK(throws([] { nnet::Conv2D(1, 4, 4, 2, 3, func::act::reLU(), 0); }));
+    CHECK(throws([] { nnet::MaxPool2D(1, 4, 4, 5, 2); }));
+    CHECK(throws([] { nnet::AvgPool2D(1, 8, 3, 4); }));
+    CHECK(!throws([] { nnet::Conv2D(1, 4, 4, 2, 6, func::act::reLU(), 1, 1); }));
+    CHECK(!throws([] { nnet::MaxPool2D(1, 4, 4, 4); }));
+    std::puts("conv ok");
+    return 0;
+}
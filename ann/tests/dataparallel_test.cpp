@@ -0,0 +1,85 @@
+#include <cstring>
+#include "check.h"
+#include "../trainer.h"
+#include "../conv.h"
+
+//DataParallel against the serial batch: the same loss, gradient sums and batch sizes for any number of workers, bitwise the
+//same sums when a step is repeated, zeroed replicas, and training that converges. Run it under -fsanitize=thread as well.
+using namespace linalg;
+
+static nnet::Network* makeNet(int kind)
+{
+    std::vector<nnet::ILayer*> layers;
+    if (kind == 0) {
+        layers = { new nnet::Linear(30, 64, func::act::reLU()), new nnet::FixedLinear<64, 24>(func::act::tanhAct()), new nnet::Linear(24, 10, func::act::linear(1)) };
+    }
+    else {
+        layers = { new nnet::Conv2D(1, 8, 8, 4, 3, func::act::reLU(), 1, 1), new nnet::MaxPool2D(4, 8, 8, 2), new nnet::Linear(64, 10, func::act::sigmoid(1)) };
+    }
+    return new nnet::Network(layers, new func::loss::SoftmaxCrossEntropy());
+}
+
+static std::vector<float> gradients(nnet::Network& net)
+{
+    std::vector<nnet::ILayer::param> params;
+    for (nnet::ILayer* l : net.layers) { l->params(params); }
+    std::vector<float> g;
+    for (nnet::ILayer::param& p : params) { g.insert(g.end(), p.grad, p.grad + p.size); }
+    return g;
+}
+
+int main()
+{
+    linalg::parallel::setNumThreads(4);
+    for (int kind = 0; kind < 2; kind++) {
+        int inSize = kind == 0 ? 30 : 64;
+        nnet::Network* net = makeNet(kind);
+        Matrix<float> inputs(50, inSize, uniform), labels(50, 10, zeros);
+        for (int r = 0; r < 50; r++) { labels[r][r % 10] = 1; }
+
+        std::vector<nnet::ILayer*> cloned;
+        for (nnet::ILayer* l : net->layers) { cloned.push_back(l->clone()); }
+        nnet::Network serial(cloned, net->lossFunc.clone());
+        serial.forward(inputs);
+        float serialLoss = serial.lossFunc.lossSum(50, 10, serial.batchOutput->nums.data(), labels.nums.data());
+        serial.backward(labels);
+        std::vector<float> serialGrads = gradients(serial);
+
+        for (int workers : { 1, 3, 4, 7 }) {
+            nnet::DataParallel dp(*net, workers);
+            CHECK(dp.numWorkers() == workers);
+            for (nnet::ILayer* l : net->layers) { l->zeroGrad(); }
+            metrics::Metrics stats;
+            float loss = dp.trainStep(inputs, labels, &stats);
+            CHECK(tests::close(loss, serialLoss));
+            CHECK(stats.count == 50);
+            std::vector<float> g = gradients(*net);
+            CHECK(g.size() == serialGrads.size());
+            for (size_t k = 0; k < g.size(); k++) { CHECK(tests::close(g[k], serialGrads[k])); }
+            for (size_t i = 0; i < net->layers.size(); i++) { CHECK(net->layers[i]->batchSize == serial.layers[i]->batchSize); }
+            for (int w = 1; w < workers; w++) {
+                for (float v : gradients(dp.replica(w))) { CHECK(v == 0); }
+            }
+            //the reduction has a fixed shape: the same step again gives bitwise the same sums
+            for (nnet::ILayer* l : net->layers) { l->zeroGrad(); }
+            dp.trainStep(inputs, labels);
+            std::vector<float> again = gradients(*net);
+            CHECK(std::memcmp(g.data(), again.data(), g.size() * sizeof(float)) == 0);
+        }
+
+        nnet::DataParallel dp(*net, 4);
+        std::vector<nnet::ILayer*> params(net->layers.begin(), net->layers.end());
+        optim::SGD sgd(params, 0.5f);
+        float first = 0, last = 0;
+        for (int it = 0; it < 300; it++) {
+            sgd.zeroGrad();
+            last = dp.trainStep(inputs, labels);
+            sgd.step();
+            if (it == 0) first = last;
+        }
+        CHECK(last < first * (kind == 0 ? 0.3f : 0.7f));
+        delete net;
+    }
+    std::puts("dataparallel ok");
+    return 0;
+}
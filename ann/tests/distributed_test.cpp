@@ -0,0 +1,200 @@
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include "check.h"
+#include "../dist.h"
+#include "../data.h"
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
+
+//Multi-process training, with fork()ed ranks: 3 ranks on a third of a batch each get the gradients and loss of the serial full
+//batch and keep identical weights while training, and when a rank leaves (dies, throws or quits) the others throw instead of waiting
+//forever.
+//Also: the MNIST shards of all ranks together are exactly the whole file.
+using namespace linalg;
+
+#ifdef _WIN32
+int main()
+{
+    std::puts("distributed: POSIX only, skipped");
+    return 0;
+}
+#else
+const int RANKS = 3, BATCH = 48;
+
+static nnet::Network* makeNet()
+{
+    return new nnet::Network({ new nnet::Linear(30, 32, func::act::reLU()), new nnet::Linear(32, 16, func::act::tanhAct()), new nnet::Linear(16, 10, func::act::linear(1)) },
+        new func::loss::SoftmaxCrossEntropy());
+}
+
+static std::vector<float> gather(nnet::Network& net, bool grads)
+{
+    std::vector<nnet::ILayer::param> params;
+    for (nnet::ILayer* l : net.layers) { l->params(params); }
+    std::vector<float> v;
+    for (nnet::ILayer::param& p : params) { v.insert(v.end(), grads ? p.grad : p.value, (grads ? p.grad : p.value) + p.size); }
+    return v;
+}
+
+//one rank: the exit code of the process
+static int runRank(int rank, const Matrix<float>& inputs, const Matrix<float>& labels, const std::vector<float>& serialGrads, float serialLoss,
+    const std::vector<float>& weights)
+{
+    nnet::Network* net = makeNet(); //other random weights in each process, until rank 0's are broadcast
+    if (rank == 0) {
+        std::vector<nnet::ILayer::param> params;
+        for (nnet::ILayer* l : net->layers) { l->params(params); }
+        size_t k = 0;
+        for (nnet::ILayer::param& p : params) { for (size_t i = 0; i < p.size; i++) { p.value[i] = weights[k++]; } }
+    }
+    nnet::DistributedDataParallel ddp(*net, "test" + std::to_string(getppid()), rank, RANKS, 20);
+    CHECK(gather(*net, false) == weights);
+
+    int lo = BATCH * rank / RANKS, hi = BATCH * (rank + 1) / RANKS;
+    Matrix<float> x(hi - lo, 30), y(hi - lo, 10);
+    std::copy(inputs.nums.begin() + lo * 30, inputs.nums.begin() + hi * 30, x.nums.begin());
+    std::copy(labels.nums.begin() + lo * 10, labels.nums.begin() + hi * 10, y.nums.begin());
+    for (nnet::ILayer* l : net->layers) { l->zeroGrad(); }
+    float loss = ddp.trainStep(x, y);
+    CHECK(tests::close(loss, serialLoss));
+    std::vector<float> g = gather(*net, true);
+    for (size_t k = 0; k < g.size(); k++) { CHECK(tests::close(g[k], serialGrads[k])); }
+    for (nnet::ILayer* l : net->layers) { CHECK(l->batchSize == BATCH); }
+
+    std::vector<nnet::ILayer*> params(net->layers.begin(), net->layers.end());
+    optim::SGD sgd(params, 0.3f);
+    sgd.step();
+    float first = 0, last = 0;
+    for (int it = 0; it < 200; it++) {
+        sgd.zeroGrad();
+        last = ddp.trainStep(x, y);
+        sgd.step();
+        if (it == 0) first = last;
+    }
+    CHECK(last < first * 0.3f);
+    //bitwise the same weights on all ranks
+    std::vector<float> mine = gather(*net, false), rank0 = mine;
+    ddp.processGroup().broadcast(rank0.data(), 0, rank0.size());
+    CHECK(mine == rank0);
+    delete net;
+    return 0;
+}
+
+//fork a process per rank running fn(rank), return the number of ranks that failed
+template <class F>
+static int forkRanks(F fn)
+{
+    std::fflush(stdout);
+    std::vector<pid_t> children;
+    for (int r = 0; r < RANKS; r++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int code = 1;
+            try { code = fn(r); }
+            catch (std::exception& e) { std::printf("rank %d: %s\n", r, e.what()); }
+            std::fflush(stdout);
+            _exit(code);
+        }
+        children.push_back(pid);
+    }
+    int failed = 0;
+    for (pid_t pid : children) {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    return failed;
+}
+
+static void writeBigEndian(std::ofstream& ofs, int v)
+{
+    unsigned char b[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v };
+    ofs.write((const char*)b, 4);
+}
+
+int main()
+{
+    nnet::Network* serial = makeNet();
+    Matrix<float> inputs(BATCH, 30, uniform), labels(BATCH, 10, zeros);
+    for (int r = 0; r < BATCH; r++) { labels[r][r % 10] = 1; }
+    std::vector<float> weights = gather(*serial, false);
+    serial->forward(inputs);
+    float serialLoss = serial->lossFunc.lossSum(BATCH, 10, serial->batchOutput->nums.data(), labels.nums.data());
+    serial->backward(labels);
+    std::vector<float> serialGrads = gather(*serial, true);
+    delete serial;
+    CHECK(forkRanks([&](int rank) { return runRank(rank, inputs, labels, serialGrads, serialLoss, weights); }) == 0);
+
+    //rank 1 leaves the group after joining: it dies, throws, or destroys its trainer and lives on. Ranks 0 and 2 must get through
+    //the join and then throw instead of hanging.
+    for (int how = 0; how < 3; how++) {
+        int failed = forkRanks([&](int rank) {
+            nnet::Network* net = makeNet();
+            int code = 1;
+            try {
+                nnet::DistributedDataParallel ddp(*net, "leave" + std::to_string(how) + "-" + std::to_string(getppid()), rank, RANKS, 20);
+                Matrix<float> x(4, 30, uniform), y(4, 10, zeros);
+                if (rank == 1) {
+                    if (how == 0) _exit(0);
+                    if (how == 1) throw std::logic_error("rank 1 failed");
+                    code = 0;
+                }
+                else {
+                    for (int i = 0; i < 10; i++) {
+                        for (nnet::ILayer* l : net->layers) { l->zeroGrad(); }
+                        ddp.trainStep(x, y);
+                    }
+                }
+            }
+            catch (std::runtime_error&) {
+                if (rank != 1) code = 0;
+            }
+            catch (std::logic_error&) {
+                if (rank == 1) code = 0;
+            }
+            if (rank == 1) std::this_thread::sleep_for(std::chrono::milliseconds(500)); //still running, only out of the group
+            delete net;
+            return code;
+        });
+        CHECK(failed == 0);
+    }
+
+    //MNIST shards: a small file in the MNIST format, loaded whole and in 1, 3 and 4 shards
+    std::string dir = std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp";
+    std::string imagePath = dir + "/ann-test-images.idx", labelPath = dir + "/ann-test-labels.idx";
+    const int items = 103, rows = 4, cols = 3;
+    {
+        std::ofstream images(imagePath, std::ios::binary), labelFile(labelPath, std::ios::binary);
+        writeBigEndian(images, 2051);
+        writeBigEndian(images, items);
+        writeBigEndian(images, rows);
+        writeBigEndian(images, cols);
+        writeBigEndian(labelFile, 2049);
+        writeBigEndian(labelFile, items);
+        for (int i = 0; i < items; i++) {
+            for (int j = 0; j < rows * cols; j++) { images.put((char)((i * 7 + j) % 251)); }
+            labelFile.put((char)(i % 10));
+        }
+    }
+    data::MNIST whole(imagePath, labelPath);
+    CHECK(whole.size == items);
+    for (int count : { 1, 3, 4 }) {
+        int seen = 0;
+        for (int s = 0; s < count; s++) {
+            data::MNIST shard(imagePath, labelPath, s, count);
+            for (int i = 0; i < shard.size; i++) {
+                CHECK(shard.inputData[i].nums == whole.inputData[seen + i].nums);
+                CHECK(shard.labelData[i].nums == whole.labelData[seen + i].nums);
+            }
+            seen += shard.size;
+        }
+        CHECK(seen == items);
+    }
+    std::remove(imagePath.c_str());
+    std::remove(labelPath.c_str());
+    std::puts("distributed ok");
+    return 0;
+}
+#endif
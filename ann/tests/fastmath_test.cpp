@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <limits>
+#include "check.h"
+#include "../fastmath.h"
+
+//The error bounds listed in fastmath.h on every ISA the CPU has, and the clamping of out-of-range and NaN inputs.
+using namespace linalg::kernels;
+
+static double ulpError(float got, double ref)
+{
+    float r = (float)ref;
+    double ulp = std::nextafter(std::fabs(r), INFINITY) - std::fabs(r);
+    return std::fabs(got - ref) / ulp;
+}
+
+int main()
+{
+    const int N = 1 << 20;
+    std::vector<float> x(N), y(N);
+    auto range = [&](float lo, float hi) { for (int i = 0; i < N; i++) { x[i] = lo + (hi - lo) * i / (N - 1); } };
+    for (int level = scalar; level <= avx512; level++) {
+        setSimdLevel((simdLevel)level);
+        if (getSimdLevel() != level) continue; //not supported by the CPU
+        double err = 0;
+        range(-87.3f, 88.f);
+        exp(N, x.data(), y.data(), fast);
+        for (int i = 0; i < N; i++) { err = std::max(err, ulpError(y[i], std::exp((double)x[i]))); }
+        CHECK(err <= 1.1);
+
+        err = 0;
+        range(-87.f, 30.f);
+        sigmoid(N, x.data(), y.data(), fast);
+        for (int i = 0; i < N; i++) { err = std::max(err, ulpError(y[i], 1 / (1 + std::exp(-(double)x[i])))); }
+        CHECK(err <= 2.5);
+
+        double errSigmoid = 0, errFast = 0, errTable = 0;
+        range(-20.f, 20.f);
+        sigmoid(N, x.data(), y.data(), table);
+        for (int i = 0; i < N; i++) { errSigmoid = std::max(errSigmoid, std::fabs(y[i] - 1 / (1 + std::exp(-(double)x[i])))); }
+        CHECK(errSigmoid <= 7.8e-7);
+        tanh(N, x.data(), y.data(), fast);
+        for (int i = 0; i < N; i++) { errFast = std::max(errFast, std::fabs(y[i] - std::tanh((double)x[i]))); }
+        tanh(N, x.data(), y.data(), table);
+        for (int i = 0; i < N; i++) { errTable = std::max(errTable, std::fabs(y[i] - std::tanh((double)x[i]))); }
+        CHECK(errFast <= 9e-8);
+        CHECK(errTable <= 1.6e-6);
+
+        //out of range and NaN: the SIMD body and the scalar tail clamp the same way (19 elements: a tail on every ISA)
+        const float inf = std::numeric_limits<float>::infinity(), nan = std::numeric_limits<float>::quiet_NaN();
+        std::vector<float> odd(19), out(19);
+        for (int i = 0; i < 19; i++) { odd[i] = i % 4 == 0 ? nan : i % 4 == 1 ? inf : i % 4 == 2 ? -inf : -200.f; }
+        exp(19, odd.data(), out.data(), fast);
+        for (int i = 0; i < 19; i++) {
+            CHECK(out[i] == (i % 4 == 1 ? out[1] : out[0]));
+            CHECK(std::isfinite(out[i]));
+        }
+    }
+    std::puts("fastmath ok");
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <cstdint>
+#include "check.h"
+#include "../conv.h"
+
+//Network::flattenParams(): the tensors keep their values and move into the network's buffers, each on a cache line, and SGD
+//stepping the flat buffer in one pass trains to the same weights as per-layer SGD, for a dense and a convolutional net.
+//Flattening again keeps the values. A network with a layer that can't be flattened is left exactly as it was.
+using namespace linalg;
+
+static nnet::Network* makeNet(int kind)
+{
+    std::vector<nnet::ILayer*> layers;
+    if (kind == 0) {
+        layers = { new nnet::Linear(30, 64, func::act::reLU()), new nnet::Linear(64, 24, func::act::tanhAct(), false), new nnet::Linear(24, 10, func::act::linear(1)) };
+    }
+    else {
+        layers = { new nnet::Conv2D(1, 8, 8, 4, 3, func::act::reLU(), 1, 1), new nnet::MaxPool2D(4, 8, 8, 2), new nnet::Linear(64, 10, func::act::sigmoid(1)) };
+    }
+    return new nnet::Network(layers, new func::loss::SoftmaxCrossEntropy());
+}
+
+static std::vector<float> values(nnet::Network& net)
+{
+    std::vector<nnet::ILayer::param> params;
+    for (nnet::ILayer* l : net.layers) { l->params(params); }
+    std::vector<float> v;
+    for (nnet::ILayer::param& p : params) { v.insert(v.end(), p.value, p.value + p.size); }
+    return v;
+}
+
+int main()
+{
+    for (int kind = 0; kind < 2; kind++) {
+        int inSize = kind == 0 ? 30 : 64;
+        nnet::Network* plain = makeNet(kind);
+        std::vector<nnet::ILayer*> cloned;
+        for (nnet::ILayer* l : plain->layers) { cloned.push_back(l->clone()); }
+        nnet::Network flat(cloned, plain->lossFunc.clone());
+        std::vector<float> before = values(*plain);
+
+        optim::flatBuffer buffer = flat.flattenParams();
+        CHECK(flat.flat());
+        CHECK(values(flat) == before);
+        for (nnet::ILayer* l : flat.layers) {
+            std::vector<nnet::ILayer::param> params;
+            l->params(params);
+            for (nnet::ILayer::param& p : params) {
+                CHECK(p.value >= buffer.values && p.value + p.size <= buffer.values + buffer.size);
+                CHECK(p.grad - buffer.grads == p.value - buffer.values);
+                CHECK((uintptr_t)p.value % 64 == 0);
+            }
+        }
+
+        Matrix<float> inputs(40, inSize, uniform), labels(40, 10, zeros);
+        for (int r = 0; r < 40; r++) { labels[r][r % 10] = 1; }
+        std::vector<nnet::ILayer*> plainLayers(plain->layers.begin(), plain->layers.end()), flatLayers(flat.layers.begin(), flat.layers.end());
+        optim::SGD plainSgd(plainLayers, 0.3f, 0.01f), flatSgd(flatLayers, 0.3f, 0.01f);
+        flatSgd.useFlat(buffer);
+        for (int it = 0; it < 50; it++) {
+            plainSgd.zeroGrad();
+            plain->forward(inputs);
+            plain->backward(labels);
+            plainSgd.step();
+            flatSgd.zeroGrad();
+            flat.forward(inputs);
+            flat.backward(labels);
+            flatSgd.step();
+        }
+        std::vector<float> trained = values(*plain), flatTrained = values(flat);
+        CHECK(trained != before);
+        for (size_t k = 0; k < trained.size(); k++) { CHECK(tests::close(flatTrained[k], trained[k])); }
+
+        flat.flattenParams();
+        CHECK(values(flat) == flatTrained);
+        delete plain;
+    }
+
+    //FixedLinear keeps its weights inline: nothing is bound, not even the Linear before it, and training goes on as before
+    nnet::Network net({ new nnet::Linear(4, 8, func::act::reLU()), new nnet::FixedLinear<8, 3>(func::act::tanhAct()) }, new func::loss::MSE());
+    nnet::Linear* first = (nnet::Linear*)net.layers[0];
+    std::vector<float> before = values(net);
+    bool threw = false;
+    try {
+        net.flattenParams();
+    }
+    catch (std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(!net.flat() && net.flatValues.empty());
+    CHECK(first->boundWeights == nullptr && first->boundBiases == nullptr && first->weights.size() == 8 * 4);
+    CHECK(values(net) == before);
+    Matrix<float> inputs(5, 4, uniform), labels(5, 3, zeros);
+    std::vector<nnet::ILayer*> layers(net.layers.begin(), net.layers.end());
+    optim::SGD sgd(layers, 0.1f);
+    sgd.zeroGrad();
+    net.forward(inputs);
+    net.backward(labels);
+    sgd.step();
+    CHECK(values(net) != before);
+    std::puts("flatten ok");
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <random>
+#include "check.h"
+#include "../trainer.h"
+
+//Hogwild on a synthetic sparse 10-class task (each class a fixed pattern of 15 active inputs out of 100, plus 3 random ones per
+//sample): every sample is trained on exactly once per epoch, and 4 racing workers still learn the task. The races on the weights
+//are on purpose, so ThreadSanitizer reports them.
+using namespace linalg;
+
+struct SparseSet : data::IDataSet
+{
+    std::vector<Vector<float>> inputs, labels;
+    SparseSet(int n)
+    {
+        size = n;
+        inputSize = 100;
+        labelSize = 10;
+        std::mt19937 gen(1);
+        std::vector<Vector<float>> patterns;
+        for (int c = 0; c < 10; c++) {
+            Vector<float> p(100, zeros);
+            for (int k = 0; k < 15; k++) { p[gen() % 100] = 1; }
+            patterns.push_back(p);
+        }
+        for (int i = 0; i < n; i++) {
+            Vector<float> x = patterns[i % 10];
+            for (int k = 0; k < 3; k++) { x[gen() % 100] = 1; }
+            Vector<float> y(10, zeros);
+            y[i % 10] = 1;
+            inputs.push_back(x);
+            labels.push_back(y);
+        }
+    }
+    data::InputLabelPair getItem(int i) override { return { &inputs[i], &labels[i] }; }
+    void shuffle() override {}
+};
+
+int main()
+{
+    linalg::parallel::setNumThreads(4);
+    SparseSet set(4000);
+    data::DataLoader loader(set, 4, false);
+    nnet::Network net({ new nnet::Linear(100, 32, func::act::reLU()), new nnet::Linear(32, 10, func::act::linear(1)) }, new func::loss::SoftmaxCrossEntropy());
+    nnet::Hogwild hogwild(net, 4);
+    CHECK(hogwild.numWorkers() == 4);
+    for (int epoch = 0; epoch < 3; epoch++) {
+        metrics::Metrics stats(10);
+        loader.reset();
+        long long samples = hogwild.trainEpoch(loader, 0.1f, &stats);
+        CHECK(samples == 4000);
+        CHECK(stats.count == 4000);
+        if (epoch == 2) CHECK(stats.accuracy() >= 0.99);
+    }
+    std::puts("hogwild ok");
+    return 0;
+}
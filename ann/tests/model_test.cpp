@@ -0,0 +1,117 @@
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <string>
+#include "check.h"
+#include "../model.h"
+
+//Model files: save, then load mapped and copied, and predict the same as the saved network (activation parameters and
+//accuracies, a layer without biases and a FixedLinear included). Truncated files and files with a bad field (layer kind,
+//activation, accuracy, loss, sizes that don't chain, weights outside the file) are rejected with std::runtime_error.
+using namespace linalg;
+
+static std::vector<char> readFile(const std::string& path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+static void writeFile(const std::string& path, const std::vector<char>& bytes)
+{
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    ofs.write(bytes.data(), bytes.size());
+}
+
+//whether loading the file throws std::runtime_error
+static bool rejected(const std::string& path, func::ALossFunction* loss = nullptr)
+{
+    try {
+        delete nnet::loadModel(path, true, loss);
+    }
+    catch (std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+//the file with a field of the layer record i (i < 0: of the header) at offset set to v
+template <class T>
+static bool rejectedWith(const std::string& path, const std::vector<char>& file, int i, size_t offset, T v)
+{
+    std::vector<char> bytes = file;
+    size_t at = i < 0 ? offset : sizeof(nnet::modelHeader) + i * sizeof(nnet::layerRecord) + offset;
+    std::memcpy(bytes.data() + at, &v, sizeof(v));
+    writeFile(path, bytes);
+    return rejected(path);
+}
+
+int main()
+{
+    nnet::Network net({ new nnet::Linear(30, 50, func::act::lReLU(0.2f)), new nnet::Linear(50, 20, func::act::sigmoid(3), false),
+        new nnet::FixedLinear<20, 10>(func::act::tanhAct()) }, new func::loss::SoftmaxCrossEntropy());
+    for (nnet::ILayer* l : net.layers) { l->biases = Vector<float>(l->outSize, uniform); }
+    nnet::FixedLinear<20, 10>* fixed = (nnet::FixedLinear<20, 10>*)net.layers[2];
+    for (int i = 0; i < 10; i++) { fixed->fixedBiases[i] = 0.1f * i; }
+    ((nnet::Linear*)net.layers[1])->actFunc->accuracy = kernels::fast;
+    Matrix<float> x(40, 30, uniform), expected, out;
+    net.predict(x, expected);
+
+    std::string dir = std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp";
+    std::string path = dir + "/ann-test.model", badPath = dir + "/ann-test-bad.model";
+    nnet::saveModel(net, path);
+    for (bool map : { true, false }) {
+        nnet::Network* loaded = nnet::loadModel(path, map);
+        CHECK(loaded->layers.size() == 3);
+        CHECK(loaded->lossFunc.type() == func::lossType::SoftmaxCrossEntropy);
+        const func::AActFunction* act = loaded->layers[1]->activation();
+        CHECK(act->type() == func::actType::sigmoid && act->param() == 3 && act->accuracy == kernels::fast);
+        CHECK(!loaded->layers[1]->hasBias());
+        loaded->predict(x, out);
+        for (int i = 0; i < expected.size(); i++) { CHECK(tests::close(out.nums[i], expected.nums[i], 1e-6)); }
+        delete loaded;
+    }
+
+    std::vector<char> file = readFile(path);
+    for (size_t size : { (size_t)0, (size_t)10, sizeof(nnet::modelHeader), sizeof(nnet::modelHeader) + 3 * sizeof(nnet::layerRecord) - 1, file.size() - 1 }) {
+        writeFile(badPath, std::vector<char>(file.begin(), file.begin() + size));
+        CHECK(rejected(badPath));
+    }
+    std::vector<char> longer = file;
+    longer.push_back(0);
+    writeFile(badPath, longer);
+    CHECK(rejected(badPath));
+
+    CHECK(rejectedWith(badPath, file, -1, offsetof(nnet::modelHeader, loss), (int32_t)42));
+    CHECK(rejectedWith(badPath, file, -1, offsetof(nnet::modelHeader, loss), (int32_t)-1));
+    CHECK(rejectedWith(badPath, file, -1, offsetof(nnet::modelHeader, loss), (int32_t)func::lossType::custom));
+    CHECK(rejectedWith(badPath, file, -1, offsetof(nnet::modelHeader, numLayers), (uint32_t)0x40000000));
+    CHECK(rejectedWith(badPath, file, 1, offsetof(nnet::layerRecord, kind), (int32_t)2));
+    CHECK(rejectedWith(badPath, file, 1, offsetof(nnet::layerRecord, act), (int32_t)func::actType::custom));
+    CHECK(rejectedWith(badPath, file, 1, offsetof(nnet::layerRecord, act), (int32_t)99));
+    CHECK(rejectedWith(badPath, file, 1, offsetof(nnet::layerRecord, actParam), std::numeric_limits<float>::quiet_NaN()));
+    CHECK(rejectedWith(badPath, file, 1, offsetof(nnet::layerRecord, actAccuracy), (int32_t)-1));
+    CHECK(rejectedWith(badPath, file, 1, offsetof(nnet::layerRecord, actAccuracy), (int32_t)9));
+    CHECK(rejectedWith(badPath, file, 1, offsetof(nnet::layerRecord, inSize), (int32_t)7));
+    CHECK(rejectedWith(badPath, file, 2, offsetof(nnet::layerRecord, outSize), (int32_t)-10));
+    CHECK(rejectedWith(badPath, file, 2, offsetof(nnet::layerRecord, outSize), (int32_t)100000));
+    CHECK(rejectedWith(badPath, file, 0, offsetof(nnet::layerRecord, weightsOffset), (uint64_t)-64));
+    CHECK(rejectedWith(badPath, file, 0, offsetof(nnet::layerRecord, weightsOffset), (uint64_t)0));
+    CHECK(rejectedWith(badPath, file, 2, offsetof(nnet::layerRecord, biasesOffset), (uint64_t)file.size()));
+    CHECK(rejectedWith(badPath, file, 2, offsetof(nnet::layerRecord, biasesOffset), (uint64_t)8));
+    CHECK(!rejectedWith(badPath, file, 1, offsetof(nnet::layerRecord, actAccuracy), (int32_t)kernels::exact));
+
+    //a model stored with a custom loss loads only with a loss function passed
+    std::vector<char> custom = file;
+    int32_t customLoss = (int32_t)func::lossType::custom;
+    std::memcpy(custom.data() + offsetof(nnet::modelHeader, loss), &customLoss, sizeof(customLoss));
+    writeFile(badPath, custom);
+    CHECK(!rejected(badPath, new func::loss::MSE()));
+
+    std::remove(path.c_str());
+    std::remove(badPath.c_str());
+    std::puts("model ok");
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <string>
+#include "check.h"
+#include "../pipeline.h"
+#include "../conv.h"
+
+//Pipeline against serial backprop: the same loss, gradient sums and batch sizes for 1 to L stages and 1 to 60 micro-batches,
+//for a dense net and one with layers Pipeline recomputes (Conv2D, MaxPool2D), and training that converges. A layer that throws in
+//any stage makes trainStep() throw its exception instead of hanging, and the next step is right again. Run it under
+//-fsanitize=thread as well.
+using namespace linalg;
+
+//a MaxPool2D whose forward() throws on call number failAt
+struct FailingPool : nnet::MaxPool2D
+{
+    int failAt = -1, calls = 0;
+    FailingPool() : nnet::MaxPool2D(4, 8, 8, 2) {}
+    using nnet::MaxPool2D::forward;
+    Matrix<float>& forward(Matrix<float>& inBatch) override
+    {
+        if (calls++ == failAt) throw std::runtime_error("pool failed");
+        return nnet::MaxPool2D::forward(inBatch);
+    }
+};
+
+static nnet::Network* makeNet(int kind)
+{
+    std::vector<nnet::ILayer*> layers;
+    if (kind == 0) {
+        layers = { new nnet::Linear(30, 16, func::act::reLU()), new nnet::Linear(16, 16, func::act::reLU()), new nnet::Linear(16, 16, func::act::tanhAct()),
+            new nnet::Linear(16, 16, func::act::reLU()), new nnet::Linear(16, 10, func::act::linear(1)) };
+    }
+    else {
+        layers = { new nnet::Conv2D(1, 8, 8, 4, 3, func::act::reLU(), 1, 1), new nnet::MaxPool2D(4, 8, 8, 2), new nnet::Linear(64, 16, func::act::reLU()),
+            new nnet::Linear(16, 10, func::act::linear(1)) };
+    }
+    return new nnet::Network(layers, new func::loss::SoftmaxCrossEntropy());
+}
+
+static std::vector<float> gradients(nnet::Network& net)
+{
+    std::vector<nnet::ILayer::param> params;
+    for (nnet::ILayer* l : net.layers) { l->params(params); }
+    std::vector<float> g;
+    for (nnet::ILayer::param& p : params) { g.insert(g.end(), p.grad, p.grad + p.size); }
+    return g;
+}
+
+int main()
+{
+    for (int kind = 0; kind < 2; kind++) {
+        int inSize = kind == 0 ? 30 : 64;
+        nnet::Network* net = makeNet(kind);
+        Matrix<float> inputs(50, inSize, uniform), labels(50, 10, zeros);
+        for (int r = 0; r < 50; r++) { labels[r][r % 10] = 1; }
+
+        std::vector<nnet::ILayer*> cloned;
+        for (nnet::ILayer* l : net->layers) { cloned.push_back(l->clone()); }
+        nnet::Network serial(cloned, net->lossFunc.clone());
+        serial.forward(inputs);
+        float serialLoss = serial.lossFunc.lossSum(50, 10, serial.batchOutput->nums.data(), labels.nums.data());
+        serial.backward(labels);
+        std::vector<float> serialGrads = gradients(serial);
+
+        for (int stages = 1; stages <= (int)net->layers.size(); stages++) {
+            for (int micro : { 1, 2, 4, 7, 60 }) {
+                nnet::Pipeline pipeline(*net, stages, micro);
+                for (nnet::ILayer* l : net->layers) { l->zeroGrad(); }
+                metrics::Metrics stats;
+                float loss = pipeline.trainStep(inputs, labels, &stats);
+                CHECK(tests::close(loss, serialLoss));
+                CHECK(stats.count == 50);
+                std::vector<float> g = gradients(*net);
+                for (size_t k = 0; k < g.size(); k++) { CHECK(tests::close(g[k], serialGrads[k])); }
+                for (size_t i = 0; i < net->layers.size(); i++) { CHECK(net->layers[i]->batchSize == serial.layers[i]->batchSize); }
+            }
+        }
+
+        {
+            //the pipeline rewires the layers' inputs, so it must go before the network
+            nnet::Pipeline pipeline(*net, 3, 6);
+            std::vector<nnet::ILayer*> params(net->layers.begin(), net->layers.end());
+            optim::SGD sgd(params, 0.3f);
+            float first = 0, last = 0;
+            for (int it = 0; it < 300; it++) {
+                sgd.zeroGrad();
+                last = pipeline.trainStep(inputs, labels);
+                sgd.step();
+                if (it == 0) first = last;
+            }
+            CHECK(last < first * 0.5f);
+        }
+        delete net;
+    }
+
+    //the failing layer in the first, a middle and the last stage, on its first forward and on a later one (a recomputation)
+    FailingPool* pool = new FailingPool();
+    nnet::Network net({ new nnet::Conv2D(1, 8, 8, 4, 3, func::act::reLU(), 1, 1), pool, new nnet::Linear(64, 16, func::act::reLU()),
+        new nnet::Linear(16, 10, func::act::linear(1)) }, new func::loss::SoftmaxCrossEntropy());
+    Matrix<float> inputs(50, 64, uniform), labels(50, 10, zeros);
+    for (int r = 0; r < 50; r++) { labels[r][r % 10] = 1; }
+    net.forward(inputs);
+    float serialLoss = net.lossFunc.lossSum(50, 10, net.batchOutput->nums.data(), labels.nums.data());
+    for (const std::vector<int>& split : std::vector<std::vector<int>>{ { 0, 2, 3 }, { 0, 1, 2, 3 }, { 0, 1 } }) {
+        nnet::Pipeline pipeline(net, split, 6);
+        for (int failAt : { 0, 7 }) {
+            pool->calls = 0;
+            pool->failAt = failAt;
+            bool threw = false;
+            try {
+                pipeline.trainStep(inputs, labels);
+            }
+            catch (std::runtime_error& e) {
+                threw = std::string(e.what()) == "pool failed";
+            }
+            CHECK(threw);
+            pool->failAt = -1;
+            CHECK(tests::close(pipeline.trainStep(inputs, labels), serialLoss));
+        }
+    }
+    std::puts("pipeline ok");
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <string>
+#include "check.h"
+#include "../plan.h"
+
+//Plan against Network::forward()/backward() on the same weights: the same outputs, loss, gradient sums and batch sizes, for
+//full and smaller batches, with a layer the plan runs through its Matrixf interface (FixedLinear), and the inference plan against
+//predict(). Batches that don't fit the plan are rejected.
+using namespace linalg;
+
+static nnet::Network* makeNet(bool fixed)
+{
+    std::vector<nnet::ILayer*> layers = { new nnet::Linear(30, 64, func::act::reLU()), new nnet::Linear(64, 40, func::act::tanhAct()) };
+    if (fixed) layers.push_back(new nnet::FixedLinear<40, 24>(func::act::sigmoid(1)));
+    else layers.push_back(new nnet::Linear(40, 24, func::act::sigmoid(1)));
+    layers.push_back(new nnet::Linear(24, 10, func::act::linear(1)));
+    for (nnet::ILayer* l : layers) { l->biases = Vector<float>(l->outSize, uniform); }
+    return new nnet::Network(layers, new func::loss::SoftmaxCrossEntropy());
+}
+
+static std::vector<float> gradients(nnet::Network& net)
+{
+    std::vector<nnet::ILayer::param> params;
+    for (nnet::ILayer* l : net.layers) { l->params(params); }
+    std::vector<float> g;
+    for (nnet::ILayer::param& p : params) { g.insert(g.end(), p.grad, p.grad + p.size); }
+    return g;
+}
+
+template <class F>
+static bool throws(F run)
+{
+    try {
+        run();
+    }
+    catch (std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+int main()
+{
+    for (bool fixed : { false, true }) {
+        nnet::Network* net = makeNet(fixed);
+        std::vector<nnet::ILayer*> cloned;
+        for (nnet::ILayer* l : net->layers) { cloned.push_back(l->clone()); }
+        nnet::Network reference(cloned, net->lossFunc.clone());
+        nnet::Plan plan(*net, 64);
+
+        for (int batch : { 64, 50, 7 }) {
+            Matrix<float> inputs(batch, 30, uniform), labels(batch, 10, zeros);
+            for (int r = 0; r < batch; r++) { labels[r][r % 10] = 1; }
+            for (nnet::ILayer* l : net->layers) { l->zeroGrad(); }
+            for (nnet::ILayer* l : reference.layers) { l->zeroGrad(); }
+            float loss = plan.trainStep(inputs, labels);
+            reference.forward(inputs);
+            Matrix<float> expected = *reference.batchOutput;
+            float expectedLoss = reference.lossFunc.lossSum(batch, 10, expected.nums.data(), labels.nums.data());
+            reference.backward(labels);
+
+            CHECK(tests::close(loss, expectedLoss));
+            MatrixView<const float> out = plan.output();
+            for (int r = 0; r < batch; r++) {
+                for (int c = 0; c < 10; c++) { CHECK(tests::close(out(r, c), expected[r][c])); }
+            }
+            std::vector<float> g = gradients(*net), expectedGrads = gradients(reference);
+            CHECK(g.size() == expectedGrads.size());
+            for (size_t k = 0; k < g.size(); k++) { CHECK(tests::close(g[k], expectedGrads[k], 1e-3)); }
+            for (size_t i = 0; i < net->layers.size(); i++) { CHECK(net->layers[i]->batchSize == reference.layers[i]->batchSize); }
+        }
+
+        nnet::Plan inference(*net, 64, false);
+        CHECK(inference.numBuffers() == 2);
+        Matrix<float> x(9, 30, uniform), predicted;
+        MatrixView<const float> out = inference.forward(x);
+        reference.predict(x, predicted);
+        for (int r = 0; r < 9; r++) {
+            for (int c = 0; c < 10; c++) { CHECK(tests::close(out(r, c), predicted[r][c], 1e-5)); }
+        }
+
+        Matrix<float> tooMany(65, 30, uniform), tooWide(8, 31, uniform), inputs(8, 30, uniform), labels(8, 10, zeros), fewLabels(7, 10, zeros);
+        CHECK(throws([&] { plan.forward(tooMany); }));
+        CHECK(throws([&] { plan.forward(tooWide); }));
+        CHECK(throws([&] { plan.trainStep(inputs, fewLabels); }));
+        CHECK(throws([&] { inference.trainStep(inputs, labels); }));
+        CHECK(!throws([&] { plan.trainStep(inputs, labels); }));
+        delete net;
+    }
+    std::puts("plan ok");
+    return 0;
+}
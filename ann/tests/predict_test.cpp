@@ -0,0 +1,49 @@
+#include <atomic>
+#include <thread>
+#include "check.h"
+#include "../nnet.h"
+
+//Network::predict() from 8 threads at once on one network: the same outputs as the batched forward(), and the network's own
+//outputs untouched. Run it under -fsanitize=thread as well.
+using namespace linalg;
+
+int main()
+{
+    nnet::Network net({ (nnet::ILayer*)new nnet::Linear(30, 200, func::act::reLU()), (nnet::ILayer*)new nnet::Linear(200, 100, func::act::sigmoid(1)),
+        (nnet::ILayer*)new nnet::FixedLinear<100, 10>(func::act::tanhAct()) }, new func::loss::MSE());
+    for (nnet::ILayer* l : net.layers) { l->biases = Vector<float>(l->outSize, uniform); }
+    nnet::FixedLinear<100, 10>* fixed = (nnet::FixedLinear<100, 10>*)net.layers[2];
+    for (int i = 0; i < 10; i++) { fixed->fixedBiases[i] = 0.1f * i; }
+
+    Matrix<float> inputs(300, 30, uniform);
+    net.forward(inputs);
+    Matrix<float> expected = *net.batchOutput;
+
+    std::vector<std::thread> threads;
+    std::atomic<int> wrong(0);
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&] {
+            for (int it = 0; it < 20; it++) {
+                Matrix<float> out;
+                net.predict(inputs, out);
+                for (int i = 0; i < out.size(); i++) {
+                    if (!tests::close(out.nums[i], expected.nums[i], 1e-5)) wrong++;
+                }
+            }
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    CHECK(wrong == 0);
+    for (int i = 0; i < expected.size(); i++) { CHECK(expected.nums[i] == net.batchOutput->nums[i]); }
+
+    Vector<float> x(inputs.view().row(5));
+    Vector<float> y = net.predict(x);
+    for (int j = 0; j < 10; j++) { CHECK(tests::close(y[j], expected[5][j], 1e-5)); }
+
+    //without keepSums, forward() goes through predict()
+    ((nnet::Linear*)net.layers[0])->keepSums = false;
+    net.forward(inputs);
+    for (int i = 0; i < expected.size(); i++) { CHECK(tests::close(net.batchOutput->nums[i], expected.nums[i], 1e-5)); }
+    std::puts("predict ok");
+    return 0;
+}
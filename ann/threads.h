@@ -0,0 +1,226 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//Process-wide work-stealing thread pool used by the linalg kernels.
+//parallelFor() splits a range into chunks and pushes them onto the workers' deques. A worker takes work from the back
+//of its own deque and, when that is empty, steals from the front of the others'. The calling thread runs chunks too
+//until its range is done, so a parallelFor inside a chunk (nested parallelism) can't deadlock the pool.
+namespace linalg
+{
+    namespace parallel
+    {
+        //Thread-local index of the pool worker running on this thread, -1 on all other threads.
+        inline int& workerIndex()
+        {
+            thread_local int index = -1;
+            return index;
+        }
+
+        class ThreadPool
+        {
+        protected:
+            //a chunk [lo, hi) of a parallelFor call
+            struct Task
+            {
+                void (*call)(void*, int, int);
+                void* fn;
+                int lo;
+                int hi;
+                std::atomic<int>* remaining;
+            };
+            struct Queue
+            {
+                std::mutex m;
+                std::deque<Task> tasks;
+            };
+
+            std::vector<std::unique_ptr<Queue>> queues; //one per worker
+            std::vector<std::thread> workers;
+            std::atomic<int> queued; //tasks waiting in any queue
+            std::atomic<int> nextQueue; //round-robin target for tasks pushed by non-worker threads
+            std::mutex sleepMutex;
+            std::condition_variable sleepCv;
+            bool stop = false;
+        public:
+            //IN: number of worker threads (the calling thread works as well), pin worker i to core i + 1
+            ThreadPool(int numWorkers, bool pinThreads = false) : queued(0), nextQueue(0)
+            {
+                for (int i = 0; i < numWorkers; i++) queues.emplace_back(new Queue);
+                for (int i = 0; i < numWorkers; i++) {
+                    workers.emplace_back([this, i] { workerLoop(i); });
+                    if (pinThreads) pin(workers.back(), (i + 1) % std::max(1u, std::thread::hardware_concurrency()));
+                }
+            }
+            ~ThreadPool()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(sleepMutex);
+                    stop = true;
+                }
+                sleepCv.notify_all();
+                for (auto& t : workers) t.join();
+            }
+
+            //number of threads that run chunks: the workers plus the caller
+            int size() const { return (int)workers.size() + 1; }
+
+            //Call call(fn, lo, hi) on chunks of at least minChunk elements covering [0, n), in parallel, and return when all are done.
+            //Chunk sizes are rounded up to a multiple of align (e.g. whole SIMD registers).
+            void parallelFor(int n, int minChunk, int align, void (*call)(void*, int, int), void* fn)
+            {
+                int maxChunks = size() * 4; //a few chunks per thread so stealing can even out imbalance
+                int chunk = std::max(minChunk, (n + maxChunks - 1) / maxChunks);
+                chunk = (chunk + align - 1) / align * align;
+                int numChunks = (n + chunk - 1) / chunk;
+                if (numChunks <= 1 || workers.empty()) {
+                    if (n > 0) call(fn, 0, n);
+                    return;
+                }
+
+                std::atomic<int> remaining(numChunks - 1);
+                int self = workerIndex();
+                for (int c = 1; c < numChunks; c++) {
+                    int q = self >= 0 ? self : nextQueue.fetch_add(1) % (int)queues.size();
+                    push(q, { call, fn, c * chunk, std::min(n, (c + 1) * chunk), &remaining });
+                }
+                call(fn, 0, std::min(n, chunk));
+
+                //help until the rest of this range is done
+                while (remaining.load() > 0) {
+                    Task t;
+                    if (tryPop(self, t)) run(t);
+                    else std::this_thread::yield();
+                }
+            }
+        protected:
+            void push(int q, const Task& t)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(queues[q]->m);
+                    queues[q]->tasks.push_back(t);
+                }
+                queued.fetch_add(1);
+                std::lock_guard<std::mutex> lock(sleepMutex);
+                sleepCv.notify_one();
+            }
+
+            //Take a task from the back of the own queue (if self is a worker), else steal from the front of another one.
+            bool tryPop(int self, Task& t)
+            {
+                if (queued.load() == 0) return false;
+                if (self >= 0) {
+                    std::lock_guard<std::mutex> lock(queues[self]->m);
+                    if (!queues[self]->tasks.empty()) {
+                        t = queues[self]->tasks.back();
+                        queues[self]->tasks.pop_back();
+                        queued.fetch_sub(1);
+                        return true;
+                    }
+                }
+                int n = (int)queues.size();
+                int start = self >= 0 ? self + 1 : 0;
+                for (int k = 0; k < n; k++) {
+                    int q = (start + k) % n;
+                    if (q == self) continue;
+                    std::lock_guard<std::mutex> lock(queues[q]->m);
+                    if (!queues[q]->tasks.empty()) {
+                        t = queues[q]->tasks.front();
+                        queues[q]->tasks.pop_front();
+                        queued.fetch_sub(1);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            static void run(const Task& t)
+            {
+                t.call(t.fn, t.lo, t.hi);
+                t.remaining->fetch_sub(1);
+            }
+
+            void workerLoop(int i)
+            {
+                workerIndex() = i;
+                while (true) {
+                    Task t;
+                    if (tryPop(i, t)) {
+                        run(t);
+                        continue;
+                    }
+                    std::unique_lock<std::mutex> lock(sleepMutex);
+                    if (stop) return;
+                    if (queued.load() == 0) sleepCv.wait(lock);
+                }
+            }
+
+            static void pin(std::thread& t, int core)
+            {
+#ifdef _WIN32
+                SetThreadAffinityMask(t.native_handle(), (DWORD_PTR)1 << core);
+#elif defined(__linux__)
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(core, &set);
+                pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#endif
+            }
+        };
+
+        inline std::unique_ptr<ThreadPool>& poolPtr()
+        {
+            static std::unique_ptr<ThreadPool> p;
+            return p;
+        }
+
+        //The shared pool, created on first use with one thread per hardware thread.
+        inline ThreadPool& pool()
+        {
+            static std::once_flag once;
+            std::call_once(once, [] {
+                if (!poolPtr()) poolPtr().reset(new ThreadPool((int)std::max(1u, std::thread::hardware_concurrency()) - 1));
+            });
+            return *poolPtr();
+        }
+
+        //Replace the shared pool with one of n threads in total (n = 1: everything runs on the calling thread).
+        //Not thread safe, call it before the kernels are used from more than one thread.
+        //IN: number of threads including the caller, pin each worker to its own core
+        inline void setNumThreads(int n, bool pinThreads = false)
+        {
+            pool();
+            poolPtr().reset();
+            poolPtr().reset(new ThreadPool(std::max(1, n) - 1, pinThreads));
+        }
+
+        inline int numThreads() { return pool().size(); }
+
+        //Run fn(lo, hi) over chunks of [0, n) on the shared pool, or inline if n is less than two chunks.
+        //IN: range size, minimum chunk size, function taking a [lo, hi) chunk, chunk size granularity
+        template <class F>
+        void parallelFor(int n, int minChunk, F fn, int align = 1)
+        {
+            if (n < 2 * minChunk) {
+                if (n > 0) fn(0, n);
+                return;
+            }
+            pool().parallelFor(n, minChunk, align, [](void* f, int lo, int hi) { (*(F*)f)(lo, hi); }, &fn);
+        }
+    }
+}
@@ -0,0 +1,355 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "nnet.h"
+#include "data.h"
+#include "metrics.h"
+
+//Trainers that keep several threads busy on one network.
+//DataParallel, synchronous data-parallel training: each batch is split into contiguous slices, one per worker, and every worker
+//runs forward and backward on its slice with its own replica of the network, so activations, weighted sums and gradient sums are
+//never shared. The gradient sums of the replicas are then combined into the master network's by a tree reduction with a fixed
+//shape, so the result depends on the number of workers only, not on the thread timing, and the optimizer steps the master as usual.
+//Hogwild, asynchronous SGD: the workers pull their own small batches from a data loader and subtract their gradients from the
+//master's weights right away, without locks and without waiting for each other.
+namespace nnet
+{
+    //Persistent threads for the workers of a trainer (or the stages of a Pipeline): run(fn) calls fn(w) for each worker w, worker 0
+    //on the calling thread and each other one on its own thread, and returns when all are done. The workers' passes must not run as
+    //tasks of the linalg pool: a thread waiting in parallelFor() runs queued tasks meanwhile, and if one of them were another worker's
+    //pass, its GEMMs would repack the waiting GEMM's per-thread packing buffer while the pool still reads it.
+    class WorkerThreads
+    {
+    protected:
+        std::vector<std::thread> threads; //workers 1..N-1
+        std::mutex mutex;
+        std::condition_variable startCv, doneCv;
+        std::function<void(int)> job;
+        long long generation = 0;
+        int running = 0;
+        bool stop = false;
+        std::exception_ptr error; //the first exception of the current run()
+    public:
+        //IN: number of workers, including the calling thread
+        explicit WorkerThreads(int numWorkers)
+        {
+            for (int w = 1; w < numWorkers; w++) {
+                threads.emplace_back([this, w] { workerLoop(w); });
+            }
+        }
+        ~WorkerThreads()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            startCv.notify_all();
+            for (std::thread& t : threads) t.join();
+        }
+        WorkerThreads(const WorkerThreads&) = delete;
+        WorkerThreads& operator = (const WorkerThreads&) = delete;
+
+        int size() const { return (int)threads.size() + 1; }
+
+        //Call fn(w) for all workers at once and wait for them. If workers throw, the first exception is rethrown after all are done.
+        void run(const std::function<void(int)>& fn)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = fn;
+                error = nullptr;
+                running = (int)threads.size();
+                generation++;
+            }
+            startCv.notify_all();
+            std::exception_ptr e;
+            try { fn(0); }
+            catch (...) { e = std::current_exception(); }
+            std::unique_lock<std::mutex> lock(mutex);
+            doneCv.wait(lock, [&] { return running == 0; });
+            if (e == nullptr) e = error;
+            if (e) std::rethrow_exception(e);
+        }
+    protected:
+        void workerLoop(int w)
+        {
+            long long seen = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    startCv.wait(lock, [&] { return stop || generation != seen; });
+                    if (stop) return;
+                    seen = generation;
+                }
+                std::exception_ptr e;
+                try { job(w); }
+                catch (...) { e = std::current_exception(); }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (e && error == nullptr) error = e;
+                if (--running == 0) doneCv.notify_all();
+            }
+        }
+    };
+
+    class DataParallel
+    {
+    protected:
+        //a worker: its replica of the network (worker 0: the master network), its slice of the batch and trained tensors
+        struct worker
+        {
+            Network* net;
+            std::unique_ptr<Network> owned; //the replicas of workers 1..N-1
+            Matrixf inputs, labels;
+            std::vector<ILayer::param> params; //of all layers, in layer order (Network::params())
+            float loss = 0;
+            int rows = 0;
+        };
+        Network& master;
+        std::vector<worker> workers;
+        std::unique_ptr<WorkerThreads> threads;
+    public:
+        //Replicate a network for numWorkers workers. The replicas are clones of the layers and the loss function, so all layers must
+        //implement ILayer::clone(). The master's weights are copied into the replicas at each trainStep(); train the master as usual.
+        //If the master is flat (Network::flattenParams()), so are the replicas, and weights and gradients move as one buffer.
+        //IN: network (must outlive the trainer), number of workers (0: one per thread of the pool, see linalg::parallel::numThreads())
+        DataParallel(Network& net, int numWorkers = 0) : master(net)
+        {
+            if (numWorkers <= 0) numWorkers = lin::parallel::numThreads();
+            workers.resize(numWorkers);
+            workers[0].net = &master;
+            for (int w = 1; w < numWorkers; w++) {
+                std::vector<ILayer*> layers;
+                func::ALossFunction* loss = nullptr;
+                try {
+                    for (ILayer* l : master.layers) { layers.push_back(l->clone()); }
+                    loss = master.lossFunc.clone();
+                }
+                catch (...) {
+                    for (ILayer* l : layers) delete l;
+                    throw;
+                }
+                workers[w].owned.reset(new Network(layers, loss));
+                workers[w].net = workers[w].owned.get();
+                if (master.flat()) workers[w].net->flattenParams();
+            }
+            for (worker& wk : workers) {
+                wk.net->params(wk.params);
+                if (wk.params.size() != workers[0].params.size()) throw std::runtime_error("DataParallel: a replica has different parameters");
+            }
+            threads.reset(new WorkerThreads(numWorkers));
+        }
+
+        int numWorkers() const { return (int)workers.size(); }
+        //the replica of a worker (0: the master network), e.g. to read its batchOutput after trainStep()
+        Network& replica(int w) { return *workers[w].net; }
+        //the number of batch rows worker w got in the last trainStep()
+        int sliceRows(int w) const { return workers[w].rows; }
+
+        //Forward and backward for a batch, split across the workers. The gradient sums and batch sizes end up in the master's layers
+        //as if the master had run the whole batch (up to rounding: the sums are added in a different order), then call the optimizer's
+        //step(). The master's gradients are added to, not replaced, so zero them before as usual.
+        //IN: a batch*inputs Matrixf, the batch*labels Matrixf, metrics to add the outputs of the batch to (optional)
+        //OUT: the loss summed over the batch
+        float trainStep(const Matrixf& inputs, const Matrixf& labels, metrics::Metrics* stats = nullptr)
+        {
+            assert(labels.rows == inputs.rows);
+            int n = numWorkers();
+            syncWeights();
+            for (int w = 0; w < n; w++) {
+                worker& wk = workers[w];
+                int lo = (int)((long long)inputs.rows * w / n), hi = (int)((long long)inputs.rows * (w + 1) / n);
+                wk.rows = hi - lo;
+                if (wk.rows == 0) continue;
+                copyRows(inputs, lo, hi, wk.inputs);
+                copyRows(labels, lo, hi, wk.labels);
+            }
+
+            //each worker on its own thread; the kernels inside its passes split their work across the pool, so idle pool threads help
+            threads->run([&](int w) {
+                worker& wk = workers[w];
+                wk.loss = 0;
+                if (wk.rows == 0) return;
+                Network& net = *wk.net;
+                net.forward(wk.inputs);
+                const Matrixf& out = *net.batchOutput;
+                wk.loss = net.lossFunc.lossSum(out.rows, out.cols, out.nums.data(), wk.labels.nums.data());
+                net.backward(wk.labels);
+            });
+
+            reduceGradients();
+            float loss = 0;
+            for (int w = 0; w < n; w++) {
+                worker& wk = workers[w];
+                loss += wk.loss;
+                if (stats && wk.rows > 0) stats->add(&wk.net->lossFunc, *wk.net->batchOutput, wk.labels);
+                if (w == 0) continue;
+                for (size_t i = 0; i < master.layers.size(); i++) {
+                    master.layers[i]->batchSize += wk.net->layers[i]->batchSize;
+                    wk.net->layers[i]->batchSize = 0;
+                }
+            }
+            return loss;
+        }
+    protected:
+        static void copyRows(const Matrixf& m, int lo, int hi, Matrixf& out)
+        {
+            if (out.rows != hi - lo || out.cols != m.cols) out = Matrixf(hi - lo, m.cols);
+            std::copy(m.nums.begin() + (size_t)lo * m.cols, m.nums.begin() + (size_t)hi * m.cols, out.nums.begin());
+        }
+
+        //copy the master's weights (changed by the last optimizer step) into the replicas
+        void syncWeights()
+        {
+            const std::vector<ILayer::param>& src = workers[0].params;
+            for (size_t w = 1; w < workers.size(); w++) {
+                for (size_t p = 0; p < src.size(); p++) {
+                    std::copy(src[p].value, src[p].value + src[p].size, workers[w].params[p].value);
+                }
+            }
+        }
+
+        //Add the gradient sums of all workers into worker 0's (the master's) in a binary tree: in round s = 1, 2, 4, ...
+        //worker w += worker w + s for all w that are multiples of 2s, so each element is summed in the same order every time.
+        //The replicas' sums are zeroed for the next step. Parallel over chunks of the elements.
+        void reduceGradients()
+        {
+            int n = numWorkers();
+            if (n == 1) return;
+            for (size_t p = 0; p < workers[0].params.size(); p++) {
+                int size = (int)workers[0].params[p].size;
+                lin::parallel::parallelFor(size, 4096, [&](int lo, int hi) {
+                    for (int s = 1; s < n; s *= 2) {
+                        for (int w = 0; w + s < n; w += 2 * s) {
+                            float* a = workers[w].params[p].grad + lo;
+                            lin::kernels::add(hi - lo, a, workers[w + s].params[p].grad + lo, a);
+                        }
+                    }
+                    for (int w = 1; w < n; w++) { std::fill(workers[w].params[p].grad + lo, workers[w].params[p].grad + hi, 0.f); }
+                }, 16);
+            }
+        }
+    };
+
+    //Asynchronous lock-free SGD (Hogwild!). Each worker loops: take the next batch from the shared data loader (the only lock), copy
+    //the master's current weights into its replica, run forward and backward there, and subtract learnRate/batch times the gradients
+    //from the master's weights. The writes of different workers race on purpose: an update may be lost or based on weights that
+    //changed meanwhile, which costs little when the updates are small and touch few of the same weights. Only nonzero gradient
+    //elements are written, so sparse inputs (the blank pixels of MNIST) keep the workers off each other's cache lines.
+    //optim::SGD isn't used: there are no global steps; gradient sums and batch sizes of the master stay untouched.
+    class Hogwild
+    {
+    protected:
+        struct worker
+        {
+            std::unique_ptr<Network> net; //replica: private activations and gradient sums
+            std::vector<ILayer::param> params;
+            Matrixf inputs, labels;
+            metrics::Metrics stats;
+            long long samples = 0;
+        };
+        Network& master;
+        std::vector<ILayer::param> masterParams;
+        std::vector<worker> workers;
+        std::unique_ptr<WorkerThreads> threads;
+    public:
+        //A flat master (Network::flattenParams()) gets flat replicas, so each copy and update is one pass over one buffer.
+        //IN: network (must outlive the trainer; all layers must implement ILayer::clone()), number of worker threads (0: one per
+        //thread of the pool, see linalg::parallel::numThreads())
+        Hogwild(Network& net, int numWorkers = 0) : master(net)
+        {
+            if (numWorkers <= 0) numWorkers = lin::parallel::numThreads();
+            workers.resize(numWorkers);
+            master.params(masterParams);
+            for (worker& wk : workers) {
+                std::vector<ILayer*> layers;
+                func::ALossFunction* loss = nullptr;
+                try {
+                    for (ILayer* l : master.layers) { layers.push_back(l->clone()); }
+                    loss = master.lossFunc.clone();
+                }
+                catch (...) {
+                    for (ILayer* l : layers) delete l;
+                    throw;
+                }
+                wk.net.reset(new Network(layers, loss));
+                if (master.flat()) wk.net->flattenParams();
+                wk.net->params(wk.params);
+                if (wk.params.size() != masterParams.size()) throw std::runtime_error("Hogwild: a replica has different parameters");
+            }
+            threads.reset(new WorkerThreads(numWorkers));
+        }
+
+        int numWorkers() const { return (int)workers.size(); }
+
+        //Train on the batches of a loader until its end is reached (one epoch from where it stands). Batches have loader.batchSize
+        //items; small ones (1 to 16) give the most frequent updates.
+        //IN: data loader, learning rate, metrics to add the outputs of all batches to (optional)
+        //OUT: the number of samples trained on
+        long long trainEpoch(data::DataLoader& loader, float learnRate, metrics::Metrics* stats = nullptr)
+        {
+            std::mutex loaderMutex;
+            bool done = false;
+            for (worker& wk : workers) {
+                wk.samples = 0;
+                wk.stats = metrics::Metrics(stats ? stats->numClasses : 0);
+            }
+            //each worker loops on its own thread (WorkerThreads); as a pool task, a worker's loop could be picked up by another worker
+            //waiting for its kernels, stalling that worker until the end of the epoch
+            threads->run([&](int w) {
+                worker& wk = workers[w];
+                Network& net = *wk.net;
+                while (true) {
+                    {
+                        std::lock_guard<std::mutex> lock(loaderMutex);
+                        //endReached() restarts a looping loader when called after the end, so it's asked until it says yes once
+                        if (done || loader.endReached()) {
+                            done = true;
+                            break;
+                        }
+                        data::Batch bat = loader.next();
+                        data::toMatrices(bat, wk.inputs, wk.labels);
+                    }
+                    //racy reads: the copy may mix weights from before and after another worker's update
+                    for (size_t p = 0; p < masterParams.size(); p++) {
+                        std::copy(masterParams[p].value, masterParams[p].value + masterParams[p].size, wk.params[p].value);
+                    }
+                    net.forward(wk.inputs);
+                    if (stats) wk.stats.add(&net.lossFunc, *net.batchOutput, wk.labels);
+                    net.backward(wk.labels);
+                    apply(wk, learnRate / wk.inputs.rows);
+                    wk.samples += wk.inputs.rows;
+                }
+            });
+            long long samples = 0;
+            for (worker& wk : workers) {
+                samples += wk.samples;
+                if (stats) stats->add(wk.stats);
+            }
+            return samples;
+        }
+    protected:
+        //master -= scale * the worker's gradient sums, written where they are nonzero, which zeroes them for the next batch
+        void apply(worker& wk, float scale)
+        {
+            for (size_t p = 0; p < masterParams.size(); p++) {
+                float* v = masterParams[p].value;
+                float* g = wk.params[p].grad;
+                for (size_t i = 0; i < masterParams[p].size; i++) {
+                    if (g[i] != 0.f) {
+                        v[i] -= scale * g[i];
+                        g[i] = 0.f;
+                    }
+                }
+            }
+            for (ILayer* l : wk.net->layers) { l->batchSize = 0; }
+        }
+    };
+}
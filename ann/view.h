@@ -0,0 +1,112 @@
+#pragma once
+#include <cassert>
+#include <type_traits>
+
+//Non-owning views into the storage of a Matrix or Vector (or any other buffer): a pointer plus shape and strides.
+//Transposing, reshaping and slicing a view only changes those numbers, nothing is copied.
+//A view of a const Matrix has a const element type, e.g. MatrixView<const float>.
+//Views don't keep the storage alive, so they must not outlive the Matrix/Vector they point into.
+namespace linalg
+{
+    template <class T>
+    class VectorView;
+
+    //rows*cols matrix, element (i, j) is at data[i * rowStride + j * colStride]
+    template <class T>
+    class MatrixView
+    {
+    public:
+        T* data;
+        int rows;
+        int cols;
+        int rowStride;
+        int colStride;
+    public:
+        MatrixView(T* ptr, int m, int n, int rs = -1, int cs = 1)
+        {
+            data = ptr;
+            rows = m;
+            cols = n;
+            rowStride = rs == -1 ? n : rs;
+            colStride = cs;
+        }
+        //a view of non-const elements can be used as a view of const elements
+        template <class U, class = typename std::enable_if<std::is_same<const U, T>::value>::type>
+        MatrixView(const MatrixView<U>& v)
+        {
+            data = v.data;
+            rows = v.rows;
+            cols = v.cols;
+            rowStride = v.rowStride;
+            colStride = v.colStride;
+        }
+
+        int size() const { return rows * cols; }
+        //true if the elements are stored row after row without gaps, like in a Matrix
+        bool contiguous() const { return colStride == 1 && (rowStride == cols || rows == 1); }
+
+        T& operator () (int i, int j) const { return data[(size_t)i * rowStride + (size_t)j * colStride]; }
+
+        MatrixView transposed() const { return MatrixView(data, cols, rows, colStride, rowStride); }
+        //Same elements as an m*n matrix (n = -1: size / m). Only possible for contiguous views.
+        MatrixView reshaped(int m, int n = -1) const
+        {
+            assert(contiguous());
+            if (n == -1) n = size() / m;
+            assert(m * n == size());
+            return MatrixView(data, m, n);
+        }
+        //the m*n block starting at element (r, c)
+        MatrixView block(int r, int c, int m, int n) const { return MatrixView(&(*this)(r, c), m, n, rowStride, colStride); }
+        VectorView<T> row(int i) const { return VectorView<T>(&(*this)(i, 0), cols, colStride); }
+        VectorView<T> col(int j) const { return VectorView<T>(&(*this)(0, j), rows, rowStride); }
+        //All elements as one vector. Only possible for contiguous views.
+        VectorView<T> asVector() const
+        {
+            assert(contiguous());
+            return VectorView<T>(data, size());
+        }
+    };
+
+    //vector of n elements, element i is at data[i * stride]
+    template <class T>
+    class VectorView
+    {
+    public:
+        T* data;
+        int n;
+        int stride;
+    public:
+        VectorView(T* ptr, int s, int st = 1)
+        {
+            data = ptr;
+            n = s;
+            stride = st;
+        }
+        template <class U, class = typename std::enable_if<std::is_same<const U, T>::value>::type>
+        VectorView(const VectorView<U>& v)
+        {
+            data = v.data;
+            n = v.n;
+            stride = v.stride;
+        }
+
+        int size() const { return n; }
+        bool contiguous() const { return stride == 1 || n <= 1; }
+
+        T& operator [] (int i) const { return data[(size_t)i * stride]; }
+
+        //count elements starting at start
+        VectorView slice(int start, int count) const { return VectorView(&(*this)[start], count, stride); }
+        //The vector as a m*n matrix, by default a single row (like Vector::asMatrix). Only possible for contiguous views.
+        MatrixView<T> asMatrix(int m = 1, int n_ = -1) const
+        {
+            assert(contiguous());
+            if (n_ == -1) n_ = n / m;
+            assert(m * n_ == n);
+            return MatrixView<T>(data, m, n_);
+        }
+        //the vector as a single column (like Vector::transposed)
+        MatrixView<T> transposed() const { return MatrixView<T>(data, n, 1, stride, 1); }
+    };
+}